@@ -0,0 +1,238 @@
+/*
+ * include/atomic.h
+ *
+ * 2016-01-01  written by Hoyleeson <hoyleeson@gmail.com>
+ *	Copyright (C) 2015-2016 by Hoyleeson.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; version 2.
+ *
+ */
+
+#ifndef _ANZZC_ATOMIC_H
+#define _ANZZC_ATOMIC_H
+
+#include "bitops.h"
+
+/*
+ * Lock-free atomics on top of the GCC __atomic builtins, following the
+ * kernel conventions:
+ *
+ * - atomic_get/set/inc/dec/add/sub are unordered (relaxed).
+ * - the operations returning a value (*_return, *_and_test) are fully
+ *   ordered. _relaxed, _acquire and _release variants are provided.
+ * - atomic_get_acquire() and atomic_set_release() pair up to publish
+ *   data through a counter.
+ */
+
+typedef struct {
+    int counter;
+} atomic_t;
+
+typedef struct {
+    long counter;
+} atomic_long_t;
+
+#define ATOMIC_INIT(i)          { (i) }
+#define ATOMIC_LONG_INIT(i)     { (i) }
+
+/* full barrier, e.g. between a relaxed store and a later load */
+#define smp_mb()    __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#define __ATOMIC_OPS(prefix, type, ctype)                                   \
+static inline void prefix##_init(type *v, ctype i)                          \
+{                                                                           \
+    __atomic_store_n(&v->counter, i, __ATOMIC_RELAXED);                     \
+}                                                                           \
+static inline void prefix##_set(type *v, ctype i)                           \
+{                                                                           \
+    __atomic_store_n(&v->counter, i, __ATOMIC_RELAXED);                     \
+}                                                                           \
+static inline void prefix##_set_release(type *v, ctype i)                   \
+{                                                                           \
+    __atomic_store_n(&v->counter, i, __ATOMIC_RELEASE);                     \
+}                                                                           \
+static inline ctype prefix##_get(const type *v)                             \
+{                                                                           \
+    return __atomic_load_n(&v->counter, __ATOMIC_RELAXED);                  \
+}                                                                           \
+static inline ctype prefix##_get_acquire(const type *v)                     \
+{                                                                           \
+    return __atomic_load_n(&v->counter, __ATOMIC_ACQUIRE);                  \
+}                                                                           \
+static inline void prefix##_add(ctype i, type *v)                           \
+{                                                                           \
+    __atomic_fetch_add(&v->counter, i, __ATOMIC_RELAXED);                   \
+}                                                                           \
+static inline void prefix##_sub(ctype i, type *v)                           \
+{                                                                           \
+    __atomic_fetch_sub(&v->counter, i, __ATOMIC_RELAXED);                   \
+}                                                                           \
+static inline void prefix##_inc(type *v)                                    \
+{                                                                           \
+    __atomic_fetch_add(&v->counter, 1, __ATOMIC_RELAXED);                   \
+}                                                                           \
+static inline void prefix##_dec(type *v)                                    \
+{                                                                           \
+    __atomic_fetch_sub(&v->counter, 1, __ATOMIC_RELAXED);                   \
+}                                                                           \
+__ATOMIC_RETURN_OPS(prefix, type, ctype, , __ATOMIC_SEQ_CST)                \
+__ATOMIC_RETURN_OPS(prefix, type, ctype, _relaxed, __ATOMIC_RELAXED)        \
+__ATOMIC_RETURN_OPS(prefix, type, ctype, _acquire, __ATOMIC_ACQUIRE)        \
+__ATOMIC_RETURN_OPS(prefix, type, ctype, _release, __ATOMIC_RELEASE)        \
+static inline int prefix##_inc_and_test(type *v)                            \
+{                                                                           \
+    return prefix##_add_return(1, v) == 0;                                  \
+}                                                                           \
+static inline int prefix##_dec_and_test(type *v)                            \
+{                                                                           \
+    return prefix##_sub_return(1, v) == 0;                                  \
+}                                                                           \
+static inline ctype prefix##_cmpxchg(type *v, ctype old, ctype new)        \
+{                                                                           \
+    __atomic_compare_exchange_n(&v->counter, &old, new, 0,                  \
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);        \
+    return old;                                                             \
+}                                                                           \
+static inline ctype prefix##_xchg(type *v, ctype new)                      \
+{                                                                           \
+    return __atomic_exchange_n(&v->counter, new, __ATOMIC_SEQ_CST);         \
+}
+
+#define __ATOMIC_RETURN_OPS(prefix, type, ctype, order, memorder)           \
+static inline ctype prefix##_add_return##order(ctype i, type *v)            \
+{                                                                           \
+    return __atomic_add_fetch(&v->counter, i, memorder);                    \
+}                                                                           \
+static inline ctype prefix##_sub_return##order(ctype i, type *v)            \
+{                                                                           \
+    return __atomic_sub_fetch(&v->counter, i, memorder);                    \
+}                                                                           \
+static inline ctype prefix##_inc_return##order(type *v)                     \
+{                                                                           \
+    return __atomic_add_fetch(&v->counter, 1, memorder);                    \
+}                                                                           \
+static inline ctype prefix##_dec_return##order(type *v)                     \
+{                                                                           \
+    return __atomic_sub_fetch(&v->counter, 1, memorder);                    \
+}
+
+__ATOMIC_OPS(atomic, atomic_t, int)
+__ATOMIC_OPS(atomic_long, atomic_long_t, long)
+
+#undef __ATOMIC_OPS
+#undef __ATOMIC_RETURN_OPS
+
+/**
+ * set_bit - Atomically set a bit in memory
+ * @nr: the bit to set
+ * @addr: the address to start counting from
+ *
+ * This function is atomic but is not ordered against other memory
+ * accesses. See __set_bit() if you do not require the atomic guarantees.
+ */
+static inline void set_bit(int nr, volatile unsigned long *addr)
+{
+    __atomic_fetch_or(addr + BIT_WORD(nr), BIT_MASK(nr), __ATOMIC_RELAXED);
+}
+
+/**
+ * clear_bit - Clears a bit in memory
+ * @nr: Bit to clear
+ * @addr: Address to start counting from
+ *
+ * clear_bit() is atomic but is not ordered, use clear_bit_unlock() if
+ * it releases something.
+ */
+static inline void clear_bit(int nr, volatile unsigned long *addr)
+{
+    __atomic_fetch_and(addr + BIT_WORD(nr), ~BIT_MASK(nr), __ATOMIC_RELAXED);
+}
+
+/**
+ * clear_bit_unlock - Clears a bit in memory with release semantics
+ * @nr: Bit to clear
+ * @addr: Address to start counting from
+ *
+ * The memory accesses before it can't be reordered after it.
+ */
+static inline void clear_bit_unlock(int nr, volatile unsigned long *addr)
+{
+    __atomic_fetch_and(addr + BIT_WORD(nr), ~BIT_MASK(nr), __ATOMIC_RELEASE);
+}
+
+/**
+ * change_bit - Toggle a bit in memory
+ * @nr: Bit to change
+ * @addr: Address to start counting from
+ *
+ * change_bit() is atomic but is not ordered.
+ */
+static inline void change_bit(int nr, volatile unsigned long *addr)
+{
+    __atomic_fetch_xor(addr + BIT_WORD(nr), BIT_MASK(nr), __ATOMIC_RELAXED);
+}
+
+/**
+ * test_and_set_bit - Set a bit and return its old value
+ * @nr: Bit to set
+ * @addr: Address to count from
+ *
+ * This operation is atomic and implies a full memory barrier.
+ */
+static inline int test_and_set_bit(int nr, volatile unsigned long *addr)
+{
+    unsigned long mask = BIT_MASK(nr);
+
+    return !!(__atomic_fetch_or(addr + BIT_WORD(nr), mask,
+                                __ATOMIC_SEQ_CST) & mask);
+}
+
+/**
+ * test_and_set_bit_lock - Set a bit and return its old value, for locking
+ * @nr: Bit to set
+ * @addr: Address to count from
+ *
+ * Acquire semantics: the memory accesses after it can't be reordered
+ * before it. Pairs with clear_bit_unlock().
+ */
+static inline int test_and_set_bit_lock(int nr, volatile unsigned long *addr)
+{
+    unsigned long mask = BIT_MASK(nr);
+
+    return !!(__atomic_fetch_or(addr + BIT_WORD(nr), mask,
+                                __ATOMIC_ACQUIRE) & mask);
+}
+
+/**
+ * test_and_clear_bit - Clear a bit and return its old value
+ * @nr: Bit to clear
+ * @addr: Address to count from
+ *
+ * This operation is atomic and implies a full memory barrier.
+ */
+static inline int test_and_clear_bit(int nr, volatile unsigned long *addr)
+{
+    unsigned long mask = BIT_MASK(nr);
+
+    return !!(__atomic_fetch_and(addr + BIT_WORD(nr), ~mask,
+                                 __ATOMIC_SEQ_CST) & mask);
+}
+
+/**
+ * test_and_change_bit - Change a bit and return its old value
+ * @nr: Bit to change
+ * @addr: Address to count from
+ *
+ * This operation is atomic and implies a full memory barrier.
+ */
+static inline int test_and_change_bit(int nr, volatile unsigned long *addr)
+{
+    unsigned long mask = BIT_MASK(nr);
+
+    return !!(__atomic_fetch_xor(addr + BIT_WORD(nr), mask,
+                                 __ATOMIC_SEQ_CST) & mask);
+}
+
+#endif
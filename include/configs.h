@@ -23,6 +23,7 @@ extern "C" {
 void exec_daemons(void);
 void exec_commands(void);
 int init_configs(const char *fname);
+const char *config_val_find_by_key(const char *key);
 
 #ifdef __cplusplus
 }
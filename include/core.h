@@ -56,6 +56,12 @@
 #define PAGE_SIZE 	(4*1024)
 #endif
 
+#ifndef L1_CACHE_BYTES
+#define L1_CACHE_BYTES 	(64)
+#endif
+
+#define ____cacheline_aligned 	__attribute__((__aligned__(L1_CACHE_BYTES)))
+
 #define __ALIGN_COMMON(x, a)		__ALIGN_COMMON_MASK(x, (typeof(x))(a) - 1)
 #define __ALIGN_COMMON_MASK(x, mask)	(((x) + (mask)) & ~(mask))
 
@@ -18,6 +18,7 @@
 #include "types.h"
 #include "packet.h"
 #include "poller.h"
+#include "timer.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -27,6 +28,34 @@ extern "C" {
 typedef struct iohandler iohandler_t;
 typedef struct ioasync ioasync_t;
 
+/* edge-triggered read budget per wakeup, see iohandler_set_edge_triggered() */
+#define IOHANDLER_DEF_READ_BUDGET   (64 * 1024)
+#define IOHANDLER_DEF_READ_PACKETS  (64)
+
+/* iohandler_create()/iohandler_udp_create() dispatch flags */
+#define IOHANDLER_DISPATCH_DEFERRED (0)         /* handle on a worker thread */
+#define IOHANDLER_DISPATCH_INLINE   (1 << 0)    /* handle on the reactor thread */
+
+/* datagrams per syscall, see iohandler_udp_set_batch() */
+#define IOHANDLER_DEF_MMSG_BATCH    (32)
+#define IOHANDLER_MMSG_MAX          (64)
+
+/* connections per accept_batch callback, see iohandler_accept_batch_create() */
+#define IOHANDLER_ACCEPT_BATCH      (64)
+#define IOHANDLER_DEF_BACKLOG       SOMAXCONN
+
+/* iohandler_accept_batch_create() flags */
+#define IOHANDLER_ACCEPT_SPREAD     (1 << 0)    /* hand fds to their reactor */
+
+/* iohandler_set_watermarks() flags */
+#define IOHANDLER_WM_BLOCK          (1 << 0)    /* wait instead of -EAGAIN */
+
+/* how ioasync_create() spreads new iohandlers over its reactors */
+enum ioasync_policy {
+    IOASYNC_POLICY_FD_HASH,         /* reactor = fd % nr_reactors */
+    IOASYNC_POLICY_LEAST_LOADED,    /* reactor owning the fewest handlers */
+};
+
 #if 0
 typedef void (*handle_func) (void *priv, uint8_t *data, int len);
 typedef void (*handlefrom_func) (void *priv, uint8_t *data, int len,
@@ -36,31 +65,62 @@ typedef void (*close_func) (void  *priv);
 #endif
 
 pack_buf_t *iohandler_pack_buf_alloc(iohandler_t *ioh);
+pack_buf_t *iohandler_pack_buf_alloc_size(iohandler_t *ioh, int size);
 void iohandler_pack_buf_free(pack_buf_t *pkb);
 
 
-void iohandler_send(iohandler_t *ioh, const uint8_t *data, int len);
-void iohandler_sendto(iohandler_t *ioh, const uint8_t *data, int len,
-                      struct sockaddr *to);
+int iohandler_send(iohandler_t *ioh, const uint8_t *data, int len);
+int iohandler_sendto(iohandler_t *ioh, const uint8_t *data, int len,
+                     struct sockaddr *to);
 
-void iohandler_pkt_send(iohandler_t *ioh, pack_buf_t *pkb);
-void iohandler_pkt_sendto(iohandler_t *ioh, pack_buf_t *pkb,
-                          struct sockaddr *to);
+int iohandler_pkt_send(iohandler_t *ioh, pack_buf_t *pkb);
+int iohandler_pkt_sendto(iohandler_t *ioh, pack_buf_t *pkb,
+                         struct sockaddr *to);
+
+int iohandler_pkt_forward(iohandler_t *to, pack_buf_t *pkb);
+int iohandler_pkt_forwardto(iohandler_t *to, pack_buf_t *pkb,
+                            struct sockaddr *addr);
 
 iohandler_t *iohandler_create(ioasync_t *aio, int fd,
-                              void (*handle)(void *, uint8_t *, int), void (*close)(void *), void *priv);
+                              void (*handle)(void *, uint8_t *, int), void (*close)(void *), void *priv,
+                              int flags);
+
+iohandler_t *iohandler_pkb_create(ioasync_t *aio, int fd,
+                                  void (*handle_pkb)(void *, pack_buf_t *),
+                                  void (*close)(void *), void *priv, int flags);
 
 iohandler_t *iohandler_accept_create(ioasync_t *aio, int fd,
                                      void (*accept)(void *, int), void (*close)(void *), void *priv);
 
+iohandler_t *iohandler_accept_batch_create(ioasync_t *aio, int fd,
+                                           void (*accept_batch)(void *, int *, int),
+                                           void (*close)(void *), void *priv,
+                                           int backlog, int flags);
+
 iohandler_t *iohandler_udp_create(ioasync_t *aio, int fd,
                                   void (*handlefrom)(void *, uint8_t *, int, void *),
-                                  void (*close)(void *), void *priv);
+                                  void (*close)(void *), void *priv, int flags);
+
+iohandler_t *iohandler_udp_pkb_create(ioasync_t *aio, int fd,
+                                      void (*handlefrom_pkb)(void *, pack_buf_t *, void *),
+                                      void (*close)(void *), void *priv, int flags);
+
+void iohandler_set_edge_triggered(iohandler_t *ioh, int budget,
+                                  int max_packets);
+int iohandler_udp_set_batch(iohandler_t *ioh, int batch);
+
+void iohandler_set_watermarks(iohandler_t *ioh, int high_bytes, int low_bytes,
+                              int high_packets, int low_packets, int flags);
+void iohandler_set_writable_cb(iohandler_t *ioh, void (*on_writable)(void *));
+void iohandler_init_timer(iohandler_t *ioh, struct timer_list *timer);
+void iohandler_pause_read(iohandler_t *ioh);
+void iohandler_resume_read(iohandler_t *ioh);
 
 void iohandler_shutdown(iohandler_t *ioh);
 
+ioasync_t *ioasync_create(int nr_reactors, int policy, int backend);
 ioasync_t *ioasync_init(void);
-//void ioasync_loop(ioasync_t *aio);
+int ioasync_reactor_count(ioasync_t *aio);
 void ioasync_release(ioasync_t *aio);
 
 void global_ioasync_init(void);
@@ -28,12 +28,22 @@ extern "C" {
 
 typedef struct mempool mempool_t;
 
+/* mempool_create_flags() flags */
+#define MEMPOOL_F_ARENA     (1 << 0)    /* grow in mmap'd slabs */
+#define MEMPOOL_F_HUGETLB   (1 << 1)    /* arena: try MAP_HUGETLB slabs */
+#define MEMPOOL_F_THP       (1 << 2)    /* arena: madvise(MADV_HUGEPAGE) */
+#define MEMPOOL_F_POPULATE  (1 << 3)    /* arena: pre-fault new slabs */
+
 mempool_t *mempool_create(int block_size, int init_count, int limited);
+mempool_t *mempool_create_flags(int block_size, int init_count, int limited,
+                                int flags);
 void mempool_release(mempool_t *pool);
 
 void *mempool_alloc(mempool_t *pool);
 void *mempool_zalloc(mempool_t *pool);
 void mempool_free(mempool_t *pool, void *buf);
+int mempool_alloc_bulk(mempool_t *pool, void **objs, int nr);
+void mempool_free_bulk(mempool_t *pool, void **objs, int nr);
 
 
 struct mem_head {
@@ -48,9 +58,16 @@ struct mem_item {
 
 #define IS_LIMIT 	(0)
 
+/* largest size served by the size classes of include/memsizes.h,
+ * bigger allocations are mapped from, and unmapped to, the OS.
+ * classes are multiples of 1 << MM_CLASS_SHIFT. */
+#define MM_CACHE_MAX_SIZE   (64 * 1024)
+#define MM_CLASS_SHIFT      (4)
+
 #define mem_entry(b) container_of(b, struct mem_item, data)
 
 int mem_cache_init(void);
+int size_to_index(int size);
 
 void *__mm_alloc(int size, int node);
 void __mm_free(void *ptr, int node);
@@ -70,12 +87,11 @@ static __always_inline void *mm_alloc(int size)
 			i++;
 #include "memsizes.h"
 #undef CACHE
-
-        return malloc(size);
-    } else {
-        i = -1;
     }
 
+    /* runtime size, or a large object */
+    i = -1;
+
 found:
     return __mm_alloc(size, i);
 }
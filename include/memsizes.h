@@ -1,9 +1,24 @@
-CACHE(32, 16)
-CACHE(64, 16)
-CACHE(96, 16)
-CACHE(128, 8)
-CACHE(192, 8)
-CACHE(256, 8)
-CACHE(512, 8)
+CACHE(16, 64)
+CACHE(32, 64)
+CACHE(48, 32)
+CACHE(64, 32)
+CACHE(96, 32)
+CACHE(128, 32)
+CACHE(192, 16)
+CACHE(256, 16)
+CACHE(384, 16)
+CACHE(512, 16)
+CACHE(768, 8)
 CACHE(1024, 8)
-
+CACHE(1536, 8)
+CACHE(2048, 8)
+CACHE(3072, 4)
+CACHE(4096, 4)
+CACHE(6144, 4)
+CACHE(8192, 4)
+CACHE(12288, 2)
+CACHE(16384, 2)
+CACHE(24576, 2)
+CACHE(32768, 2)
+CACHE(49152, 1)
+CACHE(65536, 1)
@@ -16,12 +16,15 @@
 #include <stdint.h>
 
 #include "list.h"
-#include "fake_atomic.h"
+#include "atomic.h"
 #include "mempool.h"
 #include "core.h"
 
 #define PACKET_MAX_PAYLOAD      (2000)
 
+/* size classes of a pack_buf_pool_t, see create_pack_buf_pool_sizes() */
+#define PACK_BUF_MAX_CLASSES    (8)
+
 typedef struct _pack_buf pack_buf_t;
 
 struct packet {
@@ -31,12 +34,24 @@ struct packet {
 
 
 typedef struct _pack_buf_pool {
-    mempool_t *pool;
+    int nr_classes;
+    /* payload size of each class, ascending */
+    int sizes[PACK_BUF_MAX_CLASSES];
+    mempool_t *pools[PACK_BUF_MAX_CLASSES];
 } pack_buf_pool_t;
 
+/*
+ * A buffer is one block of a size class. Data larger than the biggest
+ * class is held in a chain of buffers linked by @next; the head carries
+ * the reference count of the whole chain and @len of each segment is
+ * the data held by that segment only.
+ */
 struct _pack_buf {
     pack_buf_pool_t *owner;
-    fake_atomic_t refcount;
+    pack_buf_t *next;
+    atomic_t refcount;
+    int cls;
+    int size;   /* capacity of data */
 
     int len;
     uint8_t data[0];
@@ -48,17 +63,36 @@ struct _pack_buf {
 #define data_to_pack_buf(ptr) \
     node_to_item(ptr, pack_buf_t, data)
 
+/* total data length of the chain starting at @pkb */
+static inline int pack_buf_chain_len(const pack_buf_t *pkb)
+{
+    int len = 0;
+
+    for (; pkb; pkb = pkb->next)
+        len += pkb->len;
+    return len;
+}
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 
 pack_buf_pool_t *create_pack_buf_pool(int esize, int ecount);
+pack_buf_pool_t *create_pack_buf_pool_sizes(const int *sizes, int nr,
+                                            int ecount);
 void free_pack_buf_pool(pack_buf_pool_t *pool);
 
 pack_buf_t *pack_buf_alloc(pack_buf_pool_t *pool);
+pack_buf_t *pack_buf_alloc_size(pack_buf_pool_t *pool, int size);
+pack_buf_t *pack_buf_alloc_chain(pack_buf_pool_t *pool, int size);
+void pack_buf_trim(pack_buf_t *pkb, int len);
+int pack_buf_copy_in(pack_buf_t *pkb, const void *data, int len);
+int pack_buf_copy_out(const pack_buf_t *pkb, void *dst, int len);
+int pack_buf_alloc_bulk(pack_buf_pool_t *pool, pack_buf_t **pkbs, int nr);
 pack_buf_t *pack_buf_get(pack_buf_t *pkb);
 void pack_buf_free(pack_buf_t *pkb);
+void pack_buf_free_bulk(pack_buf_t **pkbs, int nr);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,44 @@
+/*
+ * include/placement.h
+ *
+ * 2016-01-01  written by Hoyleeson <hoyleeson@gmail.com>
+ *	Copyright (C) 2015-2016 by Hoyleeson.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; version 2.
+ *
+ */
+
+#ifndef _ANZZC_PLACEMENT_H
+#define _ANZZC_PLACEMENT_H
+
+#include <pthread.h>
+
+/*
+ * Classes of the threads started by the library.  The timers run on
+ * the global ioasync reactor, so they follow THREAD_CLASS_POLLER.
+ */
+enum {
+    THREAD_CLASS_WORKER,    /* workqueue workers, float on the cpu set */
+    THREAD_CLASS_POLLER,    /* ioasync reactors, pinned to one cpu each */
+
+    THREAD_CLASS_MAX,
+};
+
+/* thread names are cut to this, terminating nul included */
+#define THREAD_NAME_LEN     (16)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int thread_placement_set(int cls, const char *cpus, int fifo_prio);
+int thread_placement_load_configs(void);
+int thread_place(pthread_t thread, int cls, int index, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
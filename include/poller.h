@@ -13,9 +13,13 @@
 #ifndef _ANZZC_POLLER_H
 #define _ANZZC_POLLER_H
 
+#include <stdint.h>
 #include <pthread.h>
+#include <sys/epoll.h>
 
+#include "list.h"
 #include "wait.h"
+#include "mempool.h"
 
 /* A struct poller object is used to monitor activity on one or more
  * file descriptors (e.g sockets).
@@ -36,16 +40,40 @@
  * callback.
  */
 
-/* the current implementation uses Linux's epoll facility
+/* the current implementation uses Linux's epoll facility, or
+ * io_uring poll requests (see poller_init_backend()), where streams
+ * can also be read by multishot recvs (see poller_event_recv()).
  * the event mask we use are simply combinations of EPOLLIN
  * EPOLLOUT, EPOLLHUP and EPOLLERR
  */
 
+enum poller_backend {
+    POLLER_BACKEND_EPOLL,
+    POLLER_BACKEND_URING,   /* falls back to epoll if not supported */
+};
+
 /* the event handler function type, 'data' is a user-specific
  * opaque pointer passed to poller_add().
  */
 typedef void (*event_func)(void  *data, int  events);
 
+/* a multishot recv of a hook completed, see poller_event_recv().
+ * 'buf' is the cookie of the provided buffer holding the data, now
+ * owned by the handler (NULL if none), 'res' the byte count, 0 at end
+ * of stream or a negative errno.
+ */
+typedef void (*recv_func)(void *data, void *buf, int res);
+
+/* source of the provided buffers of the io_uring recv mode, see
+ * poller_recv_init(). get() returns the cookie of a new buffer and
+ * sets its address and size, or returns NULL. put() releases a buffer
+ * the handlers never got.
+ */
+struct poller_buf_ops {
+    void *(*get)(void *arg, void **addr, int *size);
+    void (*put)(void *arg, void *buf);
+};
+
 /* bit flags for the struct event_hook structure.
  *
  * HOOK_PENDING means that an event happened on the
@@ -53,10 +81,14 @@ typedef void (*event_func)(void  *data, int  events);
  *
  * HOOK_CLOSING is used to delay-close monitored
  * file descriptors.
+ *
+ * HOOK_READY means an edge-triggered file descriptor is
+ * still ready after its handler ran, see poller_event_pending().
  */
 enum {
     HOOK_PENDING = (1 << 0),
     HOOK_CLOSING = (1 << 1),
+    HOOK_READY   = (1 << 2),
 };
 
 
@@ -64,6 +96,10 @@ enum {
 #define EV_WRITE 	EPOLLOUT
 #define EV_ERROR 	EPOLLERR
 #define EV_HUP      EPOLLHUP
+/* enable it with the other events to monitor the fd in edge-triggered
+ * mode. The handler must then consume the fd until EAGAIN, or call
+ * poller_event_pending() for what it left behind. */
+#define EV_ET       EPOLLET
 
 /* A struct event_hook structure is used to monitor a given
  * file descriptor and record its event handler.
@@ -75,22 +111,94 @@ struct event_hook {
     int state;   /* see HOOK_XXX constants */
     void *data; /* user-provided handler parameter */
     event_func func; /* event handler callback */
+    int ready;   /* edge-triggered events left unconsumed by func */
+    struct list_head entry; /* on poller closing list once deleted */
+    struct list_head ready_entry; /* on poller ready list if HOOK_READY */
+    /* io_uring backend only */
+    recv_func recv; /* EV_READ served by multishot recvs, see poller_event_recv() */
+    uint64_t recv_token;  /* user_data of the recv in flight, 0 if none */
+    uint32_t recv_first;  /* generation of the first recv of the hook */
+    uint64_t token; /* user_data of the poll in flight, 0 if none */
+    unsigned int batch; /* last wait round that reported the hook */
+    int slot;   /* its index in poller events during that round */
+    struct list_head arm_entry; /* on rearm list once its poll completed */
 };
 
+/* the control commands (add/del/enable/disable) are posted to the
+ * loop thread through a bounded lock-free ring, see poller.c.
+ * must be a power of 2.
+ */
+#define POLLER_CTL_RING_SIZE    (4096)
+
+/* callback duration histogram: bucket 0 counts callbacks shorter than
+ * 1us, bucket n (n > 0) those in [2^(n-1), 2^n) us, the last one
+ * everything longer. */
+#define POLLER_HIST_BUCKETS     (24)
+
+/* event loop instrumentation, see poller_stats_snapshot().
+ * times are in nanoseconds. */
+struct poller_stats {
+    uint64_t loops;         /* poller_exec() iterations */
+    uint64_t waits;         /* epoll_wait() calls which returned events */
+    uint64_t events;        /* events returned by epoll_wait() */
+    uint64_t max_events;    /* largest single epoll_wait() batch */
+    uint64_t wait_ns;       /* blocked in epoll_wait() */
+    uint64_t busy_ns;       /* running callbacks and timers */
+
+    uint64_t callbacks;
+    uint64_t cb_hist[POLLER_HIST_BUCKETS];
+    uint64_t cb_max_ns;     /* slowest callback so far */
+    int cb_max_fd;
+    event_func cb_max_func;
+
+    uint64_t hooks_added;
+    uint64_t hooks_removed;
+    int num_fds;
+
+    uint64_t ctl_cmds;      /* control commands executed */
+    uint64_t ctl_max_batch; /* most commands drained at once */
+    unsigned long ctl_depth; /* commands queued at snapshot time */
+};
+
+struct poller_ctl_ring;
+struct poller_uring;
+struct timer_base;
+
 /* struct poller is the main object modeling a poller object
  */
 struct poller {
-    int epoll_fd;
+    int epoll_fd;   /* -1 when running on io_uring */
+    struct poller_uring *uring;
     int num_fds;
-    int max_fds;
+    int max_fds;    /* size of events */
 
     struct epoll_event *events;
-    struct event_hook *hooks;
-    int ctl_socks[2];
+
+    /* hooks never move once allocated, epoll data points to them.
+     * fdtab maps a fd to its hook for O(1) lookup. */
+    struct event_hook **fdtab;
+    int fdtab_size;
+    mempool_t *hook_pool;
+    struct event_hook *ctl_hook;
+    struct list_head closing_hooks;
+    struct list_head ready_hooks;   /* HOOK_READY hooks, run without waiting */
+    int ctl_fd;     /* eventfd doorbell of ctl_ring */
+    struct poller_ctl_ring *ctl_ring;
+    /* timers run on the loop thread, epoll_wait() sleeps until the
+     * earliest one. see poller_timer_base(). */
+    struct timer_base *timers;
     int running;
+    pthread_t thread;   /* thread running poller_loop() */
+
+    /* written by the loop thread only, read under stats_seq */
+    struct poller_stats stats;
+    /* recv callbacks run inside poller_wait(), not counted as waiting */
+    uint64_t wait_busy_ns;
+    unsigned int stats_seq;
+    int stats_reset;
+    struct list_head entry; /* on the list of live pollers */
 
     wait_queue_head_t waitq;
-    pthread_mutex_t lock;
 };
 
 
@@ -104,11 +212,23 @@ void poller_event_del(struct poller *l, int fd);
 void poller_event_enable(struct poller *l, int  fd, int  events);
 void poller_event_disable(struct poller *l, int  fd, int  events);
 void poller_event_signal(struct poller *l);
+void poller_event_call(struct poller *l, void (*func)(void *), void *arg);
+void poller_event_pending(struct poller *l, int fd, int events);
+void poller_event_recv(struct poller *l, int fd, recv_func func);
+int poller_recv_init(struct poller *l, const struct poller_buf_ops *ops,
+                     void *arg);
+struct timer_base *poller_timer_base(struct poller *l);
+
+int poller_stats_snapshot(struct poller *l, struct poller_stats *st);
+void poller_stats_reset(struct poller *l);
+uint64_t poller_stats_percentile(struct poller_stats *st, int pct);
+int poller_for_each(int (*fn)(struct poller *l, void *data), void *data);
 
 void poller_loop(struct poller *l);
 void poller_done(struct poller *l);
 
 int poller_init(struct poller *l);
+int poller_init_backend(struct poller *l, int backend);
 void poller_release(struct poller  *l);
 
 struct poller *poller_create(void);
@@ -43,7 +43,9 @@ void queue_release(struct queue *q);
 
 void queue_in(struct queue *q, struct packet *p);
 struct packet *queue_out(struct queue *q);
+int queue_out_many(struct queue *q, struct packet **pkts, int max);
 struct packet *queue_peek(struct queue *q);
+int queue_peek_many(struct queue *q, struct packet **pkts, int max);
 
 size_t queue_count(struct queue *q);
 void queue_clear(struct queue *q, void(*reclaim)(struct packet *p));
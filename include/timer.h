@@ -84,10 +84,16 @@ static inline void setup_timer(struct timer_list *timer,
 }
 
 void init_timer(struct timer_list *timer);
+void init_timer_on(struct timer_list *timer, struct timer_base *base);
 int add_timer(struct timer_list *timer);
 int del_timer(struct timer_list *timer);
 int mod_timer(struct timer_list *timer, unsigned long expires);
 
+struct timer_base *timer_base_create(void (*kick)(void *), void *data);
+void timer_base_release(struct timer_base *base);
+int timer_base_timeout(struct timer_base *base);
+void timer_base_run(struct timer_base *base);
+
 
 /* current time in milliseconds */
 static inline uint64_t curr_time_ms(void)
@@ -97,6 +103,14 @@ static inline uint64_t curr_time_ms(void)
     return tm.tv_sec * MSEC_PER_SEC + (tm.tv_nsec / NSEC_PER_MSEC);
 }
 
+/* current time in nanoseconds */
+static inline uint64_t curr_time_ns(void)
+{
+    struct timespec tm;
+    clock_gettime(CLOCK_MONOTONIC, &tm);
+    return tm.tv_sec * NSEC_PER_SEC + tm.tv_nsec;
+}
+
 /**
  * timer_pending - is a timer pending?
  * @timer: the timer in question
@@ -28,7 +28,7 @@ typedef signed long long s64;
 typedef unsigned long long u64;
 
 
-#ifdef CONFIG_64BIT
+#if defined(CONFIG_64BIT) || __SIZEOF_LONG__ == 8
 #define BITS_PER_LONG 64
 #else
 #define BITS_PER_LONG 32
@@ -13,9 +13,11 @@
 #ifndef _ANZZC_WORK_QUEUE_H
 #define _ANZZC_WORK_QUEUE_H
 
+#include <pthread.h>
+
 #include "list.h"
 #include "timer.h"
-#include "fake_atomic.h"
+#include "atomic.h"
 
 struct workqueue_struct;
 
@@ -48,7 +50,8 @@ enum {
 struct work_struct {
     struct list_head entry;
     work_func_t func;
-    fake_atomic_long_t data;
+    atomic_long_t data;
+    uint64_t queued_ns;     /* queue_work() time, see workqueue_stats */
 };
 
 struct delayed_work {
@@ -56,6 +59,57 @@ struct delayed_work {
     struct timer_list timer;
 };
 
+/* wait and run time histograms: bucket 0 counts works shorter than
+ * 1us, bucket n (n > 0) those in [2^(n-1), 2^n) us, the last one
+ * everything longer. */
+#define WQ_HIST_BUCKETS     (24)
+
+/*
+ * Workqueue instrumentation, see workqueue_stats_snapshot().  Times
+ * are in nanoseconds, the counters cover the time since the workqueue
+ * was allocated or its stats reset.
+ */
+struct workqueue_stats {
+    uint64_t queued;        /* works queued */
+    uint64_t done;          /* works which returned */
+    uint64_t elapsed_ns;    /* time covered by the counters */
+
+    uint64_t wait_hist[WQ_HIST_BUCKETS];    /* from queue_work() to start */
+    uint64_t wait_max_ns;
+
+    uint64_t exec_hist[WQ_HIST_BUCKETS];
+    uint64_t exec_ns;       /* total run time */
+    uint64_t exec_max_ns;   /* slowest work so far */
+    work_func_t exec_max_func;
+
+    /* at snapshot time */
+    int max_active;
+    int nr_active;          /* queued or running works */
+    int nr_delayed;         /* waiting for max_active */
+    int nr_busy;            /* workers running a work of the wq */
+    uint64_t longest_ns;    /* longest running of those works */
+    work_func_t longest_func;
+
+    /* the workers of all pools, shared by every workqueue */
+    int nr_workers;
+    int nr_idle;
+};
+
+/* max works a strand runs before yielding its worker, see strand_run() */
+#define STRAND_BATCH    (16)
+
+/*
+ * Serialized execution context on a shared workqueue: works queued
+ * with strand_queue_work() run one at a time, in order.
+ */
+struct strand {
+    struct workqueue_struct *wq;
+    struct work_struct run;
+    pthread_mutex_t lock;
+    struct list_head works;
+    int scheduled;
+};
+
 static inline struct delayed_work *to_delayed_work(struct work_struct *work)
 {
     return container_of(work, struct delayed_work, work);
@@ -94,7 +148,7 @@ static inline struct delayed_work *to_delayed_work(struct work_struct *work)
 
 #define INIT_WORK(_work, _func)                 \
     do {                                \
-        fake_atomic_long_init(&(_work)->data, 0);   \
+        atomic_long_init(&(_work)->data, 0);        \
         INIT_LIST_HEAD(&(_work)->entry);            \
         PREPARE_WORK((_work), (_func));             \
     } while (0)
@@ -111,7 +165,7 @@ static inline struct delayed_work *to_delayed_work(struct work_struct *work)
  * @work: The work item in question
  */
 #define work_pending(work) \
-    (!!(fake_atomic_long_get(&(work)->data) & WORK_STRUCT_PENDING_BIT))
+    (!!(atomic_long_get(&(work)->data) & WORK_STRUCT_PENDING))
 
 /**
  * delayed_work_pending - Find out whether a delayable work item is currently
@@ -127,10 +181,11 @@ static inline struct delayed_work *to_delayed_work(struct work_struct *work)
  * @work: The work item in question
  */
 #define work_clear_pending(work) \
-    fake_clear_bit(WORK_STRUCT_PENDING_BIT, work_data_bits(work))
+    clear_bit_unlock(WORK_STRUCT_PENDING_BIT, work_data_bits(work))
 
 
 struct workqueue_struct *alloc_workqueue(int max_active, unsigned int flags);
+void destroy_workqueue(struct workqueue_struct *wq);
 
 #define create_workqueue()	    \
     alloc_workqueue(1, 0)
@@ -146,6 +201,7 @@ enum {
     WQ_MEM_RECLAIM      = 1 << 3, /* may be used for memory reclaim */
     WQ_HIGHPRI      = 1 << 4, /* high priority */
     WQ_CPU_INTENSIVE    = 1 << 5, /* cpu instensive workqueue */
+    WQ_BACKGROUND       = 1 << 8, /* bulk, runs after the normal works */
 
     WQ_DRAINING     = 1 << 6, /* internal: workqueue is draining */
     WQ_RESCUER      = 1 << 7, /* internal: workqueue has rescuer */
@@ -154,6 +210,18 @@ enum {
     WQ_DFL_ACTIVE       = WQ_MAX_ACTIVE / 2,
 };
 
+/*
+ * Priority lanes of the worker pools.  The active works of a workqueue
+ * are queued on the lane its flags select, lanes are served in order.
+ */
+enum {
+    WQ_LANE_HIGH,       /* WQ_HIGHPRI */
+    WQ_LANE_NORMAL,
+    WQ_LANE_BACKGROUND, /* WQ_BACKGROUND */
+
+    WQ_NR_LANES,
+};
+
 
 extern struct workqueue_struct *global_wq;
 
@@ -162,9 +230,14 @@ extern "C" {
 #endif
 
 int queue_work(struct workqueue_struct *wq, struct work_struct *work);
+int queue_work_many(struct workqueue_struct *wq, struct work_struct **works,
+                    int nr, unsigned long *pending);
 int queue_delayed_work(struct workqueue_struct *wq,
                        struct delayed_work *work, unsigned long delay);
 
+void strand_init(struct strand *s, struct workqueue_struct *wq);
+int strand_queue_work(struct strand *s, struct work_struct *work);
+
 
 void flush_workqueue(struct workqueue_struct *wq);
 void drain_workqueue(struct workqueue_struct *wq);
@@ -185,6 +258,15 @@ bool cancel_delayed_work_sync(struct delayed_work *dwork);
 void workqueue_set_max_active(struct workqueue_struct *wq,
                               int max_active);
 bool workqueue_congested(unsigned int cpu, struct workqueue_struct *wq);
+int workqueue_lane_depth(int lane);
+
+int workqueue_stats_snapshot(struct workqueue_struct *wq,
+                             struct workqueue_stats *st);
+void workqueue_stats_reset(struct workqueue_struct *wq);
+uint64_t workqueue_stats_percentile(const uint64_t *hist, uint64_t max_ns,
+                                    int pct);
+int workqueue_for_each(int (*fn)(struct workqueue_struct *wq, void *data),
+                       void *data);
 unsigned int work_busy(struct work_struct *work);
 
 int init_workqueues(void);
@@ -20,6 +20,8 @@
 #include <config.h>
 #include <include/log.h>
 #include <include/cmds.h>
+#include <include/poller.h>
+#include <include/workqueue.h>
 
 cmd_tbl_t *get_static_cmd_list(void);
 
@@ -77,6 +79,100 @@ int do_loglevel(int argc, char **argv)
     return 0;
 }
 
+static int show_poller_stats(struct poller *l, void *data)
+{
+    int *index = (int *)data;
+    struct poller_stats st;
+    uint64_t total;
+
+    poller_stats_snapshot(l, &st);
+    total = st.wait_ns + st.busy_ns;
+
+    printf("poller %d: fds %d, hooks +%llu/-%llu, ctl queued %lu, "
+           "ctl done %llu (max batch %llu)\n", (*index)++, st.num_fds,
+           (unsigned long long)st.hooks_added,
+           (unsigned long long)st.hooks_removed, st.ctl_depth,
+           (unsigned long long)st.ctl_cmds,
+           (unsigned long long)st.ctl_max_batch);
+    printf("\tloops %llu, events %llu (%.1f per wait, max %llu), "
+           "blocked %.1f%%\n", (unsigned long long)st.loops,
+           (unsigned long long)st.events,
+           st.waits ? (double)st.events / st.waits : 0.0,
+           (unsigned long long)st.max_events,
+           total ? 100.0 * st.wait_ns / total : 0.0);
+    printf("\tcallbacks %llu, p50 %lluus, p99 %lluus, max %lluus "
+           "(fd %d, func %p)\n", (unsigned long long)st.callbacks,
+           (unsigned long long)poller_stats_percentile(&st, 50) / 1000,
+           (unsigned long long)poller_stats_percentile(&st, 99) / 1000,
+           (unsigned long long)st.cb_max_ns / 1000,
+           st.cb_max_fd, st.cb_max_func);
+    return 0;
+}
+
+static int reset_poller_stats(struct poller *l, void *data)
+{
+    poller_stats_reset(l);
+    return 0;
+}
+
+static int do_poller(int argc, char **argv)
+{
+    int index = 0;
+
+    if (argc > 1 && !strcmp(argv[1], "-r"))
+        return poller_for_each(reset_poller_stats, NULL);
+
+    return poller_for_each(show_poller_stats, &index);
+}
+
+static int show_workqueue_stats(struct workqueue_struct *wq, void *data)
+{
+    int *index = (int *)data;
+    struct workqueue_stats st;
+
+    workqueue_stats_snapshot(wq, &st);
+
+    printf("workqueue %d: active %d/%d, delayed %d, busy workers %d "
+           "(longest %lluus, func %p)\n", (*index)++, st.nr_active,
+           st.max_active, st.nr_delayed, st.nr_busy,
+           (unsigned long long)st.longest_ns / 1000, st.longest_func);
+    printf("\tqueued %llu, done %llu, %.1f works/s, workers %d (%d idle)\n",
+           (unsigned long long)st.queued, (unsigned long long)st.done,
+           st.elapsed_ns ? st.done * 1e9 / st.elapsed_ns : 0.0,
+           st.nr_workers, st.nr_idle);
+    printf("\twait p50 %lluus, p99 %lluus, max %lluus\n",
+           (unsigned long long)workqueue_stats_percentile(st.wait_hist,
+                   st.wait_max_ns, 50) / 1000,
+           (unsigned long long)workqueue_stats_percentile(st.wait_hist,
+                   st.wait_max_ns, 99) / 1000,
+           (unsigned long long)st.wait_max_ns / 1000);
+    printf("\texec p50 %lluus, p99 %lluus, max %lluus (func %p), "
+           "total %llums\n",
+           (unsigned long long)workqueue_stats_percentile(st.exec_hist,
+                   st.exec_max_ns, 50) / 1000,
+           (unsigned long long)workqueue_stats_percentile(st.exec_hist,
+                   st.exec_max_ns, 99) / 1000,
+           (unsigned long long)st.exec_max_ns / 1000, st.exec_max_func,
+           (unsigned long long)st.exec_ns / 1000000);
+    return 0;
+}
+
+static int reset_workqueue_stats(struct workqueue_struct *wq, void *data)
+{
+    workqueue_stats_reset(wq);
+    return 0;
+}
+
+static int do_workqueue(int argc, char **argv)
+{
+    int index = 0;
+
+    if (argc > 1 && !strcmp(argv[1], "-r"))
+        return workqueue_for_each(reset_workqueue_stats, NULL);
+
+    return workqueue_for_each(show_workqueue_stats, &index);
+}
+
 /*******************************************************/
 
 #define CONSOLE_CMD_END() \
@@ -88,6 +184,8 @@ static cmd_tbl_t cmd_tbl_list[] = {
     CONSOLE_CMD(exit,       do_exit,        "Exit program.\n\t-f:exit program force."),
     CONSOLE_CMD(quit,       do_quit,        "Exit program.\n\t-f:exit program force."),
     CONSOLE_CMD(loglevel,   do_loglevel,    "Setting log print level."),
+    CONSOLE_CMD(poller,     do_poller,      "Show event loop statistics.\n\t-r:reset them."),
+    CONSOLE_CMD(workqueue,  do_workqueue,   "Show workqueue statistics.\n\t-r:reset them."),
     CONSOLE_CMD_END(),
 };
 
@@ -166,6 +166,10 @@ static struct config *config_find_by_key(const char *key)
     struct config *conf;
     struct configs_module *configs = &_configs;
 
+    /* init_configs() not called */
+    if (!configs->configs_list.next)
+        return NULL;
+
     list_for_each_entry(conf, &configs->configs_list, node) {
         if (!strcmp(conf->key, key))
             return conf;
@@ -20,11 +20,14 @@
 #include <include/ioasync.h>
 #include <include/workqueue.h>
 #include <include/idr.h>
+#include <include/placement.h>
 
 
 int common_init(void)
 {
     mem_cache_init();
+    /* the configs, if any, are loaded first */
+    thread_placement_load_configs();
     init_workqueues();
     global_ioasync_init();
     init_timers();
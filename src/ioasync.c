@@ -10,6 +10,7 @@
  *
  */
 
+#define _GNU_SOURCE
 #include <stdint.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -18,7 +19,10 @@
 #include <errno.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <unistd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
 #include <netinet/in.h>
 
 #include <include/utils.h>
@@ -26,6 +30,7 @@
 #include <include/queue.h>
 #include <include/ioasync.h>
 #include <include/workqueue.h>
+#include <include/placement.h>
 
 
 struct iopacket {
@@ -33,14 +38,60 @@ struct iopacket {
     struct sockaddr addr;
 };
 
+/* max number of queued packets gathered into one writev() */
+#define IOHANDLER_IOV_MAX   (64)
 
-struct ioasync {
+/* segments of the chain a single stream read may fill */
+#define IOHANDLER_READ_SEGS (16)
+#define IOHANDLER_DGRAM_MAX (65535)
+
+/* received datagrams up to this size are copied out of the recvmmsg()
+ * buffer into a small one, the big buffer stays in its slot */
+#define IOHANDLER_COPYBREAK (256)
+
+/* buffer size classes, a short message must not pin a 2 KB block */
+static const int ioasync_buf_sizes[] = {
+    64, 256, 1024, PACKET_MAX_PAYLOAD,
+};
+
+/* recvmmsg()/sendmmsg() state of a batched udp iohandler */
+struct iohandler_mmsg {
+    int batch;
+    /* receive buffers kept across wakeups, NULL once handed out */
+    struct iopacket **packs;
+    struct mmsghdr *msgs;
+    struct iovec *iov;
+};
+
+
+/* One reactor is one poller driven by its own thread. Every iohandler
+ * is bound to exactly one reactor for its whole lifetime, so all the
+ * read/write/close callbacks of a given fd run on the same thread.
+ */
+struct ioreactor {
+    int id;
     struct poller poller;
+    pthread_t thread;
+    int nr_handlers;    /* protected by owner->lock */
+    /* accept batch being delivered, reactor thread only */
+    struct iohandler_accept_call *accept_call;
+    /* inline handler in post(), cleared if it closed, reactor only */
+    struct iohandler *dispatching;
+    struct ioasync *owner;
+};
+
+struct ioasync {
+    int nr_reactors;
+    int policy;
+    struct ioreactor *reactors;
     bool initialized;
 
     mempool_t *pkt_pool;
     pack_buf_pool_t *buf_pool;
 
+    /* shared by the strands of all iohandlers */
+    struct workqueue_struct *wq;
+
     /* list of active iohandler objects */
     struct list_head active_list;
 
@@ -57,8 +108,12 @@ struct ioasync {
 struct handle_ops {
     void (*post)(void *priv, struct iopacket *pkt);
     void (*accept)(void *priv, int acceptfd);
+    void (*accept_batch)(void *priv, int *fds, int nr);
     void (*handle)(void *priv, uint8_t *data, int len);
     void (*handlefrom)(void *priv, uint8_t *data, int len, void *from);
+    /* zero-copy variants, the callee owns the pack_buf reference */
+    void (*handle_pkb)(void *priv, pack_buf_t *pkb);
+    void (*handlefrom_pkb)(void *priv, pack_buf_t *pkb, void *from);
     void (*close)(void *priv);
 };
 
@@ -69,6 +124,38 @@ enum iohandler_type {
     HANDLER_TYPE_UDP,
 };
 
+/* iohandler flags */
+enum {
+    /* IOHANDLER_DISPATCH_INLINE = 1 << 0, from iohandler_create() */
+    IOHANDLER_F_EDGE = 1 << 1,  /* edge-triggered, read until EAGAIN */
+    IOHANDLER_F_MMSG = 1 << 2,  /* udp, batched recvmmsg/sendmmsg */
+    IOHANDLER_F_ACCEPT_BATCH = 1 << 3,  /* accept4() loop, direct handoff */
+    IOHANDLER_F_ACCEPT_SPREAD = 1 << 4, /* IOHANDLER_ACCEPT_SPREAD */
+    IOHANDLER_F_CHAIN = 1 << 5, /* takes chained reads, handle_pkb */
+};
+
+/* the part of an accepted batch bound to one reactor. every fd holds
+ * a slot in reactor->nr_handlers until an iohandler is created for it
+ * from the callback, or until the callback returns */
+struct iohandler_accept_call {
+    void (*accept_batch)(void *priv, int *fds, int nr);
+    void *priv;
+    struct ioreactor *reactor;
+    int nr;
+    int fds[IOHANDLER_ACCEPT_BATCH];
+    bool claimed[IOHANDLER_ACCEPT_BATCH];
+};
+
+
+/* output queue backpressure, see iohandler_set_watermarks() */
+struct iohandler_wm {
+    int high_bytes;     /* 0: no byte limit */
+    int low_bytes;
+    int high_packets;   /* 0: no packet limit */
+    int low_packets;
+    int flags;          /* IOHANDLER_WM_* */
+    int above;          /* high reached, on_writable due on drain */
+};
 
 struct iohandler {
     int fd;
@@ -76,17 +163,43 @@ struct iohandler {
     int flags;
     int closing;
 
+    /* edge-triggered fairness budget, per wakeup */
+    int read_budget;
+    int read_packets;
+
     struct handle_ops h_ops;
     void *priv_data;
 
-    struct workqueue_struct *wq;
+    /* q_in is drained in order on the shared workqueue */
+    struct strand strand;
     struct work_struct work;
     struct queue *q_in;
     struct queue *q_out;
+    /* bytes of the head packet of q_out already written */
+    int out_pos;
+    struct iohandler_mmsg *mmsg;
+    /* datagrams dropped for not fitting a receive slot, reactor only */
+    int rx_truncated;
+    /* size of the next single read, from the last ones, reactor only */
+    int rx_size;
+
+    /* q_out occupancy, under lock */
+    int out_bytes;
+    int out_packets;
+    /* sent by the reactor since the last accounting, reactor only */
+    int retired_bytes;
+    int retired_packets;
+    struct iohandler_wm wm;
+    pthread_cond_t wm_cond;
+    /* under lock: set on close/shutdown, blocked senders then leave */
+    int wm_dead;
+    int wm_waiters;
+    void (*on_writable)(void *priv);
 
     struct list_head entry;
     pthread_mutex_t lock;
     struct ioasync *owner;
+    struct ioreactor *reactor;
 };
 
 static struct iopacket *iohandler_pack_alloc(iohandler_t *ioh, int allocbuf)
@@ -102,18 +215,71 @@ static struct iopacket *iohandler_pack_alloc(iohandler_t *ioh, int allocbuf)
     return pkt;
 }
 
+static void ioasync_pack_free(ioasync_t *aio, struct iopacket *pkt,
+                              int freebuf)
+{
+    /* a zero-copy post may have taken the buffer */
+    if (freebuf && pkt->packet.buf) {
+        pack_buf_free(pkt->packet.buf);
+    }
+    mempool_free(aio->pkt_pool, pkt);
+}
+
 static void iohandler_pack_free(iohandler_t *ioh, struct iopacket *pkt,
                                 int freebuf)
 {
+    ioasync_pack_free(ioh->owner, pkt, freebuf);
+}
+
+/* free @n packets and their buffers with one call to each pool,
+ * n <= IOHANDLER_IOV_MAX */
+static void iohandler_pack_free_many(iohandler_t *ioh, struct iopacket **packs,
+                                     int n)
+{
+    int i;
+    int nr_bufs = 0;
     ioasync_t *aio = ioh->owner;
+    pack_buf_t *pkbs[IOHANDLER_IOV_MAX];
 
-    if (freebuf) {
-        pack_buf_free(pkt->packet.buf);
+    for (i = 0; i < n; i++) {
+        if (packs[i]->packet.buf)
+            pkbs[nr_bufs++] = packs[i]->packet.buf;
     }
-    mempool_free(aio->pkt_pool, pkt);
+
+    pack_buf_free_bulk(pkbs, nr_bufs);
+    mempool_free_bulk(aio->pkt_pool, (void **)packs, n);
+}
+
+static struct iohandler_mmsg *iohandler_mmsg_alloc(int batch)
+{
+    struct iohandler_mmsg *mmsg;
+
+    mmsg = xzalloc(sizeof(*mmsg));
+    mmsg->batch = batch;
+    mmsg->packs = xzalloc(batch * sizeof(*mmsg->packs));
+    mmsg->msgs = xzalloc(batch * sizeof(*mmsg->msgs));
+    mmsg->iov = xzalloc(batch * sizeof(*mmsg->iov));
+
+    return mmsg;
+}
+
+static void iohandler_mmsg_free(iohandler_t *ioh, struct iohandler_mmsg *mmsg)
+{
+    int i;
+
+    for (i = 0; i < mmsg->batch; i++) {
+        if (mmsg->packs[i])
+            iohandler_pack_free(ioh, mmsg->packs[i], 1);
+    }
+
+    free(mmsg->packs);
+    free(mmsg->msgs);
+    free(mmsg->iov);
+    free(mmsg);
 }
 
 
+
 pack_buf_t *iohandler_pack_buf_alloc(iohandler_t *ioh)
 {
     pack_buf_t *pkb;
@@ -123,91 +289,317 @@ pack_buf_t *iohandler_pack_buf_alloc(iohandler_t *ioh)
     return pkb;
 }
 
+/**
+ * iohandler_pack_buf_alloc_size - allocate room for @size bytes from
+ * the smallest fitting size class
+ *
+ * Above PACKET_MAX_PAYLOAD the result is a chain of buffers, fill it
+ * with pack_buf_copy_in() or segment by segment.
+ */
+pack_buf_t *iohandler_pack_buf_alloc_size(iohandler_t *ioh, int size)
+{
+    ioasync_t *aio = ioh->owner;
+
+    return pack_buf_alloc_chain(aio->buf_pool, size);
+}
+
 void iohandler_pack_buf_free(pack_buf_t *pkb)
 {
     pack_buf_free(pkb);
 }
 
-void iohandler_pack_submit(iohandler_t *ioh, struct iopacket *pack)
+static int iohandler_buf_segs(pack_buf_t *pkb)
+{
+    int n = 0;
+
+    for (; pkb; pkb = pkb->next)
+        n++;
+    return n;
+}
+
+/* describe the chain @pkb in @iov, skipping its first @skip bytes. with
+ * @room the whole capacity of each segment is used, for a read.
+ * returns the number of entries used, at most @max. */
+static int iohandler_buf_iov(pack_buf_t *pkb, int skip, int room,
+                             struct iovec *iov, int max)
+{
+    int len;
+    int n = 0;
+
+    for (; pkb && n < max; pkb = pkb->next) {
+        len = room ? pkb->size : pkb->len;
+        if (skip >= len) {
+            skip -= len;
+            continue;
+        }
+
+        iov[n].iov_base = pkb->data + skip;
+        iov[n].iov_len = len - skip;
+        skip = 0;
+        n++;
+    }
+
+    return n;
+}
+
+static int iohandler_above_high_wm(iohandler_t *ioh)
+{
+    struct iohandler_wm *wm = &ioh->wm;
+
+    return (wm->high_bytes && ioh->out_bytes >= wm->high_bytes) ||
+           (wm->high_packets && ioh->out_packets >= wm->high_packets);
+}
+
+static int iohandler_below_low_wm(iohandler_t *ioh)
+{
+    struct iohandler_wm *wm = &ioh->wm;
+
+    return (!wm->high_bytes || ioh->out_bytes <= wm->low_bytes) &&
+           (!wm->high_packets || ioh->out_packets <= wm->low_packets);
+}
+
+/* free a packet that left q_out, accounted by iohandler_write() */
+static void iohandler_out_retire(iohandler_t *ioh, struct iopacket *pack)
+{
+    ioh->retired_bytes += pack_buf_chain_len(pack->packet.buf);
+    ioh->retired_packets++;
+    iohandler_pack_free(ioh, pack, 1);
+}
+
+/* take the @n head packets of q_out, which are sent.
+ * n <= IOHANDLER_IOV_MAX */
+static void iohandler_out_retire_many(iohandler_t *ioh, int n)
+{
+    int i;
+    struct packet *pkts[IOHANDLER_IOV_MAX];
+    struct iopacket *packs[IOHANDLER_IOV_MAX];
+
+    n = queue_out_many(ioh->q_out, pkts, n);
+    for (i = 0; i < n; i++) {
+        packs[i] = (struct iopacket *)pkts[i];
+        ioh->retired_bytes += pack_buf_chain_len(pkts[i]->buf);
+    }
+    ioh->retired_packets += n;
+
+    iohandler_pack_free_many(ioh, packs, n);
+}
+
+/* returns -EAGAIN if q_out is above its high watermark, or -EPIPE once
+ * @ioh is shutting down, @pack is not queued then and still belongs to
+ * the caller */
+int iohandler_pack_submit(iohandler_t *ioh, struct iopacket *pack)
 {
     int empty;
 
     pthread_mutex_lock(&ioh->lock);
 
-    empty = !queue_count(ioh->q_out);
-    if (empty) {
-        ioasync_t *aio = ioh->owner;
-        poller_event_enable(&aio->poller, ioh->fd, EV_WRITE);
+    while (ioh->wm_dead || iohandler_above_high_wm(ioh)) {
+        if (ioh->wm_dead) {
+            pthread_mutex_unlock(&ioh->lock);
+            return -EPIPE;
+        }
+        ioh->wm.above = 1;
+
+        /* the reactor drains q_out, it must never wait for itself */
+        if (!(ioh->wm.flags & IOHANDLER_WM_BLOCK) ||
+            pthread_equal(pthread_self(), ioh->reactor->thread)) {
+            pthread_mutex_unlock(&ioh->lock);
+            return -EAGAIN;
+        }
+        ioh->wm_waiters++;
+        pthread_cond_wait(&ioh->wm_cond, &ioh->lock);
+        /* the last one out lets iohandler_close() free @ioh */
+        if (!--ioh->wm_waiters && ioh->wm_dead)
+            pthread_cond_broadcast(&ioh->wm_cond);
     }
+
+    empty = !queue_count(ioh->q_out);
+    ioh->out_bytes += pack_buf_chain_len(pack->packet.buf);
+    ioh->out_packets++;
+    if (iohandler_above_high_wm(ioh))
+        ioh->wm.above = 1;
+
+    /* queue first: an edge-triggered write event must find the packet */
     queue_in(ioh->q_out, (struct packet *)pack);
+    if (empty)
+        poller_event_enable(&ioh->reactor->poller, ioh->fd, EV_WRITE);
 
     pthread_mutex_unlock(&ioh->lock);
+    return 0;
 }
 
-void iohandler_pkt_send(iohandler_t *ioh, pack_buf_t *pkb)
+/**
+ * iohandler_pkt_send - queue @pkb for output, without copying it
+ *
+ * Takes over the caller's reference on success. Returns -EAGAIN when
+ * the output queue is above its high watermark in fail-fast mode and
+ * -EPIPE once @ioh is shutting down, the caller then still owns @pkb.
+ */
+int iohandler_pkt_send(iohandler_t *ioh, pack_buf_t *pkb)
 {
+    int ret;
     struct iopacket *pack;
 
     pack = iohandler_pack_alloc(ioh, 0);
     pack->packet.buf = pkb;
 
-    iohandler_pack_submit(ioh, pack);
+    ret = iohandler_pack_submit(ioh, pack);
+    if (ret)
+        iohandler_pack_free(ioh, pack, 0);
+    return ret;
 }
 
-void iohandler_pkt_sendto(iohandler_t *ioh, pack_buf_t *pkb,
-                          struct sockaddr *to)
+int iohandler_pkt_sendto(iohandler_t *ioh, pack_buf_t *pkb,
+                         struct sockaddr *to)
 {
+    int ret;
     struct iopacket *pack;
 
     pack = iohandler_pack_alloc(ioh, 0);
     pack->packet.buf = pkb;
     pack->addr = *to;
 
-    iohandler_pack_submit(ioh, pack);
+    ret = iohandler_pack_submit(ioh, pack);
+    if (ret)
+        iohandler_pack_free(ioh, pack, 0);
+    return ret;
+}
+
+/**
+ * iohandler_pkt_forward - queue a received buffer on another iohandler
+ * @to: the iohandler to send on
+ * @pkb: the head of a chain: a handle_pkb buffer, or data_to_pack_buf()
+ *       of the data passed to a handle callback of iohandler_create().
+ *       Never a segment reached through ->next, which has no reference
+ *       of its own.
+ *
+ * Takes its own reference to @pkb, the data is not copied. The caller
+ * keeps its reference, so one buffer can be forwarded to several
+ * iohandlers and must still be released once.
+ */
+int iohandler_pkt_forward(iohandler_t *to, pack_buf_t *pkb)
+{
+    int ret;
+
+    ret = iohandler_pkt_send(to, pack_buf_get(pkb));
+    if (ret)
+        pack_buf_free(pkb);
+    return ret;
+}
+
+int iohandler_pkt_forwardto(iohandler_t *to, pack_buf_t *pkb,
+                            struct sockaddr *addr)
+{
+    int ret;
+
+    ret = iohandler_pkt_sendto(to, pack_buf_get(pkb), addr);
+    if (ret)
+        pack_buf_free(pkb);
+    return ret;
+}
+
+/* copy @data into a buffer of the right size, chained if needed */
+static pack_buf_t *iohandler_pack_buf_copy(iohandler_t *ioh,
+                                           const uint8_t *data, int len)
+{
+    pack_buf_t *pkb;
+
+    pkb = iohandler_pack_buf_alloc_size(ioh, len);
+    if (pkb)
+        pack_buf_copy_in(pkb, data, len);
+    return pkb;
 }
 
-void iohandler_send(iohandler_t *ioh, const uint8_t *data, int len)
+/**
+ * iohandler_send - queue a copy of @data for output
+ *
+ * @len is not limited to PACKET_MAX_PAYLOAD, a large message is kept in
+ * a chain of buffers and written with a single writev(). Returns
+ * -EINVAL for a bad @len, -ENOMEM, -EAGAIN above the high watermark or
+ * -EPIPE once @ioh is shutting down.
+ */
+int iohandler_send(iohandler_t *ioh, const uint8_t *data, int len)
 {
+    int ret;
     pack_buf_t *pkb;
 
-    pkb = iohandler_pack_buf_alloc(ioh);
-    memcpy(pkb->data, data, len);
-    pkb->len = len;
+    if (len < 0 || (len && !data))
+        return -EINVAL;
 
-    iohandler_pkt_send(ioh, pkb);
+    pkb = iohandler_pack_buf_copy(ioh, data, len);
+    if (!pkb)
+        return -ENOMEM;
+
+    ret = iohandler_pkt_send(ioh, pkb);
+    if (ret)
+        pack_buf_free(pkb);
+    return ret;
 }
 
-void iohandler_sendto(iohandler_t *ioh, const uint8_t *data, int len,
-                      struct sockaddr *to)
+int iohandler_sendto(iohandler_t *ioh, const uint8_t *data, int len,
+                     struct sockaddr *to)
 {
+    int ret;
     pack_buf_t *pkb;
 
-    pkb = iohandler_pack_buf_alloc(ioh);
-    memcpy(pkb->data, data, len);
-    pkb->len = len;
+    if (len < 0 || (len && !data))
+        return -EINVAL;
 
-    iohandler_pkt_sendto(ioh, pkb, to);
+    pkb = iohandler_pack_buf_copy(ioh, data, len);
+    if (!pkb)
+        return -ENOMEM;
+
+    ret = iohandler_pkt_sendto(ioh, pkb, to);
+    if (ret)
+        pack_buf_free(pkb);
+    return ret;
 }
 
+/* fail senders from now on and wake those blocked on the watermark */
+static void iohandler_wm_kill(iohandler_t *ioh)
+{
+    pthread_mutex_lock(&ioh->lock);
+    ioh->wm_dead = 1;
+    pthread_cond_broadcast(&ioh->wm_cond);
+    pthread_mutex_unlock(&ioh->lock);
+}
 
 static void iohandler_close(iohandler_t *ioh)
 {
     ioasync_t *aio = ioh->owner;
+    struct ioreactor *r = ioh->reactor;
+
+    /* closed from its own inline post(), tell the dispatcher */
+    if (pthread_equal(r->thread, pthread_self()) && r->dispatching == ioh)
+        r->dispatching = NULL;
+
+    /* no sender may still sleep on wm_cond once @ioh is freed */
+    pthread_mutex_lock(&ioh->lock);
+    ioh->wm_dead = 1;
+    pthread_cond_broadcast(&ioh->wm_cond);
+    while (ioh->wm_waiters)
+        pthread_cond_wait(&ioh->wm_cond, &ioh->lock);
+    pthread_mutex_unlock(&ioh->lock);
 
     if (ioh->h_ops.close)
         ioh->h_ops.close(ioh->priv_data);
 
     pthread_mutex_lock(&aio->lock);
     list_del(&ioh->entry);
+    ioh->reactor->nr_handlers--;
     pthread_mutex_unlock(&aio->lock);
 
     queue_release(ioh->q_in);
     queue_release(ioh->q_out);
+    if (ioh->mmsg)
+        iohandler_mmsg_free(ioh, ioh->mmsg);
 
     if (ioh->fd > 0) {
-        poller_event_del(&aio->poller, ioh->fd);
+        poller_event_del(&ioh->reactor->poller, ioh->fd);
     }
 
+    pthread_cond_destroy(&ioh->wm_cond);
+    pthread_mutex_destroy(&ioh->lock);
     free(ioh);
 }
 
@@ -224,6 +616,8 @@ void iohandler_shutdown(iohandler_t *ioh)
         iohandler_close(ioh);
     } else if (!q_empty && !ioh->closing) {
         ioh->closing = 1;
+        /* q_out only drains from here, blocked senders get -EPIPE */
+        iohandler_wm_kill(ioh);
 
         pthread_mutex_lock(&aio->lock);
         list_del(&ioh->entry);
@@ -256,179 +650,827 @@ static void iohandler_in_handle_work(struct work_struct *work)
     }
 }
 
-static void iohandler_in_pack_queue(iohandler_t *ioh, struct iopacket *pack)
+/* returns -EPIPE if an inline handler closed @ioh, see iohandler_read() */
+static int iohandler_in_pack_queue(iohandler_t *ioh, struct iopacket *pack)
 {
+    ioasync_t *aio = ioh->owner;
+    struct ioreactor *r = ioh->reactor;
+    iohandler_t *prev;
+
+    /* run to completion on the reactor thread, no workqueue hop. the
+     * handler may shut @ioh down, touch nothing of it after post() */
+    if (ioh->flags & IOHANDLER_DISPATCH_INLINE) {
+        prev = r->dispatching;
+        r->dispatching = ioh;
+        if (ioh->h_ops.post)
+            ioh->h_ops.post(ioh, pack);
+
+        ioasync_pack_free(aio, pack, 1);
+        if (r->dispatching != ioh) {
+            r->dispatching = prev;
+            return -EPIPE;
+        }
+        r->dispatching = prev;
+        return 0;
+    }
+
     logv("iohandler receive data. packet queue.\n");
     queue_in(ioh->q_in, (struct packet *)pack);
 
-    queue_work(ioh->wq, &ioh->work);
+    strand_queue_work(&ioh->strand, &ioh->work);
+    return 0;
+}
+
+/* the biggest single read: a stream read for a handle_pkb callback takes
+ * up to IOHANDLER_READ_SEGS segments, a handle callback gets a single
+ * buffer, see iohandler_create(). */
+static int iohandler_rx_max(iohandler_t *ioh)
+{
+    if (ioh->type == HANDLER_TYPE_UDP)
+        return IOHANDLER_DGRAM_MAX;
+    if (ioh->flags & IOHANDLER_F_CHAIN)
+        return PACKET_MAX_PAYLOAD * IOHANDLER_READ_SEGS;
+    return PACKET_MAX_PAYLOAD;
 }
 
-static int iohandler_read(iohandler_t *ioh)
+/*
+ * Size the next read from this one, so a read costs no FIONREAD up
+ * front. A stream read that filled its @room asks FIONREAD how much is
+ * left and grows to take it all next time, any other read halves the
+ * size down to what it got. Datagram reads start at PACKET_MAX_PAYLOAD
+ * and never shrink: one that did not fit is dropped, and the size
+ * grows to its length for the next one.
+ */
+static void iohandler_rx_size_update(iohandler_t *ioh, int room, int len)
+{
+    int avail;
+    int size;
+    int limit = iohandler_rx_max(ioh);
+
+    if (len >= room) {
+        if (room >= limit)
+            size = limit;
+        else if (ioh->type == HANDLER_TYPE_UDP)
+            size = len;
+        else if (ioctl(ioh->fd, FIONREAD, &avail) < 0 || avail <= 0)
+            size = room * 2;
+        else
+            size = room + avail;
+    } else if (ioh->type == HANDLER_TYPE_UDP) {
+        return;
+    } else {
+        size = max(len, room / 2);
+    }
+
+    ioh->rx_size = clamp(size, 1, limit);
+}
+
+static pack_buf_t *iohandler_rx_buf_alloc(iohandler_t *ioh)
+{
+    ioasync_t *aio = ioh->owner;
+
+    if (ioh->type == HANDLER_TYPE_TCP_ACCEPT)
+        return pack_buf_alloc_size(aio->buf_pool, sizeof(int));
+
+    return pack_buf_alloc_chain(aio->buf_pool, ioh->rx_size);
+}
+
+/* read one packet from the fd and queue it. returns the payload
+ * length, -EPIPE once @ioh was closed (end of stream, or by an inline
+ * handler), or a negative errno (-EAGAIN once the fd is drained).
+ */
+static int iohandler_read_packet(iohandler_t *ioh)
 {
+    int ret;
+    ssize_t len;
     struct iopacket *pack;
     pack_buf_t  *pkb;
+    pack_buf_t  *seg;
+    struct iovec iov[IOHANDLER_IOV_MAX];
+    int nr_iov;
+    int room = 0;
 
-    pack = iohandler_pack_alloc(ioh, 1);
-    pkb = pack->packet.buf;
+    pkb = iohandler_rx_buf_alloc(ioh);
+    if (!pkb)
+        return -ENOMEM;
+
+    for (seg = pkb; seg; seg = seg->next)
+        room += seg->size;
+
+    pack = iohandler_pack_alloc(ioh, 0);
+    pack->packet.buf = pkb;
 
     switch (ioh->type) {
         case HANDLER_TYPE_NORMAL:
         case HANDLER_TYPE_TCP: {
-            pkb->len = xread(ioh->fd, pkb->data, PACKET_MAX_PAYLOAD);
+            if (!pkb->next) {
+                len = xread(ioh->fd, pkb->data, pkb->size);
+                break;
+            }
+            nr_iov = iohandler_buf_iov(pkb, 0, 1, iov, IOHANDLER_READ_SEGS);
+            do {
+                len = readv(ioh->fd, iov, nr_iov);
+            } while (len < 0 && errno == EINTR);
             break;
         }
         case HANDLER_TYPE_UDP: {
-            socklen_t addrlen = sizeof(struct sockaddr_in);
+            struct msghdr msg;
+
             bzero(&pack->addr, sizeof(pack->addr));
-            pkb->len = recvfrom(ioh->fd, &pkb->data, PACKET_MAX_PAYLOAD,
-                                0, &pack->addr, &addrlen);
+            bzero(&msg, sizeof(msg));
+            msg.msg_name = &pack->addr;
+            msg.msg_namelen = sizeof(struct sockaddr_in);
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iohandler_buf_iov(pkb, 0, 1, iov,
+                                               IOHANDLER_IOV_MAX);
+            /* MSG_TRUNC: the full length of a datagram that did not fit */
+            do {
+                len = recvmsg(ioh->fd, &msg, MSG_TRUNC);
+            } while (len < 0 && errno == EINTR);
             break;
         }
         case HANDLER_TYPE_TCP_ACCEPT: {
             int channel;
             channel = xaccept(ioh->fd);
+            if (channel < 0) {
+                len = -1;
+                break;
+            }
             memcpy(pkb->data, &channel, sizeof(int));
-            pkb->len = sizeof(int);
+            len = sizeof(int);
             break;
         }
         default:
-            pkb->len = -1;
+            errno = EINVAL;
+            len = -1;
             break;
     }
 
-    if (pkb->len < 0) {
-        goto fail;
-    } else if ((pkb->len == 0) &&
-               (ioh->type && HANDLER_TYPE_TCP)) {
-        iohandler_close(ioh);
+    if (len < 0) {
+        ret = (errno == EWOULDBLOCK) ? -EAGAIN : -errno;
+        goto out;
+    } else if ((len == 0) &&
+               (ioh->type != HANDLER_TYPE_UDP)) {
         iohandler_pack_free(ioh, pack, 1);
-        return 0;
+        iohandler_close(ioh);
+        return -EPIPE;
     }
 
-    iohandler_in_pack_queue(ioh, pack);
-    return 0;
+    if (ioh->type != HANDLER_TYPE_TCP_ACCEPT)
+        iohandler_rx_size_update(ioh, room, len);
 
-fail:
-    loge("iohandler read data failed.\n");
+    /* the tail of the datagram is gone, the next one gets the room */
+    if (len > room) {
+        ioh->rx_truncated++;
+        logw("iohandler fd %d: datagram of %zd bytes dropped, "
+             "%d so far.\n", ioh->fd, len, ioh->rx_truncated);
+        ret = 0;
+        goto out;
+    }
+
+    pack_buf_trim(pkb, len);
+    ret = len;
+    if (iohandler_in_pack_queue(ioh, pack))
+        return -EPIPE;
+    return ret;
+
+out:
     iohandler_pack_free(ioh, pack, 1);
-    return -EINVAL;
+    return ret;
 }
 
-static int iohandler_write_packet(iohandler_t *ioh, struct iopacket *pkt)
+/* give a packet and a buffer to every empty slot of @mmsg, with one
+ * bulk allocation from each pool. empty slots are filled in order, so
+ * after a short allocation the filled ones stay in front. */
+static void iohandler_mmsg_refill(iohandler_t *ioh, struct iohandler_mmsg *mmsg)
 {
-    int len = -EINVAL;
+    int i, got, bufs;
+    int nr = 0;
+    ioasync_t *aio = ioh->owner;
+    int slots[IOHANDLER_MMSG_MAX];
+    struct iopacket *packs[IOHANDLER_MMSG_MAX];
+    pack_buf_t *pkbs[IOHANDLER_MMSG_MAX];
 
-    switch (ioh->type) {
-        case HANDLER_TYPE_NORMAL:
-        case HANDLER_TYPE_TCP: {
-            int out_pos = 0;
-            int avail = 0;
-            pack_buf_t *pkb = pkt->packet.buf;
+    for (i = 0; i < mmsg->batch; i++) {
+        if (!mmsg->packs[i])
+            slots[nr++] = i;
+    }
+    if (!nr)
+        return;
 
-            while (out_pos < pkb->len) {
-                avail = pkb->len - out_pos;
+    got = mempool_alloc_bulk(aio->pkt_pool, (void **)packs, nr);
+    bufs = pack_buf_alloc_bulk(aio->buf_pool, pkbs, got);
 
-                len = xwrite(ioh->fd, (&pkb->data) + out_pos, avail);
-                if (len < 0)
-                    goto fail;
-                out_pos += len;
-            }
-            break;
-        }
-        case HANDLER_TYPE_UDP: {
-            pack_buf_t *pkb = pkt->packet.buf;
-            len = sendto(ioh->fd, &pkb->data, pkb->len, 0,
-                         &pkt->addr, sizeof(struct sockaddr));
-            if (len < 0)
-                goto fail;
-            break;
-        }
-        case HANDLER_TYPE_TCP_ACCEPT:
-            BUG();
-        default:
-            goto fail;
+    for (i = 0; i < bufs; i++) {
+        packs[i]->packet.buf = pkbs[i];
+        mmsg->packs[slots[i]] = packs[i];
     }
 
-    return 0;
-
-fail:
-    loge("send data fail, ret=%d, droped.\n", len);
-    return -EINVAL;
+    if (bufs < got)
+        mempool_free_bulk(aio->pkt_pool, (void **)(packs + bufs), got - bufs);
 }
 
-
-static int iohandler_write(iohandler_t *ioh)
+/* copy a short datagram received in @slot to a packet with a buffer of
+ * its size, so that the big one stays in the slot for the next
+ * recvmmsg(). returns NULL if the slot itself is to be handed out. */
+static struct iopacket *iohandler_mmsg_copybreak(iohandler_t *ioh,
+                                                 struct iopacket *slot, int len)
 {
-    int ret;
     struct iopacket *pack;
+    pack_buf_t *pkb;
     ioasync_t *aio = ioh->owner;
 
-    if (queue_count(ioh->q_out) == 0)
-        return 0;
+    if (len > IOHANDLER_COPYBREAK)
+        return NULL;
 
-    pack = (struct iopacket *)queue_out(ioh->q_out);
-    if (!pack)
-        return 0;
+    pkb = pack_buf_alloc_size(aio->buf_pool, len);
+    if (!pkb)
+        return NULL;
 
-    logv("iohandler send data.\n");
+    pack = iohandler_pack_alloc(ioh, 0);
+    pack->packet.buf = pkb;
+    pack->addr = slot->addr;
+    memcpy(pkb->data, slot->packet.buf->data, len);
 
-    pthread_mutex_lock(&ioh->lock);
-    if (queue_count(ioh->q_out) == 0)
-        poller_event_disable(&aio->poller, ioh->fd, EV_WRITE);
+    return pack;
+}
 
-    pthread_mutex_unlock(&ioh->lock);
+/* receive up to mmsg->batch datagrams with one recvmmsg() and queue
+ * them. returns the bytes read and the datagram count in @packets,
+ * -EPIPE once an inline handler closed @ioh, or a negative errno
+ * (-EAGAIN once the fd is drained). */
+static int iohandler_read_mmsg(iohandler_t *ioh, int *packets)
+{
+    int i, n, len;
+    int bytes = 0;
+    struct iopacket *pack;
+    struct iohandler_mmsg *mmsg = ioh->mmsg;
+
+    iohandler_mmsg_refill(ioh, mmsg);
+
+    for (i = 0; i < mmsg->batch && mmsg->packs[i]; i++) {
+        pack = mmsg->packs[i];
+        mmsg->iov[i].iov_base = pack->packet.buf->data;
+        mmsg->iov[i].iov_len = pack->packet.buf->size;
+        mmsg->msgs[i].msg_hdr.msg_name = &pack->addr;
+        mmsg->msgs[i].msg_hdr.msg_namelen = sizeof(pack->addr);
+        mmsg->msgs[i].msg_hdr.msg_iov = &mmsg->iov[i];
+        mmsg->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
 
-    ret = iohandler_write_packet(ioh, pack);
+    if (!i)
+        return -ENOMEM;
 
-    iohandler_pack_free(ioh, pack, 1);
+    do {
+        n = recvmmsg(ioh->fd, mmsg->msgs, i, 0, NULL);
+    } while (n < 0 && errno == EINTR);
 
-    return ret;
-}
+    if (n < 0)
+        return (errno == EWOULDBLOCK) ? -EAGAIN : -errno;
 
+    for (i = 0; i < n; i++) {
+        len = mmsg->msgs[i].msg_len;
 
-/* iohandler file descriptor event callback for read/write ops */
-static void iohandler_event(void *data, int events)
-{
-    iohandler_t *ioh = (iohandler_t *)data;
+        /* the tail of the datagram is gone, never pass it on as whole.
+         * the buffer stays in its slot for the next recvmmsg() */
+        if (mmsg->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+            ioh->rx_truncated++;
+            logw("iohandler fd %d: datagram over %d bytes dropped, "
+                 "%d so far.\n", ioh->fd, len, ioh->rx_truncated);
+            continue;
+        }
 
-    /* in certain cases, it's possible to have both EPOLLIN and
-     * EPOLLHUP at the same time. This indicates that there is incoming
-     * data to read, but that the connection was nonetheless closed
-     * by the sender. Be sure to read the data before closing
-     * the receiver to avoid packet loss.
-     */
-    if (events & EV_READ) {
-        iohandler_read(ioh);
-    }
+        bytes += len;
 
-    if (events & EV_WRITE) {
-        iohandler_write(ioh);
+        pack = iohandler_mmsg_copybreak(ioh, mmsg->packs[i], len);
+        if (!pack) {
+            pack = mmsg->packs[i];
+            mmsg->packs[i] = NULL;
+        }
+
+        pack->packet.buf->len = len;
+        /* the slots left are freed with @ioh */
+        if (iohandler_in_pack_queue(ioh, pack))
+            return -EPIPE;
     }
 
-    if (events & (EV_HUP | EV_ERROR)) {
-        /* disconnection */
-        loge("iohandler disconnect on fd %d", ioh->fd);
-        iohandler_close(ioh);
-        return;
+    *packets = n;
+    return bytes;
+}
+
+static struct ioreactor *ioasync_select_reactor(ioasync_t *aio, int fd);
+
+static void iohandler_accept_call_run(void *arg)
+{
+    int i;
+    int unused = 0;
+    struct iohandler_accept_call *call = arg;
+    struct ioreactor *r = call->reactor;
+
+    r->accept_call = call;
+    call->accept_batch(call->priv, call->fds, call->nr);
+    r->accept_call = NULL;
+
+    /* fds the callback closed or handed to another thread */
+    for (i = 0; i < call->nr; i++)
+        unused += !call->claimed[i];
+    if (unused) {
+        pthread_mutex_lock(&r->owner->lock);
+        r->nr_handlers -= unused;
+        pthread_mutex_unlock(&r->owner->lock);
     }
+    free(call);
 }
 
-static iohandler_t *ioasync_create_context(ioasync_t *aio, int fd, int type)
+/*
+ * Hand a batch of accepted fds to the accept_batch callback. With
+ * IOHANDLER_ACCEPT_SPREAD each fd is delivered on the reactor that
+ * ioasync_select_reactor() picks for it, so that connection setup is
+ * spread over all the reactor threads (and with IOASYNC_POLICY_FD_HASH,
+ * runs on the thread which will own the connection). The reactor is
+ * chosen once: an iohandler created for the fd from the callback is
+ * bound to it.
+ */
+static void iohandler_accept_deliver(iohandler_t *ioh, int *fds, int nr)
 {
-    iohandler_t *ioh;
+    int i;
+    ioasync_t *aio = ioh->owner;
+    struct ioreactor *r;
+    struct iohandler_accept_call **calls;
+    struct iohandler_accept_call *call;
 
-    ioh = malloc(sizeof(*ioh));
+    if (!(ioh->flags & IOHANDLER_F_ACCEPT_SPREAD) || aio->nr_reactors == 1) {
+        ioh->h_ops.accept_batch(ioh->priv_data, fds, nr);
+        return;
+    }
+
+    calls = xzalloc(aio->nr_reactors * sizeof(*calls));
+
+    pthread_mutex_lock(&aio->lock);
+    for (i = 0; i < nr; i++) {
+        /* reserve the slot now, or a whole burst would go to the
+         * reactor that was the least loaded one at its start */
+        r = ioasync_select_reactor(aio, fds[i]);
+        r->nr_handlers++;
+
+        call = calls[r->id];
+        if (!call) {
+            call = xzalloc(sizeof(*call));
+            call->accept_batch = ioh->h_ops.accept_batch;
+            call->priv = ioh->priv_data;
+            call->reactor = r;
+            calls[r->id] = call;
+        }
+        call->fds[call->nr++] = fds[i];
+    }
+    pthread_mutex_unlock(&aio->lock);
+
+    for (i = 0; i < aio->nr_reactors; i++) {
+        if (calls[i] && i != ioh->reactor->id)
+            poller_event_call(&aio->reactors[i].poller,
+                              iohandler_accept_call_run, calls[i]);
+    }
+    call = calls[ioh->reactor->id];
+    xfree(calls);
+
+    if (call)
+        iohandler_accept_call_run(call);
+}
+
+/*
+ * accept4() until EAGAIN, delivering up to IOHANDLER_ACCEPT_BATCH fds
+ * per callback. At most read_packets connections are taken per wakeup
+ * so that a connection storm does not starve the other fds of the
+ * reactor, the remainder is picked up on the next round.
+ */
+static int iohandler_read_accept(iohandler_t *ioh)
+{
+    int fd;
+    int err = 0;
+    int nr = 0;
+    int total = 0;
+    int fds[IOHANDLER_ACCEPT_BATCH];
+
+    while (total < ioh->read_packets) {
+        fd = accept4(ioh->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            /* the delivery below runs callbacks which clobber errno */
+            err = errno;
+            break;
+        }
+
+        fds[nr++] = fd;
+        total++;
+        if (nr == IOHANDLER_ACCEPT_BATCH) {
+            iohandler_accept_deliver(ioh, fds, nr);
+            nr = 0;
+        }
+    }
+
+    if (nr)
+        iohandler_accept_deliver(ioh, fds, nr);
+
+    if (total >= ioh->read_packets) {
+        if (ioh->flags & IOHANDLER_F_EDGE)
+            poller_event_pending(&ioh->reactor->poller, ioh->fd, EV_READ);
+        return 0;
+    }
+
+    if (err == EAGAIN || err == EWOULDBLOCK)
+        return 0;
+
+    /* EMFILE and co: the pending connections stay in the backlog */
+    loge("iohandler accept failed(%d).\n", err);
+    return -err;
+}
+
+/* returns -EPIPE if @ioh was closed and must not be used anymore */
+static int iohandler_read(iohandler_t *ioh)
+{
+    int ret;
+    int n = 1;
+    int bytes = 0;
+    int packets = 0;
+
+    if (ioh->flags & IOHANDLER_F_ACCEPT_BATCH)
+        return iohandler_read_accept(ioh);
+
+    /* level-triggered: one packet per wakeup, the poller calls us
+     * again if there is more. edge-triggered: drain the fd until
+     * EAGAIN or until the per-wakeup budget is spent. */
+    do {
+        if (ioh->flags & IOHANDLER_F_MMSG)
+            ret = iohandler_read_mmsg(ioh, &n);
+        else
+            ret = iohandler_read_packet(ioh);
+        if (ret < 0)
+            break;
+
+        bytes += ret;
+        packets += n;
+    } while ((ioh->flags & IOHANDLER_F_EDGE) &&
+             bytes < ioh->read_budget && packets < ioh->read_packets);
+
+    if (ret >= 0) {
+        /* out of budget, no new edge will come for the rest */
+        if (ioh->flags & IOHANDLER_F_EDGE)
+            poller_event_pending(&ioh->reactor->poller, ioh->fd, EV_READ);
+        return 0;
+    }
+
+    switch (ret) {
+        case -EAGAIN:
+            return 0;
+        case -EPIPE:
+            return -EPIPE;
+        default:
+            loge("iohandler read data failed(%d).\n", ret);
+            return -EINVAL;
+    }
+}
+
+/* drop every packet still queued for output, on a fatal write error */
+static void iohandler_drop_output(iohandler_t *ioh)
+{
+    struct iopacket *pack;
+
+    while ((pack = (struct iopacket *)queue_out(ioh->q_out)) != NULL)
+        iohandler_out_retire(ioh, pack);
+    ioh->out_pos = 0;
+}
+
+/*
+ * Gather as many queued packets as fit in one iovec batch and push them
+ * with a single writev(), one entry per buffer segment. Fully written
+ * packets are retired, a short write leaves ioh->out_pos pointing into
+ * the new head packet.
+ * Returns 0 when the whole batch went out, -EAGAIN when the socket
+ * buffer is full, or -errno.
+ */
+static int iohandler_write_stream(iohandler_t *ioh)
+{
+    int i, n, plen;
+    int nr_iov = 0;
+    int skip = ioh->out_pos;
+    ssize_t len, total = 0;
+    struct packet *pkts[IOHANDLER_IOV_MAX];
+    struct iovec iov[IOHANDLER_IOV_MAX];
+
+    n = queue_peek_many(ioh->q_out, pkts, IOHANDLER_IOV_MAX);
+    if (!n)
+        return 0;
+
+    for (i = 0; i < n && nr_iov < IOHANDLER_IOV_MAX; i++) {
+        int first = nr_iov;
+
+        nr_iov += iohandler_buf_iov(pkts[i]->buf, skip, 0, iov + nr_iov,
+                                    IOHANDLER_IOV_MAX - nr_iov);
+        for (; first < nr_iov; first++)
+            total += iov[first].iov_len;
+        skip = 0;
+    }
+
+    do {
+        len = writev(ioh->fd, iov, nr_iov);
+    } while (len < 0 && errno == EINTR);
+
+    if (len < 0)
+        return (errno == EWOULDBLOCK) ? -EAGAIN : -errno;
+
+    /* account what was written against the packets, from out_pos */
+    plen = ioh->out_pos + len;
+    for (i = 0; i < n; i++) {
+        int pkt_len = pack_buf_chain_len(pkts[i]->buf);
+
+        if (plen < pkt_len)
+            break;
+        plen -= pkt_len;
+    }
+    ioh->out_pos = (i < n) ? plen : 0;
+    iohandler_out_retire_many(ioh, i);
+
+    return (len == total) ? 0 : -EAGAIN;
+}
+
+/* flush up to mmsg->batch queued datagrams per sendmmsg() call */
+static int iohandler_write_mmsg(iohandler_t *ioh)
+{
+    int i, n, sent, segs;
+    int nr_iov = 0;
+    struct iopacket *pack;
+    struct iohandler_mmsg *mmsg = ioh->mmsg;
+    struct packet *batch[IOHANDLER_IOV_MAX];
+    struct iovec iov[IOHANDLER_IOV_MAX];
+
+    n = queue_peek_many(ioh->q_out, batch,
+                        min(mmsg->batch, IOHANDLER_IOV_MAX));
+    if (!n)
+        return 0;
+
+    for (i = 0; i < n && nr_iov < IOHANDLER_IOV_MAX; i++) {
+        pack = (struct iopacket *)batch[i];
+        /* a chained datagram must go out whole or wait for the next call */
+        if (i && iohandler_buf_segs(pack->packet.buf) > IOHANDLER_IOV_MAX - nr_iov)
+            break;
+        segs = iohandler_buf_iov(pack->packet.buf, 0, 0, iov + nr_iov,
+                                 IOHANDLER_IOV_MAX - nr_iov);
+
+        mmsg->msgs[i].msg_hdr.msg_name = &pack->addr;
+        mmsg->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr);
+        mmsg->msgs[i].msg_hdr.msg_iov = iov + nr_iov;
+        mmsg->msgs[i].msg_hdr.msg_iovlen = segs;
+        nr_iov += segs;
+    }
+    n = i;
+
+    do {
+        sent = sendmmsg(ioh->fd, mmsg->msgs, n, 0);
+    } while (sent < 0 && errno == EINTR);
+
+    if (sent < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return -EAGAIN;
+
+        /* the head datagram failed, drop it and let the rest go on
+         * the next wakeup */
+        loge("send datagram fail, ret=%d, droped.\n", -errno);
+        sent = 1;
+    }
+
+    iohandler_out_retire_many(ioh, sent);
+
+    return 0;
+}
+
+/* datagrams can not be coalesced, send them one by one until EAGAIN */
+static int iohandler_write_dgram(iohandler_t *ioh)
+{
+    int i;
+    ssize_t len;
+    struct msghdr msg;
+    struct iopacket *pack;
+    struct iovec iov[IOHANDLER_IOV_MAX];
+
+    for (i = 0; i < IOHANDLER_IOV_MAX; i++) {
+        pack = (struct iopacket *)queue_peek(ioh->q_out);
+        if (!pack)
+            break;
+
+        bzero(&msg, sizeof(msg));
+        msg.msg_name = &pack->addr;
+        msg.msg_namelen = sizeof(struct sockaddr);
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iohandler_buf_iov(pack->packet.buf, 0, 0, iov,
+                                           IOHANDLER_IOV_MAX);
+        do {
+            len = sendmsg(ioh->fd, &msg, 0);
+        } while (len < 0 && errno == EINTR);
+
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return -EAGAIN;
+
+        /* a failed datagram is dropped, the others may still go out */
+        if (len < 0)
+            loge("send datagram fail, ret=%d, droped.\n", -errno);
+
+        queue_out(ioh->q_out);
+        iohandler_out_retire(ioh, pack);
+    }
+
+    return 0;
+}
+
+static int iohandler_write(iohandler_t *ioh)
+{
+    int ret;
+    int writable;
+
+    logv("iohandler send data.\n");
+
+    switch (ioh->type) {
+        case HANDLER_TYPE_NORMAL:
+        case HANDLER_TYPE_TCP:
+            ret = iohandler_write_stream(ioh);
+            break;
+        case HANDLER_TYPE_UDP:
+            if (ioh->flags & IOHANDLER_F_MMSG)
+                ret = iohandler_write_mmsg(ioh);
+            else
+                ret = iohandler_write_dgram(ioh);
+            break;
+        case HANDLER_TYPE_TCP_ACCEPT:
+        default:
+            BUG();
+    }
+
+    if (ret < 0 && ret != -EAGAIN) {
+        loge("send data fail, ret=%d, droped.\n", ret);
+        iohandler_drop_output(ioh);
+    }
+
+    pthread_mutex_lock(&ioh->lock);
+    if (queue_count(ioh->q_out) == 0)
+        poller_event_disable(&ioh->reactor->poller, ioh->fd, EV_WRITE);
+
+    ioh->out_bytes -= ioh->retired_bytes;
+    ioh->out_packets -= ioh->retired_packets;
+    ioh->retired_bytes = 0;
+    ioh->retired_packets = 0;
+
+    writable = ioh->wm.above && iohandler_below_low_wm(ioh);
+    if (writable) {
+        ioh->wm.above = 0;
+        pthread_cond_broadcast(&ioh->wm_cond);
+    }
+    pthread_mutex_unlock(&ioh->lock);
+
+    if (writable && ioh->on_writable)
+        ioh->on_writable(ioh->priv_data);
+
+    /* batch limit hit with room left in the socket: no new edge will come */
+    if (!ret && (ioh->flags & IOHANDLER_F_EDGE) && queue_count(ioh->q_out))
+        poller_event_pending(&ioh->reactor->poller, ioh->fd, EV_WRITE);
+
+    return ret;
+}
+
+
+/* iohandler file descriptor event callback for read/write ops */
+/* a multishot recv of a stream completed, see poller_event_recv().
+ * @buf is a full size pack_buf_t of aio->buf_pool, ours from now on */
+static void iohandler_recv_event(void *data, void *buf, int res)
+{
+    iohandler_t *ioh = (iohandler_t *)data;
+    pack_buf_t *pkb = (pack_buf_t *)buf;
+    struct iopacket *pack;
+
+    if (res <= 0) {
+        if (pkb)
+            pack_buf_free(pkb);
+        if (res < 0)
+            loge("iohandler recv on fd %d failed(%d).\n", ioh->fd, res);
+        iohandler_close(ioh);
+        return;
+    }
+
+    pack_buf_trim(pkb, res);
+    pack = iohandler_pack_alloc(ioh, 0);
+    pack->packet.buf = pkb;
+    iohandler_in_pack_queue(ioh, pack);
+}
+
+static void iohandler_event(void *data, int events)
+{
+    iohandler_t *ioh = (iohandler_t *)data;
+
+    /* in certain cases, it's possible to have both EPOLLIN and
+     * EPOLLHUP at the same time. This indicates that there is incoming
+     * data to read, but that the connection was nonetheless closed
+     * by the sender. Be sure to read the data before closing
+     * the receiver to avoid packet loss.
+     */
+    if (events & EV_READ) {
+        if (iohandler_read(ioh) == -EPIPE)
+            return;
+    }
+
+    if (events & EV_WRITE) {
+        iohandler_write(ioh);
+    }
+
+    if (events & (EV_HUP | EV_ERROR)) {
+        /* disconnection */
+        loge("iohandler disconnect on fd %d", ioh->fd);
+        iohandler_close(ioh);
+        return;
+    }
+}
+
+/* pick the reactor a new fd is bound to, with aio->lock held. */
+static struct ioreactor *ioasync_select_reactor(ioasync_t *aio, int fd)
+{
+    int i;
+    struct ioreactor *r;
+
+    if (aio->nr_reactors == 1)
+        return aio->reactors;
+
+    switch (aio->policy) {
+        case IOASYNC_POLICY_LEAST_LOADED:
+            r = aio->reactors;
+            for (i = 1; i < aio->nr_reactors; i++) {
+                if (aio->reactors[i].nr_handlers < r->nr_handlers)
+                    r = aio->reactors + i;
+            }
+            return r;
+        case IOASYNC_POLICY_FD_HASH:
+        default:
+            return aio->reactors + ((unsigned int)fd % aio->nr_reactors);
+    }
+}
+
+/* the reactor reserved for @fd by the accept batch delivered on this
+ * thread, if any, with aio->lock held. */
+static struct ioreactor *ioasync_claim_reactor(ioasync_t *aio, int fd)
+{
+    int i, j;
+    struct ioreactor *r;
+    struct iohandler_accept_call *call;
+
+    for (i = 0; i < aio->nr_reactors; i++) {
+        r = aio->reactors + i;
+        /* accept_call belongs to the reactor thread, test that first */
+        if (!pthread_equal(r->thread, pthread_self()))
+            continue;
+
+        call = r->accept_call;
+        for (j = 0; call && j < call->nr; j++) {
+            if (call->fds[j] == fd && !call->claimed[j]) {
+                call->claimed[j] = 1;
+                return r;
+            }
+        }
+        break;
+    }
+    return NULL;
+}
+
+static iohandler_t *ioasync_alloc_context(ioasync_t *aio, int fd, int type,
+                                          int flags)
+{
+    iohandler_t *ioh;
+    struct ioreactor *r;
+
+    ioh = malloc(sizeof(*ioh));
     if (!ioh)
         return NULL;
 
     ioh->fd = fd;
     ioh->type = type;
-    ioh->flags = 0;
+    ioh->flags = flags & IOHANDLER_DISPATCH_INLINE;
     ioh->closing = 0;
-
-    /*XXX*/
-    ioh->wq = alloc_workqueue(0, WQ_CPU_INTENSIVE);
+    ioh->out_pos = 0;
+    ioh->mmsg = NULL;
+    ioh->rx_truncated = 0;
+    ioh->rx_size = PACKET_MAX_PAYLOAD;
+    ioh->out_bytes = 0;
+    ioh->out_packets = 0;
+    ioh->retired_bytes = 0;
+    ioh->retired_packets = 0;
+    memset(&ioh->wm, 0, sizeof(ioh->wm));
+    ioh->on_writable = NULL;
+    /* nothing is dispatched before the creator fills them */
+    memset(&ioh->h_ops, 0, sizeof(ioh->h_ops));
+    ioh->priv_data = NULL;
+    pthread_cond_init(&ioh->wm_cond, NULL);
+    ioh->wm_dead = 0;
+    ioh->wm_waiters = 0;
+    ioh->read_budget = IOHANDLER_DEF_READ_BUDGET;
+    ioh->read_packets = IOHANDLER_DEF_READ_PACKETS;
+
+    strand_init(&ioh->strand, aio->wq);
 
     ioh->q_in = queue_init(0);
     ioh->q_out = queue_init(0);
@@ -438,33 +1480,182 @@ static iohandler_t *ioasync_create_context(ioasync_t *aio, int fd, int type)
 
     /*Add to active list*/
     pthread_mutex_lock(&aio->lock);
+    r = ioasync_claim_reactor(aio, fd);
+    if (!r) {
+        r = ioasync_select_reactor(aio, fd);
+        r->nr_handlers++;
+    }
+    ioh->reactor = r;
     list_add(&ioh->entry, &aio->active_list);
     pthread_mutex_unlock(&aio->lock);
 
-    poller_event_add(&aio->poller, fd, iohandler_event, ioh);
-    poller_event_enable(&aio->poller, fd, EV_READ);
     return ioh;
 }
 
+/*
+ * hand @ioh to its reactor, its callbacks may run from now on: h_ops
+ * and priv_data must be set before, see iohandler_create().
+ */
+static void iohandler_start(iohandler_t *ioh)
+{
+    struct poller *poller = &ioh->reactor->poller;
+
+    poller_event_add(poller, ioh->fd, iohandler_event, ioh);
+    /* no read() per wakeup on io_uring, the kernel fills our buffers */
+    if (ioh->type == HANDLER_TYPE_NORMAL || ioh->type == HANDLER_TYPE_TCP)
+        poller_event_recv(poller, ioh->fd, iohandler_recv_event);
+    poller_event_enable(poller, ioh->fd, EV_READ);
+}
+
+
+/**
+ * iohandler_set_edge_triggered - switch @ioh to edge-triggered mode
+ * @ioh: the handler
+ * @budget: max bytes read per wakeup, 0 for the default
+ * @max_packets: max packets read per wakeup, 0 for the default
+ *
+ * The fd is made non-blocking and drained until EAGAIN on each wakeup,
+ * bounded by the budget so that one busy fd can not starve the others
+ * of its reactor.
+ */
+void iohandler_set_edge_triggered(iohandler_t *ioh, int budget,
+                                  int max_packets)
+{
+    ioh->read_budget = budget > 0 ? budget : IOHANDLER_DEF_READ_BUDGET;
+    ioh->read_packets = max_packets > 0 ?
+                        max_packets : IOHANDLER_DEF_READ_PACKETS;
+    ioh->flags |= IOHANDLER_F_EDGE;
+
+    /* draining until EAGAIN must never block the reactor */
+    setnonblock(ioh->fd);
+    poller_event_enable(&ioh->reactor->poller, ioh->fd, EV_ET);
+}
+
+/**
+ * iohandler_udp_set_batch - receive and send datagrams in batches
+ * @ioh: an iohandler created by iohandler_udp_create()
+ * @batch: datagrams per recvmmsg()/sendmmsg() call, 0 for the default
+ *
+ * Call it right after iohandler_udp_create(), before any traffic.
+ * Unlike the unbatched path, datagrams over PACKET_MAX_PAYLOAD do not
+ * fit a receive slot: they are dropped and logged.
+ * Returns 0 on success, -EINVAL if @ioh is not a udp handler.
+ */
+int iohandler_udp_set_batch(iohandler_t *ioh, int batch)
+{
+    if (ioh->type != HANDLER_TYPE_UDP || ioh->mmsg)
+        return -EINVAL;
+
+    if (batch <= 0)
+        batch = IOHANDLER_DEF_MMSG_BATCH;
+    batch = min(batch, IOHANDLER_MMSG_MAX);
+
+    setnonblock(ioh->fd);
+    ioh->mmsg = iohandler_mmsg_alloc(batch);
+    ioh->flags |= IOHANDLER_F_MMSG;
+    return 0;
+}
+
+/**
+ * iohandler_set_watermarks - bound the output queue of @ioh
+ * @high_bytes: queued bytes at which sends are refused, 0 for no limit
+ * @low_bytes: queued bytes at which on_writable fires again
+ * @high_packets: same as @high_bytes, counted in packets
+ * @low_packets: same as @low_bytes, counted in packets
+ * @flags: IOHANDLER_WM_BLOCK makes senders wait for the queue to drain
+ *         instead of failing with -EAGAIN. They are woken with -EPIPE
+ *         when the handler is shut down or closed.
+ *
+ * A low watermark of 0 with a non zero high one means half the high one.
+ */
+void iohandler_set_watermarks(iohandler_t *ioh, int high_bytes, int low_bytes,
+                              int high_packets, int low_packets, int flags)
+{
+    struct iohandler_wm *wm = &ioh->wm;
+
+    pthread_mutex_lock(&ioh->lock);
+    wm->high_bytes = high_bytes;
+    wm->low_bytes = low_bytes ? : high_bytes / 2;
+    wm->high_packets = high_packets;
+    wm->low_packets = low_packets ? : high_packets / 2;
+    wm->flags = flags;
+
+    /* senders may wait on limits that no longer hold */
+    pthread_cond_broadcast(&ioh->wm_cond);
+    pthread_mutex_unlock(&ioh->lock);
+}
+
+/**
+ * iohandler_set_writable_cb - called once the output queue of @ioh drops
+ * to its low watermark after having reached the high one. Runs on the
+ * reactor thread with the handler's priv data.
+ */
+void iohandler_set_writable_cb(iohandler_t *ioh, void (*on_writable)(void *))
+{
+    ioh->on_writable = on_writable;
+}
+
+/**
+ * iohandler_init_timer - initialize a timer which fires on the reactor of @ioh
+ *
+ * The timer function then runs on the thread handling the I/O of @ioh,
+ * which makes per-connection timeouts cheap and free of locking against
+ * the inline handlers.
+ */
+void iohandler_init_timer(iohandler_t *ioh, struct timer_list *timer)
+{
+    init_timer_on(timer, poller_timer_base(&ioh->reactor->poller));
+}
+
+/**
+ * iohandler_pause_read - stop reading from @ioh
+ *
+ * Lets a proxy push back on its peer while the other side's output
+ * queue is full: the data stays in the kernel socket buffer and the
+ * sender is slowed down by flow control.
+ */
+void iohandler_pause_read(iohandler_t *ioh)
+{
+    poller_event_disable(&ioh->reactor->poller, ioh->fd, EV_READ);
+}
+
+void iohandler_resume_read(iohandler_t *ioh)
+{
+    /* re-arming reports data that is already there, edge-triggered too */
+    poller_event_enable(&ioh->reactor->poller, ioh->fd, EV_READ);
+}
 
 static void iohandler_normal_post(void *priv, struct iopacket *pkt)
 {
     iohandler_t *ioh = (iohandler_t *)priv;
     pack_buf_t *pkb = pkt->packet.buf;
 
-    if (!pkb)
+    if (!pkb || !ioh->h_ops.handle)
         return;
 
-    if (ioh->h_ops.handle)
-        ioh->h_ops.handle(ioh->priv_data, pkb->data, pkb->len);
+    /* reads for @handle are never chained, see iohandler_rx_max() */
+    ioh->h_ops.handle(ioh->priv_data, pkb->data, pkb->len);
 }
 
+/**
+ * iohandler_create - watch @fd and pass whatever is read to @handle
+ * @flags: IOHANDLER_DISPATCH_DEFERRED runs @handle on a worker thread,
+ *         IOHANDLER_DISPATCH_INLINE runs it directly on the reactor
+ *         thread, which then must not block.
+ *
+ * Each read is passed as one buffer of at most PACKET_MAX_PAYLOAD
+ * bytes, data_to_pack_buf() on it gives a whole pack_buf_t which can
+ * be relayed with iohandler_pkt_forward().
+ */
 iohandler_t *iohandler_create(ioasync_t *aio, int fd,
-                              void (*handle)(void *, uint8_t *, int), void (*close)(void *), void *priv)
+                              void (*handle)(void *, uint8_t *, int), void (*close)(void *), void *priv,
+                              int flags)
 {
     iohandler_t *ioh;
 
-    ioh = ioasync_create_context(aio, fd, HANDLER_TYPE_NORMAL);
+    ioh = ioasync_alloc_context(aio, fd, HANDLER_TYPE_NORMAL, flags);
+    if (!ioh)
+        return NULL;
 
     ioh->h_ops.post = iohandler_normal_post;
     ioh->h_ops.handle = handle;
@@ -472,6 +1663,51 @@ iohandler_t *iohandler_create(ioasync_t *aio, int fd,
 
     ioh->priv_data = priv;
 
+    iohandler_start(ioh);
+    return ioh;
+}
+
+static void iohandler_pkb_post(void *priv, struct iopacket *pkt)
+{
+    iohandler_t *ioh = (iohandler_t *)priv;
+    pack_buf_t *pkb = pkt->packet.buf;
+
+    if (!pkb)
+        return;
+
+    /* hand the buffer over, iohandler_pack_free() must not free it */
+    pkt->packet.buf = NULL;
+    if (ioh->h_ops.handle_pkb)
+        ioh->h_ops.handle_pkb(ioh->priv_data, pkb);
+    else
+        pack_buf_free(pkb);
+}
+
+/**
+ * iohandler_pkb_create - like iohandler_create(), without the copy
+ * @handle_pkb: gets each received pack_buf_t and owns that reference:
+ *              it must release it with iohandler_pack_buf_free(), or
+ *              pass it on, e.g. with iohandler_pkt_send(). A large read
+ *              comes as a chain, follow pkb->next.
+ */
+iohandler_t *iohandler_pkb_create(ioasync_t *aio, int fd,
+                                  void (*handle_pkb)(void *, pack_buf_t *),
+                                  void (*close)(void *), void *priv, int flags)
+{
+    iohandler_t *ioh;
+
+    ioh = ioasync_alloc_context(aio, fd, HANDLER_TYPE_NORMAL, flags);
+    if (!ioh)
+        return NULL;
+
+    ioh->flags |= IOHANDLER_F_CHAIN;
+    ioh->h_ops.post = iohandler_pkb_post;
+    ioh->h_ops.handle_pkb = handle_pkb;
+    ioh->h_ops.close = close;
+
+    ioh->priv_data = priv;
+
+    iohandler_start(ioh);
     return ioh;
 }
 
@@ -496,7 +1732,9 @@ iohandler_t *iohandler_accept_create(ioasync_t *aio, int fd,
 {
     iohandler_t *ioh;
 
-    ioh = ioasync_create_context(aio, fd, HANDLER_TYPE_TCP_ACCEPT);
+    ioh = ioasync_alloc_context(aio, fd, HANDLER_TYPE_TCP_ACCEPT, 0);
+    if (!ioh)
+        return NULL;
 
     ioh->h_ops.post = iohandler_accept_post;
     ioh->h_ops.accept = accept;
@@ -504,7 +1742,51 @@ iohandler_t *iohandler_accept_create(ioasync_t *aio, int fd,
 
     ioh->priv_data = priv;
 
-    listen(fd, 50);
+    listen(fd, IOHANDLER_DEF_BACKLOG);
+    iohandler_start(ioh);
+
+    return ioh;
+}
+
+/**
+ * iohandler_accept_batch_create - create a listener for high accept rates
+ * @accept_batch: called with up to IOHANDLER_ACCEPT_BATCH accepted fds,
+ *      which are non-blocking and close-on-exec and owned by the callee
+ * @backlog: listen() backlog, 0 for IOHANDLER_DEF_BACKLOG
+ * @flags: IOHANDLER_ACCEPT_SPREAD to deliver each fd on its reactor
+ *
+ * The listener is drained with accept4() on each wakeup and the fds are
+ * handed over directly, without packets nor worker threads: the callback
+ * runs on a reactor thread and must not block. With
+ * IOHANDLER_ACCEPT_SPREAD an iohandler created for an fd from within the
+ * callback stays on the reactor it was delivered on.
+ */
+iohandler_t *iohandler_accept_batch_create(ioasync_t *aio, int fd,
+                                           void (*accept_batch)(void *, int *, int),
+                                           void (*close)(void *), void *priv,
+                                           int backlog, int flags)
+{
+    iohandler_t *ioh;
+
+    setnonblock(fd);
+
+    ioh = ioasync_alloc_context(aio, fd, HANDLER_TYPE_TCP_ACCEPT,
+                                IOHANDLER_DISPATCH_INLINE);
+    if (!ioh)
+        return NULL;
+
+    ioh->flags |= IOHANDLER_F_ACCEPT_BATCH;
+    if (flags & IOHANDLER_ACCEPT_SPREAD)
+        ioh->flags |= IOHANDLER_F_ACCEPT_SPREAD;
+
+    ioh->h_ops.post = NULL;
+    ioh->h_ops.accept_batch = accept_batch;
+    ioh->h_ops.close = close;
+
+    ioh->priv_data = priv;
+
+    listen(fd, backlog > 0 ? backlog : IOHANDLER_DEF_BACKLOG);
+    iohandler_start(ioh);
 
     return ioh;
 }
@@ -515,7 +1797,9 @@ iohandler_t *iohandler_tcp_create(ioasync_t *aio, int fd,
 {
     iohandler_t *ioh;
 
-    ioh = ioasync_create_context(aio, fd, HANDLER_TYPE_TCP);
+    ioh = ioasync_alloc_context(aio, fd, HANDLER_TYPE_TCP, 0);
+    if (!ioh)
+        return NULL;
 
     ioh->h_ops.post = iohandler_normal_post;
     ioh->h_ops.handle = handle;
@@ -523,6 +1807,7 @@ iohandler_t *iohandler_tcp_create(ioasync_t *aio, int fd,
 
     ioh->priv_data = priv;
 
+    iohandler_start(ioh);
     return ioh;
 }
 
@@ -532,20 +1817,42 @@ static void iohandler_udp_post(void *priv, struct iopacket *pkt)
     iohandler_t *ioh = (iohandler_t *)priv;
     pack_buf_t *pkb = pkt->packet.buf;
 
-    if (!pkb)
+    uint8_t *data;
+    int len;
+
+    if (!pkb || !ioh->h_ops.handlefrom)
         return;
 
-    if (ioh->h_ops.handlefrom)
+    if (!pkb->next) {
         ioh->h_ops.handlefrom(ioh->priv_data, pkb->data, pkb->len, &pkt->addr);
+        return;
+    }
+
+    /* a datagram above PACKET_MAX_PAYLOAD, delivered in one piece */
+    len = pack_buf_chain_len(pkb);
+    data = xzalloc(len);
+    pack_buf_copy_out(pkb, data, len);
+    ioh->h_ops.handlefrom(ioh->priv_data, data, len, &pkt->addr);
+    free(data);
 }
 
+/**
+ * iohandler_udp_create - watch the udp socket @fd
+ * @flags: dispatch mode of @handlefrom, see iohandler_create()
+ *
+ * A datagram above PACKET_MAX_PAYLOAD is passed from a temporary copy,
+ * which data_to_pack_buf() does not apply to: relays use
+ * iohandler_udp_pkb_create().
+ */
 iohandler_t *iohandler_udp_create(ioasync_t *aio, int fd,
                                   void (*handlefrom)(void *, uint8_t *, int, void *),
-                                  void (*close)(void *), void *priv)
+                                  void (*close)(void *), void *priv, int flags)
 {
     iohandler_t *ioh;
 
-    ioh = ioasync_create_context(aio, fd, HANDLER_TYPE_UDP);
+    ioh = ioasync_alloc_context(aio, fd, HANDLER_TYPE_UDP, flags);
+    if (!ioh)
+        return NULL;
 
     ioh->h_ops.post = iohandler_udp_post;
     ioh->h_ops.handlefrom = handlefrom;
@@ -553,72 +1860,201 @@ iohandler_t *iohandler_udp_create(ioasync_t *aio, int fd,
 
     ioh->priv_data = priv;
 
+    iohandler_start(ioh);
+    return ioh;
+}
+
+static void iohandler_udp_pkb_post(void *priv, struct iopacket *pkt)
+{
+    iohandler_t *ioh = (iohandler_t *)priv;
+    pack_buf_t *pkb = pkt->packet.buf;
+
+    if (!pkb)
+        return;
+
+    pkt->packet.buf = NULL;
+    if (ioh->h_ops.handlefrom_pkb)
+        ioh->h_ops.handlefrom_pkb(ioh->priv_data, pkb, &pkt->addr);
+    else
+        pack_buf_free(pkb);
+}
+
+/**
+ * iohandler_udp_pkb_create - like iohandler_udp_create(), without the copy
+ * @handlefrom_pkb: owns the received pack_buf_t, see iohandler_pkb_create()
+ */
+iohandler_t *iohandler_udp_pkb_create(ioasync_t *aio, int fd,
+                                      void (*handlefrom_pkb)(void *, pack_buf_t *, void *),
+                                      void (*close)(void *), void *priv, int flags)
+{
+    iohandler_t *ioh;
+
+    ioh = ioasync_alloc_context(aio, fd, HANDLER_TYPE_UDP, flags);
+    if (!ioh)
+        return NULL;
+
+    ioh->h_ops.post = iohandler_udp_pkb_post;
+    ioh->h_ops.handlefrom_pkb = handlefrom_pkb;
+    ioh->h_ops.close = close;
+
+    ioh->priv_data = priv;
+
+    iohandler_start(ioh);
     return ioh;
 }
 
 static void *ioasync_handle(void *args)
 {
-    ioasync_t *aio = (ioasync_t *)args;
+    struct ioreactor *r = (struct ioreactor *)args;
 
-    poller_loop(&aio->poller);
+    poller_loop(&r->poller);
     return 0;
 }
 
-ioasync_t *ioasync_init(void)
+/* provided buffers of the io_uring reactors, see poller_recv_init() */
+static void *ioasync_recv_buf_get(void *arg, void **addr, int *size)
+{
+    ioasync_t *aio = (ioasync_t *)arg;
+    pack_buf_t *pkb;
+
+    pkb = pack_buf_alloc(aio->buf_pool);
+    if (!pkb)
+        return NULL;
+
+    *addr = pkb->data;
+    *size = pkb->size;
+    return pkb;
+}
+
+static void ioasync_recv_buf_put(void *arg, void *buf)
+{
+    pack_buf_free((pack_buf_t *)buf);
+}
+
+static const struct poller_buf_ops ioasync_recv_buf_ops = {
+    .get = ioasync_recv_buf_get,
+    .put = ioasync_recv_buf_put,
+};
+
+static void ioasync_stop_reactors(ioasync_t *aio, int count)
 {
+    int i;
+    struct ioreactor *r;
+
+    for (i = 0; i < count; i++) {
+        r = aio->reactors + i;
+        poller_done(&r->poller);
+        pthread_join(r->thread, NULL);
+        poller_release(&r->poller);
+    }
+}
+
+/**
+ * ioasync_create - create an ioasync object with several reactors
+ * @nr_reactors: number of poller threads, 0 means one per online cpu
+ * @policy: IOASYNC_POLICY_*, how new iohandlers are spread on reactors
+ * @backend: POLLER_BACKEND_*, event notification used by the reactors
+ *
+ * The reactor threads are placed as THREAD_CLASS_POLLER ones, the i-th
+ * reactor on the i-th cpu of the poller cpu set if there's one.
+ */
+ioasync_t *ioasync_create(int nr_reactors, int policy, int backend)
+{
+    int i;
     int ret;
-    pthread_t thread;
     ioasync_t *aio;
+    struct ioreactor *r;
+    char name[32];     /* cut by thread_place() */
+
+    if (nr_reactors <= 0)
+        nr_reactors = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nr_reactors <= 0)
+        nr_reactors = 1;
 
     aio = malloc(sizeof(*aio));
     if (!aio)
         return NULL;
 
-    poller_init(&aio->poller);
+    aio->reactors = calloc(nr_reactors, sizeof(struct ioreactor));
+    if (!aio->reactors) {
+        free(aio);
+        return NULL;
+    }
+
+    aio->nr_reactors = nr_reactors;
+    aio->policy = policy;
 
     aio->pkt_pool = mempool_create(sizeof(struct iopacket), 128, 0);
-    aio->buf_pool = create_pack_buf_pool(PACKET_MAX_PAYLOAD, 128);
+    aio->buf_pool = create_pack_buf_pool_sizes(ioasync_buf_sizes,
+                                               ARRAY_SIZE(ioasync_buf_sizes), 128);
+    aio->wq = alloc_workqueue(WQ_MAX_ACTIVE, WQ_CPU_INTENSIVE);
 
     INIT_LIST_HEAD(&aio->active_list);
     INIT_LIST_HEAD(&aio->closing_list);
 
     pthread_mutex_init(&aio->lock, NULL);
 
-    ret = pthread_create(&thread, NULL, ioasync_handle, aio);
-    if (ret) {
-        ret = -EINVAL;
-        goto fail;
+    for (i = 0; i < nr_reactors; i++) {
+        r = aio->reactors + i;
+        r->id = i;
+        r->owner = aio;
+        r->nr_handlers = 0;
+        r->accept_call = NULL;
+
+        ret = poller_init_backend(&r->poller, backend);
+        if (ret)
+            goto fail;
+        /* streams then use multishot recvs, if the kernel has them */
+        if (backend == POLLER_BACKEND_URING)
+            poller_recv_init(&r->poller, &ioasync_recv_buf_ops, aio);
+
+        ret = pthread_create(&r->thread, NULL, ioasync_handle, r);
+        if (ret) {
+            poller_release(&r->poller);
+            goto fail;
+        }
+
+        snprintf(name, sizeof(name), "ioasync/%d", i);
+        thread_place(r->thread, THREAD_CLASS_POLLER, i, name);
     }
 
     aio->initialized = 1;
     return aio;
 
 fail:
-    poller_done(&aio->poller);
+    loge("ioasync create reactor %d failed(%d).\n", i, ret);
+    ioasync_stop_reactors(aio, i);
 
+    destroy_workqueue(aio->wq);
     free_pack_buf_pool(aio->buf_pool);
     mempool_release(aio->pkt_pool);
 
+    free(aio->reactors);
     free(aio);
     return NULL;
 }
 
-#if 0
-void ioasync_loop(ioasync_t *aio)
+ioasync_t *ioasync_init(void)
+{
+    return ioasync_create(1, IOASYNC_POLICY_FD_HASH, POLLER_BACKEND_EPOLL);
+}
+
+int ioasync_reactor_count(ioasync_t *aio)
 {
-    poller_loop(&aio->poller);
+    return aio->nr_reactors;
 }
-#endif
 
 void ioasync_release(ioasync_t *aio)
 {
     aio->initialized = 0;
 
-    poller_done(&aio->poller);
+    ioasync_stop_reactors(aio, aio->nr_reactors);
 
+    destroy_workqueue(aio->wq);
     free_pack_buf_pool(aio->buf_pool);
     mempool_release(aio->pkt_pool);
 
+    free(aio->reactors);
     free(aio);
 }
 
@@ -14,11 +14,12 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include <include/core.h>
 #include <include/types.h>
 #include <include/log.h>
-#include <include/bsearch.h>
 #include <include/compiler.h>
 #include <include/mempool.h>
 
@@ -31,9 +32,58 @@ struct mempool {
     int bsize; /* block size */
     int init_count; /* initiailized count for blocks ever alloced */
     int count; /* total count for blocks ever alloced */
-    int used; 	/* used block count */
+    int used; 	/* used block count, blocks in thread caches included */
     int dynamic_used; 	/* used block count */
     int limited; /* is resource limited to initial count? */
+
+    /* per-thread magazines, see mempool_get_cache() */
+    int cached;
+    int cache_size;     /* blocks a magazine holds at most */
+    int cache_batch;    /* blocks moved to or from the depot at once */
+    pthread_key_t cache_key;
+    struct list_head caches;
+
+    /* arena mode, see mempool_create_flags() */
+    int flags;
+    int slab_blocks;    /* blocks carved out of each slab */
+    size_t slab_size;   /* power of 2, slabs are aligned on it */
+    size_t page_size;
+    struct list_head slabs;         /* in use, carved ones first */
+    struct list_head idle_slabs;    /* empty, pages given back */
+    struct mempool_slab *carve;     /* first slab with uncarved blocks */
+};
+
+/*
+ * Arena slab: a slab_size aligned mapping, this header first, then
+ * slab_blocks cache line aligned blocks. The slab of a block is found
+ * by masking its address.
+ */
+struct mempool_slab {
+    struct list_head entry;
+    int inuse;      /* blocks out of the depot, in thread caches too */
+    int carved;     /* blocks ever put on free_list, from the start */
+} ____cacheline_aligned;
+
+#define MEMPOOL_SLAB_SIZE       (2 * 1024 * 1024)
+#define MEMPOOL_SLAB_MIN_BLOCKS (8)
+
+/*
+ * Per-thread cache of free blocks in front of the pool. Allocations and
+ * frees only touch the calling thread's magazine, pool->lock is taken
+ * once per pool->cache_batch blocks to refill it from, or flush it to,
+ * the shared free lists (the depot). A magazine holds up to
+ * MEMPOOL_CACHE_SIZE blocks but no more than about MEMPOOL_CACHE_BYTES,
+ * so that every thread does not pin dozens of large blocks.
+ */
+#define MEMPOOL_CACHE_SIZE      (64)
+#define MEMPOOL_CACHE_MIN       (2)
+#define MEMPOOL_CACHE_BYTES     (64 * 1024)
+
+struct mempool_cache {
+    mempool_t *pool;
+    int count;
+    struct list_head entry; /* on pool->caches */
+    void *objs[MEMPOOL_CACHE_SIZE];
 };
 
 
@@ -45,7 +95,190 @@ struct block {
 
 #define block_entry(buf)  ((struct block *)(buf))
 
-mempool_t *mempool_create(int block_size, int init_count, int limited)
+static void mempool_cache_destroy(void *data);
+
+#define is_arena(pool)  ((pool)->flags & MEMPOOL_F_ARENA)
+
+static inline struct mempool_slab *block_slab(mempool_t *pool, void *buf)
+{
+    return (struct mempool_slab *)((uintptr_t)buf & ~(pool->slab_size - 1));
+}
+
+static inline void *slab_block(mempool_t *pool, struct mempool_slab *slab,
+                               int i)
+{
+    return (uint8_t *)slab + sizeof(*slab) + (size_t)i * pool->bsize;
+}
+
+/* map a slab_size aligned area, NULL on failure */
+static void *mempool_slab_map(mempool_t *pool)
+{
+    uint8_t *p;
+    size_t len = pool->slab_size;
+    int populate = (pool->flags & MEMPOOL_F_POPULATE) ? MAP_POPULATE : 0;
+    uintptr_t head;
+
+#ifdef MAP_HUGETLB
+    /* hugetlb mappings come aligned on the huge page size */
+    if (pool->flags & MEMPOOL_F_HUGETLB) {
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | populate, -1, 0);
+        if (p != MAP_FAILED) {
+            if (!((uintptr_t)p & (len - 1)))
+                return p;
+            munmap(p, len);
+        }
+    }
+#endif
+
+    /* map twice the size and trim to get the alignment */
+    p = mmap(NULL, len * 2, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+
+    head = ALIGN((uintptr_t)p, len) - (uintptr_t)p;
+    if (head)
+        munmap(p, head);
+    munmap(p + head + len, len - head);
+    p += head;
+
+#ifdef MADV_HUGEPAGE
+    if (pool->flags & MEMPOOL_F_THP)
+        madvise(p, len, MADV_HUGEPAGE);
+#endif
+#ifdef MADV_POPULATE_WRITE
+    if (populate)
+        madvise(p, len, MADV_POPULATE_WRITE);
+#endif
+    return p;
+}
+
+/* add a slab worth of blocks to the pool, with pool->lock held. they
+ * are carved on demand, see mempool_carve(), so that only the pages
+ * actually used are faulted in */
+static int mempool_grow_slab(mempool_t *pool)
+{
+    struct mempool_slab *slab;
+
+    if (!list_empty(&pool->idle_slabs)) {
+        slab = list_first_entry(&pool->idle_slabs, struct mempool_slab, entry);
+        list_del(&slab->entry);
+#ifdef MADV_POPULATE_WRITE
+        if (pool->flags & MEMPOOL_F_POPULATE)
+            madvise(slab, pool->slab_size, MADV_POPULATE_WRITE);
+#endif
+    } else {
+        slab = mempool_slab_map(pool);
+        if (!slab)
+            return -ENOMEM;
+    }
+
+    slab->inuse = 0;
+    slab->carved = 0;
+    /* slabs after pool->carve are all uncarved */
+    list_add_tail(&slab->entry, &pool->slabs);
+    if (!pool->carve)
+        pool->carve = slab;
+
+    pool->count += pool->slab_blocks;
+    return 0;
+}
+
+/* the carve slab is used up, or going away: move on to the next one */
+static void mempool_carve_next(mempool_t *pool)
+{
+    struct mempool_slab *slab = pool->carve;
+
+    if (list_is_last(&slab->entry, &pool->slabs))
+        pool->carve = NULL;
+    else
+        pool->carve = list_entry(slab->entry.next, struct mempool_slab, entry);
+}
+
+/* a never used block of the slabs, NULL if there's none left */
+static struct block *mempool_carve(mempool_t *pool)
+{
+    struct mempool_slab *slab = pool->carve;
+
+    if (!slab)
+        return NULL;
+
+    if (slab->carved + 1 == pool->slab_blocks)
+        mempool_carve_next(pool);
+    return block_entry(slab_block(pool, slab, slab->carved++));
+}
+
+/*
+ * All blocks of @slab are back: unless the pool would be left with
+ * less than a slab of free blocks, or less than its initial count,
+ * pull them off the depot and give the pages back to the OS. The
+ * mapping is kept for the next growth.
+ */
+static void mempool_slab_empty(mempool_t *pool, struct mempool_slab *slab)
+{
+    int i;
+    struct block *b;
+
+    if (pool->count - pool->used < 2 * pool->slab_blocks ||
+        pool->count - pool->slab_blocks < pool->init_count)
+        return;
+
+    for (i = 0; i < slab->carved; i++) {
+        b = block_entry(slab_block(pool, slab, i));
+        list_del(&b->free);
+    }
+    if (slab == pool->carve)
+        mempool_carve_next(pool);
+    pool->count -= pool->slab_blocks;
+
+    /* the first page holds the header, which stays on idle_slabs */
+    list_move(&slab->entry, &pool->idle_slabs);
+    madvise((uint8_t *)slab + pool->page_size,
+            pool->slab_size - pool->page_size, MADV_DONTNEED);
+}
+
+/* with arena mode set up, build enough slabs for the initial count */
+static int mempool_arena_init(mempool_t *pool, int init_count)
+{
+    size_t need;
+
+    size_t align = 16;
+
+    /* blocks never straddle a cache line: the big ones start on one,
+     * the small ones are padded to a power of 2 that divides it */
+    while (align < L1_CACHE_BYTES && align < pool->bsize)
+        align <<= 1;
+    pool->bsize = ALIGN(pool->bsize, align);
+    pool->page_size = sysconf(_SC_PAGESIZE);
+
+    need = sizeof(struct mempool_slab) +
+           (size_t)MEMPOOL_SLAB_MIN_BLOCKS * pool->bsize;
+    pool->slab_size = MEMPOOL_SLAB_SIZE;
+    while (pool->slab_size < need)
+        pool->slab_size <<= 1;
+
+    pool->slab_blocks = (pool->slab_size - sizeof(struct mempool_slab)) /
+                        pool->bsize;
+
+    pool->count = 0;
+    while (pool->count < init_count) {
+        if (mempool_grow_slab(pool))
+            return -ENOMEM;
+    }
+    return 0;
+}
+
+/**
+ * mempool_create_flags - create a pool of @init_count blocks
+ * @limited: never grow past @init_count blocks
+ * @flags: MEMPOOL_F_*. MEMPOOL_F_ARENA lays the blocks out contiguously,
+ *      cache line aligned, in large mmap'd slabs which the pool grows
+ *      by, and whose pages are given back once all their blocks are
+ *      free. The other flags tune those slabs.
+ */
+mempool_t *mempool_create_flags(int block_size, int init_count, int limited,
+                                int flags)
 {
     mempool_t *pool = (mempool_t *)malloc(sizeof(mempool_t));
 
@@ -56,8 +289,28 @@ mempool_t *mempool_create(int block_size, int init_count, int limited)
     pool->init_count = pool->count = init_count;
     pool->used = pool->dynamic_used = 0;
     pool->limited = limited;
-
-    if (init_count > 0) {
+    pool->buf = NULL;
+    pool->flags = flags;
+    INIT_LIST_HEAD(&pool->slabs);
+    INIT_LIST_HEAD(&pool->idle_slabs);
+    pool->carve = NULL;
+
+    pool->cache_size = clamp(MEMPOOL_CACHE_BYTES / max(block_size, 1),
+                             MEMPOOL_CACHE_MIN, MEMPOOL_CACHE_SIZE);
+    pool->cache_batch = pool->cache_size / 2;
+
+    /* a magazine may hold cache_size free blocks out of reach of the
+     * other threads, small limited pools can't afford that */
+    INIT_LIST_HEAD(&pool->caches);
+    pool->cached = !limited || init_count >= 8 * pool->cache_size;
+    if (pool->cached &&
+        pthread_key_create(&pool->cache_key, mempool_cache_destroy))
+        pool->cached = 0;
+
+    if (is_arena(pool)) {
+        if (mempool_arena_init(pool, init_count))
+            fatal("alloc memory fail.\n");
+    } else if (init_count > 0) {
         pool->buf = calloc(init_count, block_size);
         if (!pool->buf)
             fatal("alloc memory fail.\n");
@@ -74,10 +327,32 @@ mempool_t *mempool_create(int block_size, int init_count, int limited)
     return pool;
 }
 
+mempool_t *mempool_create(int block_size, int init_count, int limited)
+{
+    return mempool_create_flags(block_size, init_count, limited, 0);
+}
+
+static inline bool is_dynamic_mem(mempool_t *pool, void *buf);
+
 void mempool_release(mempool_t *pool)
 {
+    int i;
     struct list_head *l, *tmp;
     struct block *b;
+    struct mempool_cache *c, *ctmp;
+
+    if (pool->cached) {
+        pthread_key_delete(pool->cache_key);
+
+        list_for_each_entry_safe(c, ctmp, &pool->caches, entry) {
+            for (i = 0; i < c->count && !is_arena(pool); i++) {
+                if (is_dynamic_mem(pool, c->objs[i]))
+                    free(c->objs[i]);
+            }
+            list_del(&c->entry);
+            free(c);
+        }
+    }
 
     list_for_each_safe(l, tmp, &pool->dynamic_free_list) {
         b = list_entry(l, struct block, free);
@@ -86,16 +361,34 @@ void mempool_release(mempool_t *pool)
         free(b);
     }
 
+    list_splice_init(&pool->idle_slabs, &pool->slabs);
+    list_for_each_safe(l, tmp, &pool->slabs)
+        munmap(list_entry(l, struct mempool_slab, entry), pool->slab_size);
+
     free(pool->buf);
     free(pool);
 }
 
-void *mempool_alloc(mempool_t *pool)
+/* take one block from the depot, with pool->lock held */
+static void *__mempool_alloc(mempool_t *pool)
 {
     struct block *b = NULL;
     struct list_head *l = NULL;
 
-    pthread_mutex_lock(&pool->lock);
+    if (is_arena(pool)) {
+        /* slabs may round the count up, the cap is the initial count */
+        if (pool->limited && pool->used >= pool->init_count)
+            return NULL;
+        /* recycled blocks first, they are cache hot */
+        if (list_empty(&pool->free_list)) {
+            if (!pool->carve && !pool->limited)
+                mempool_grow_slab(pool);
+            b = mempool_carve(pool);
+            if (!b)
+                return NULL;
+            goto found;
+        }
+    }
 
     if (!list_empty(&pool->free_list))
         l = pool->free_list.next;
@@ -110,12 +403,13 @@ void *mempool_alloc(mempool_t *pool)
     }
 
     if (unlikely(!b)) {
-        if (pool->limited) {
-            pthread_mutex_unlock(&pool->lock);
+        if (pool->limited || is_arena(pool)) {
             return NULL;
         } else {
             int c;
             b = (struct block *) malloc(pool->bsize);
+            if (!b)
+                return NULL;
             pool->dynamic_used++;
             c = ++pool->count;
             if ( (c & ((1 << 10) - 1)) == 0 ) {
@@ -124,9 +418,10 @@ void *mempool_alloc(mempool_t *pool)
         }
     }
 
+found:
     pool->used++;
-
-    pthread_mutex_unlock(&pool->lock);
+    if (is_arena(pool))
+        block_slab(pool, b)->inuse++;
 
     return block_data(b);
 }
@@ -158,23 +453,20 @@ static bool mempool_needed_shrink(mempool_t *pool)
               (dynamic_free > pool->init_count));
 }
 
-void mempool_shrink(mempool_t *pool)
+/* with pool->lock held */
+static void __mempool_shrink(mempool_t *pool)
 {
     struct list_head *l, *tmp;
     struct block *b;
     int shrink;
     int dynamic_free;
 
-    pthread_mutex_lock(&pool->lock);
-
     shrink = (pool->count - pool->init_count) - pool->used;
     dynamic_free = (pool->count - pool->init_count) - pool->dynamic_used;
     shrink = min(shrink, dynamic_free);
 
-    if (shrink <= 0) {
-        pthread_mutex_unlock(&pool->lock);
+    if (shrink <= 0)
         return;
-    }
 
     list_for_each_safe(l, tmp, &pool->dynamic_free_list) {
         b = list_entry(l, struct block, free);
@@ -186,15 +478,31 @@ void mempool_shrink(mempool_t *pool)
         if (--shrink == 0)
             break;
     }
+}
 
+void mempool_shrink(mempool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    __mempool_shrink(pool);
     pthread_mutex_unlock(&pool->lock);
 }
 
-void mempool_free(mempool_t *pool, void *buf)
+/* give one block back to the depot, with pool->lock held */
+static void __mempool_free(mempool_t *pool, void *buf)
 {
     struct block *b = block_entry(buf);
+    struct mempool_slab *slab;
 
-    pthread_mutex_lock(&pool->lock);
+    if (is_arena(pool)) {
+        /* LIFO: the next allocation gets a cache hot block */
+        list_add(&b->free, &pool->free_list);
+        pool->used--;
+
+        slab = block_slab(pool, buf);
+        if (!--slab->inuse)
+            mempool_slab_empty(pool, slab);
+        return;
+    }
 
     if (is_dynamic_mem(pool, buf)) {
         list_add_tail(&b->free, &pool->dynamic_free_list);
@@ -204,11 +512,166 @@ void mempool_free(mempool_t *pool, void *buf)
     }
 
     pool->used--;
+}
 
+/* hand @nr blocks back to the depot under a single lock round trip */
+static void mempool_depot_put(mempool_t *pool, void **objs, int nr)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    for (i = 0; i < nr; i++)
+        __mempool_free(pool, objs[i]);
+
+    if (!is_arena(pool) && mempool_needed_shrink(pool))
+        __mempool_shrink(pool);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* take up to @nr blocks from the depot, returns how many we got */
+static int mempool_depot_get(mempool_t *pool, void **objs, int nr)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    for (i = 0; i < nr; i++) {
+        objs[i] = __mempool_alloc(pool);
+        if (!objs[i])
+            break;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return i;
+}
+
+/* thread exit: the magazine goes back to the depot */
+static void mempool_cache_destroy(void *data)
+{
+    struct mempool_cache *c = (struct mempool_cache *)data;
+    mempool_t *pool = c->pool;
+
+    mempool_depot_put(pool, c->objs, c->count);
+
+    pthread_mutex_lock(&pool->lock);
+    list_del(&c->entry);
+    pthread_mutex_unlock(&pool->lock);
+
+    free(c);
+}
+
+/* the calling thread's magazine, NULL if the pool has none */
+static struct mempool_cache *mempool_get_cache(mempool_t *pool)
+{
+    struct mempool_cache *c;
+
+    if (!pool->cached)
+        return NULL;
+
+    c = (struct mempool_cache *)pthread_getspecific(pool->cache_key);
+    if (likely(c))
+        return c;
+
+    c = (struct mempool_cache *)malloc(sizeof(*c));
+    if (!c)
+        return NULL;
+
+    c->pool = pool;
+    c->count = 0;
+    pthread_setspecific(pool->cache_key, c);
+
+    pthread_mutex_lock(&pool->lock);
+    list_add(&c->entry, &pool->caches);
     pthread_mutex_unlock(&pool->lock);
 
-    if (mempool_needed_shrink(pool))
-        mempool_shrink(pool);
+    return c;
+}
+
+void *mempool_alloc(mempool_t *pool)
+{
+    void *buf;
+    struct mempool_cache *c;
+
+    c = mempool_get_cache(pool);
+    if (likely(c)) {
+        if (!c->count)
+            c->count = mempool_depot_get(pool, c->objs, pool->cache_batch);
+        if (likely(c->count))
+            return c->objs[--c->count];
+    }
+
+    /* no magazine, or an exhausted limited pool */
+    pthread_mutex_lock(&pool->lock);
+    buf = __mempool_alloc(pool);
+    pthread_mutex_unlock(&pool->lock);
+
+    return buf;
+}
+
+/**
+ * mempool_alloc_bulk - allocate @nr blocks into @objs
+ *
+ * Served from the calling thread's cache first, the rest is taken from
+ * the depot under a single lock round trip. Returns the number of
+ * blocks allocated, less than @nr only once a limited pool ran dry.
+ */
+int mempool_alloc_bulk(mempool_t *pool, void **objs, int nr)
+{
+    int n = 0;
+    struct mempool_cache *c;
+
+    c = mempool_get_cache(pool);
+    if (likely(c)) {
+        n = min(nr, c->count);
+        c->count -= n;
+        memcpy(objs, c->objs + c->count, n * sizeof(void *));
+    }
+
+    if (n < nr)
+        n += mempool_depot_get(pool, objs + n, nr - n);
+
+    return n;
+}
+
+/**
+ * mempool_free_bulk - free the @nr blocks of @objs
+ *
+ * What does not fit in the calling thread's cache goes back to the
+ * depot under a single lock round trip.
+ */
+void mempool_free_bulk(mempool_t *pool, void **objs, int nr)
+{
+    int n = 0;
+    struct mempool_cache *c;
+
+    c = mempool_get_cache(pool);
+    if (likely(c)) {
+        n = min(nr, pool->cache_size - c->count);
+        memcpy(c->objs + c->count, objs, n * sizeof(void *));
+        c->count += n;
+    }
+
+    if (n < nr)
+        mempool_depot_put(pool, objs + n, nr - n);
+}
+
+void mempool_free(mempool_t *pool, void *buf)
+{
+    struct mempool_cache *c;
+
+    c = mempool_get_cache(pool);
+    if (likely(c)) {
+        if (unlikely(c->count >= pool->cache_size)) {
+            /* keep the most recently freed, cache hot, half */
+            mempool_depot_put(pool, c->objs, pool->cache_batch);
+            memmove(c->objs, c->objs + pool->cache_batch,
+                    (c->count - pool->cache_batch) * sizeof(void *));
+            c->count -= pool->cache_batch;
+        }
+        c->objs[c->count++] = buf;
+        return;
+    }
+
+    mempool_depot_put(pool, &buf, 1);
 }
 
 
@@ -225,13 +688,33 @@ static struct cache_sizes cachesizes[] = {
 #undef CACHE
 };
 
+/* size class of every size up to MM_CACHE_MAX_SIZE, in steps of
+ * 1 << MM_CLASS_SHIFT bytes. memsizes.h must stay under 256 classes. */
+static uint8_t size_classes[(MM_CACHE_MAX_SIZE >> MM_CLASS_SHIFT) + 1];
+
+static void size_classes_init(void)
+{
+    int i;
+    int node = 0;
+
+    for (i = 0; i < ARRAY_SIZE(size_classes); i++) {
+        while (cachesizes[node].cs_size < (i << MM_CLASS_SHIFT))
+            node++;
+        size_classes[i] = node;
+    }
+}
+
 int mem_cache_init(void)
 {
     struct cache_sizes *sizes = cachesizes;
 
+    size_classes_init();
+
     while (sizes->cs_size != ULONG_MAX) {
         int size = sizeof(struct mem_head) + sizes->cs_size;
-        sizes->cs_cachep = mempool_create(size, sizes->cs_count, IS_LIMIT);
+        /* slabs grow without bound and hand empty pages back */
+        sizes->cs_cachep = mempool_create_flags(size, sizes->cs_count,
+                                                IS_LIMIT, MEMPOOL_F_ARENA);
         if (!sizes->cs_cachep) {
             goto mem_fail;
         }
@@ -240,32 +723,42 @@ int mem_cache_init(void)
     return 0;
 
 mem_fail:
-    do {
+    while (sizes != cachesizes) {
         sizes--;
         mempool_release(sizes->cs_cachep);
-    } while (sizes != cachesizes);
+    }
     return -ENOMEM;
 }
 
-int size_cmp(const void *key, const void *elt)
+/* size class serving @size, -EINVAL if it needs a large object */
+int size_to_index(int size)
 {
-    const struct cache_sizes *a = key;
-    const struct cache_sizes *b = elt;
+    if (size <= 0 || size > MM_CACHE_MAX_SIZE)
+        return -EINVAL;
 
-    return a->cs_size - b->cs_size;
+    return size_classes[(size + (1 << MM_CLASS_SHIFT) - 1) >> MM_CLASS_SHIFT];
 }
 
-int size_to_index(int size)
+static size_t mm_large_len(int size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    return (sizeof(struct mem_head) + size + page - 1) & ~(page - 1);
+}
+
+/* objects above MM_CACHE_MAX_SIZE get their own mapping, which goes
+ * back to the OS on free */
+static void *mm_alloc_large(int size)
 {
-    struct cache_sizes *node;
-    struct cache_sizes key;
+    struct mem_item *item;
 
-    key.cs_size = size;
-    node = bsearch_edge(&key, cachesizes, ARRAY_SIZE(cachesizes),
-                        sizeof(struct cache_sizes), BSEARCH_MATCH_UP, size_cmp);
-    if (node)
-        return node->cs_size;
-    return -EINVAL;
+    item = mmap(NULL, mm_large_len(size), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (item == MAP_FAILED)
+        return NULL;
+
+    item->head.size = size;
+    return item->data;
 }
 
 void *__mm_alloc(int size, int node)
@@ -274,13 +767,18 @@ void *__mm_alloc(int size, int node)
     struct mem_item *item;
 
     if (node < 0) {
-        node = size_to_index(size);
-        if (node < 0 || node >= ARRAY_SIZE(cachesizes))
+        if (size <= 0)
             return NULL;
+        if (size > MM_CACHE_MAX_SIZE)
+            return mm_alloc_large(size);
+        node = size_to_index(size);
     }
 
     pool = cachesizes[node].cs_cachep;
     item = (struct mem_item *)mempool_alloc(pool);
+    if (!item)
+        return NULL;
+
     item->head.size = size;
     return item->data;
 }
@@ -291,19 +789,23 @@ void __mm_free(void *ptr, int node)
     struct mem_item *item;
     mempool_t *pool;
 
+    if (!ptr)
+        return;
+
     item = mem_entry(ptr);
     size = item->head.size;
 
     if (!size)
         return;
 
-    if (node < 0) {
-        node = size_to_index(size);
-        if (node < 0 || node >= ARRAY_SIZE(cachesizes))
-            return;
+    if (size > MM_CACHE_MAX_SIZE) {
+        munmap(item, mm_large_len(size));
+        return;
     }
 
+    if (node < 0)
+        node = size_to_index(size);
+
     pool = cachesizes[node].cs_cachep;
     mempool_free(pool, item);
 }
-
@@ -11,55 +11,291 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 
 #include <include/packet.h>
 #include <include/log.h>
 
 
-pack_buf_pool_t *create_pack_buf_pool(int esize, int ecount)
+/**
+ * create_pack_buf_pool_sizes - create a pool with several size classes
+ * @sizes: payload size of each class, ascending
+ * @nr: number of classes, up to PACK_BUF_MAX_CLASSES
+ * @ecount: initial buffer count of each class
+ *
+ * Returns NULL if @sizes is not strictly ascending or out of memory.
+ */
+pack_buf_pool_t *create_pack_buf_pool_sizes(const int *sizes, int nr,
+                                            int ecount)
 {
+    int i;
     pack_buf_pool_t *pool;
 
+    if (nr <= 0 || nr > PACK_BUF_MAX_CLASSES)
+        return NULL;
+
+    /* pack_buf_class() takes the first class which is big enough */
+    for (i = 0; i < nr; i++) {
+        if (sizes[i] <= 0 || (i > 0 && sizes[i] <= sizes[i - 1])) {
+            loge("pack_buf pool sizes must be ascending.\n");
+            return NULL;
+        }
+    }
+
     pool = malloc(sizeof(*pool));
+    if (!pool)
+        return NULL;
 
-    /*Create unlimited memory pools. */
-    pool->pool = mempool_create(esize + sizeof(pack_buf_t), ecount, 0);
+    for (i = 0; i < nr; i++) {
+        pool->sizes[i] = sizes[i];
+        /*Create unlimited memory pools. */
+        pool->pools[i] = mempool_create(sizes[i] + sizeof(pack_buf_t),
+                                        ecount, 0);
+        if (!pool->pools[i]) {
+            pool->nr_classes = i;
+            free_pack_buf_pool(pool);
+            return NULL;
+        }
+    }
+    pool->nr_classes = nr;
 
     return pool;
 }
 
+pack_buf_pool_t *create_pack_buf_pool(int esize, int ecount)
+{
+    return create_pack_buf_pool_sizes(&esize, 1, ecount);
+}
+
 void free_pack_buf_pool(pack_buf_pool_t *pool)
 {
-    mempool_release(pool->pool);
+    int i;
+
+    for (i = 0; i < pool->nr_classes; i++)
+        mempool_release(pool->pools[i]);
     free(pool);
 }
 
+/* smallest class holding @size bytes, -1 if there is none */
+static int pack_buf_class(pack_buf_pool_t *pool, int size)
+{
+    int i;
 
-pack_buf_t *pack_buf_alloc(pack_buf_pool_t *pool)
+    for (i = 0; i < pool->nr_classes; i++) {
+        if (size <= pool->sizes[i])
+            return i;
+    }
+    return -1;
+}
+
+static void pack_buf_init(pack_buf_t *pkb, pack_buf_pool_t *pool, int cls)
+{
+    pkb->owner = pool;
+    pkb->next = NULL;
+    pkb->cls = cls;
+    pkb->size = pool->sizes[cls];
+    pkb->len = 0;
+    atomic_init(&pkb->refcount, 1);
+}
+
+static pack_buf_t *__pack_buf_alloc(pack_buf_pool_t *pool, int cls)
 {
     pack_buf_t *pkb;
-    pkb = mempool_alloc(pool->pool);
 
-    pkb->owner = pool;
-    fake_atomic_init(&pkb->refcount, 1);
+    pkb = mempool_alloc(pool->pools[cls]);
+    if (pkb)
+        pack_buf_init(pkb, pool, cls);
 
     return pkb;
 }
 
+/* give the segments of a released chain back to their pools */
+static void pack_buf_release(pack_buf_t *pkb)
+{
+    pack_buf_t *next;
+
+    for (; pkb; pkb = next) {
+        next = pkb->next;
+        mempool_free(pkb->owner->pools[pkb->cls], pkb);
+    }
+}
+
+/* a buffer of the biggest class */
+pack_buf_t *pack_buf_alloc(pack_buf_pool_t *pool)
+{
+    return __pack_buf_alloc(pool, pool->nr_classes - 1);
+}
+
+/**
+ * pack_buf_alloc_size - allocate a buffer of the smallest class that
+ * holds @size bytes. Returns NULL if no class is big enough, see
+ * pack_buf_alloc_chain().
+ */
+pack_buf_t *pack_buf_alloc_size(pack_buf_pool_t *pool, int size)
+{
+    int cls;
+
+    cls = pack_buf_class(pool, size);
+    if (cls < 0)
+        return NULL;
+
+    return __pack_buf_alloc(pool, cls);
+}
+
+/**
+ * pack_buf_alloc_chain - allocate room for @size bytes
+ *
+ * Returns a single buffer when one class is big enough, otherwise a
+ * chain of buffers of the biggest class ending with the smallest one
+ * that holds the remainder. The segments are empty, see
+ * pack_buf_copy_in() and pack_buf_trim().
+ */
+pack_buf_t *pack_buf_alloc_chain(pack_buf_pool_t *pool, int size)
+{
+    int cls;
+    int max = pool->sizes[pool->nr_classes - 1];
+    pack_buf_t *head = NULL;
+    pack_buf_t **tail = &head;
+
+    do {
+        cls = (size > max) ? pool->nr_classes - 1 : pack_buf_class(pool, size);
+
+        *tail = __pack_buf_alloc(pool, cls);
+        if (!*tail) {
+            pack_buf_release(head);
+            return NULL;
+        }
+
+        size -= pool->sizes[cls];
+        tail = &(*tail)->next;
+    } while (size > 0);
+
+    return head;
+}
+
+/**
+ * pack_buf_trim - set the data length of the chain @pkb to @len
+ *
+ * The segments are filled in order, the ones left empty after the
+ * first are released. @pkb must not be shared yet.
+ */
+void pack_buf_trim(pack_buf_t *pkb, int len)
+{
+    for (;;) {
+        pkb->len = min(len, pkb->size);
+        len -= pkb->len;
+
+        if (!pkb->next)
+            return;
+        if (len <= 0) {
+            pack_buf_release(pkb->next);
+            pkb->next = NULL;
+            return;
+        }
+        pkb = pkb->next;
+    }
+}
+
+/**
+ * pack_buf_copy_in - fill the chain @pkb with @len bytes of @data
+ *
+ * Returns the number of bytes copied, short if the chain is too small.
+ */
+int pack_buf_copy_in(pack_buf_t *pkb, const void *data, int len)
+{
+    int n;
+    int copied = 0;
+
+    for (; pkb; pkb = pkb->next) {
+        n = min(len - copied, pkb->size);
+        memcpy(pkb->data, (const uint8_t *)data + copied, n);
+        pkb->len = n;
+        copied += n;
+    }
+
+    return copied;
+}
+
+/**
+ * pack_buf_copy_out - copy up to @len bytes of the chain @pkb to @dst
+ *
+ * Returns the number of bytes copied.
+ */
+int pack_buf_copy_out(const pack_buf_t *pkb, void *dst, int len)
+{
+    int n;
+    int copied = 0;
+
+    for (; pkb && copied < len; pkb = pkb->next) {
+        n = min(len - copied, pkb->len);
+        memcpy((uint8_t *)dst + copied, pkb->data, n);
+        copied += n;
+    }
+
+    return copied;
+}
+
+/**
+ * pack_buf_alloc_bulk - allocate @nr buffers of the biggest class of
+ * @pool into @pkbs
+ *
+ * Returns the number of buffers allocated.
+ */
+int pack_buf_alloc_bulk(pack_buf_pool_t *pool, pack_buf_t **pkbs, int nr)
+{
+    int i, n;
+    int cls = pool->nr_classes - 1;
+
+    n = mempool_alloc_bulk(pool->pools[cls], (void **)pkbs, nr);
+    for (i = 0; i < n; i++)
+        pack_buf_init(pkbs[i], pool, cls);
+
+    return n;
+}
+
 pack_buf_t *pack_buf_get(pack_buf_t *pkb)
 {
-    fake_atomic_inc(&pkb->refcount);
+    atomic_inc(&pkb->refcount);
     return pkb;
 }
 
 void pack_buf_free(pack_buf_t *pkb)
 {
-    if (fake_atomic_dec_and_test(&pkb->refcount)) {
-        pack_buf_pool_t *pool = pkb->owner;
-        mempool_free(pool->pool, pkb);
-    }
+    if (atomic_dec_and_test(&pkb->refcount))
+        pack_buf_release(pkb);
 }
 
+/**
+ * pack_buf_free_bulk - drop a reference to each of the @nr buffers of
+ * @pkbs. The ones released go back to their pool in bulk, one call per
+ * run of buffers sharing a size class. @pkbs is clobbered.
+ */
+void pack_buf_free_bulk(pack_buf_t **pkbs, int nr)
+{
+    int i;
+    int n = 0;
+    mempool_t *pool = NULL;
+    mempool_t *p;
+
+    for (i = 0; i < nr; i++) {
+        if (!atomic_dec_and_test(&pkbs[i]->refcount))
+            continue;
 
+        if (pkbs[i]->next) {
+            pack_buf_release(pkbs[i]->next);
+            pkbs[i]->next = NULL;
+        }
 
+        p = pkbs[i]->owner->pools[pkbs[i]->cls];
+        if (n && p != pool) {
+            mempool_free_bulk(pool, (void **)pkbs, n);
+            n = 0;
+        }
+        pool = p;
+        pkbs[n++] = pkbs[i];
+    }
+
+    if (n)
+        mempool_free_bulk(pool, (void **)pkbs, n);
+}
@@ -0,0 +1,225 @@
+/*
+ * src/placement.c
+ *
+ * 2016-01-01  written by Hoyleeson <hoyleeson@gmail.com>
+ *	Copyright (C) 2015-2016 by Hoyleeson.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; version 2.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <include/log.h>
+#include <include/configs.h>
+#include <include/placement.h>
+
+/*
+ * Where the threads of a class run.  Set up before the threads are
+ * started, either by hand or from the configs:
+ *
+ *   <class>_cpus = 0-3,8    cpus the threads of the class run on
+ *   <class>_sched_fifo = 10 SCHED_FIFO priority, 0 for SCHED_OTHER
+ *
+ * with <class> one of "worker" and "poller".
+ */
+struct thread_placement {
+    const char *name;
+    int pin;            /* one cpu per thread, by index */
+    int nr_cpus;        /* 0: no affinity */
+    cpu_set_t cpus;
+    int fifo_prio;
+};
+
+static struct thread_placement placements[THREAD_CLASS_MAX] = {
+    [THREAD_CLASS_WORKER] = { .name = "worker", .pin = 0 },
+    [THREAD_CLASS_POLLER] = { .name = "poller", .pin = 1 },
+};
+
+static pthread_mutex_t placement_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* parse a cpu list such as "0-3,8" */
+static int parse_cpu_list(const char *s, cpu_set_t *set)
+{
+    char *end;
+    long first, last;
+
+    CPU_ZERO(set);
+    while (*s) {
+        first = strtol(s, &end, 10);
+        if (end == s || first < 0)
+            return -EINVAL;
+        last = first;
+        s = end;
+
+        if (*s == '-') {
+            s++;
+            last = strtol(s, &end, 10);
+            if (end == s || last < first)
+                return -EINVAL;
+            s = end;
+        }
+
+        if (last >= CPU_SETSIZE)
+            return -EINVAL;
+        for (; first <= last; first++)
+            CPU_SET(first, set);
+
+        if (*s == ',')
+            s++;
+        else if (*s)
+            return -EINVAL;
+    }
+
+    return 0;
+}
+
+/* the @n-th cpu of @set, @set is not empty */
+static int cpu_set_nth(const cpu_set_t *set, int n)
+{
+    int cpu;
+
+    n %= CPU_COUNT(set);
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, set) && !n--)
+            break;
+    }
+    return cpu;
+}
+
+/**
+ * thread_placement_set - set where the threads of a class run
+ * @cls: THREAD_CLASS_*
+ * @cpus: cpu list such as "0-3,8", NULL or empty for no affinity
+ * @fifo_prio: SCHED_FIFO priority, 0 to keep the default policy
+ *
+ * Only the threads started afterwards are placed.
+ */
+int thread_placement_set(int cls, const char *cpus, int fifo_prio)
+{
+    cpu_set_t set;
+    int nr_cpus = 0;
+    struct thread_placement *p;
+
+    if (cls < 0 || cls >= THREAD_CLASS_MAX)
+        return -EINVAL;
+
+    if (cpus && *cpus) {
+        if (parse_cpu_list(cpus, &set))
+            return -EINVAL;
+        nr_cpus = CPU_COUNT(&set);
+    }
+
+    if (fifo_prio && (fifo_prio < sched_get_priority_min(SCHED_FIFO) ||
+                      fifo_prio > sched_get_priority_max(SCHED_FIFO)))
+        return -EINVAL;
+
+    p = &placements[cls];
+
+    pthread_mutex_lock(&placement_lock);
+    p->nr_cpus = nr_cpus;
+    if (nr_cpus)
+        p->cpus = set;
+    p->fifo_prio = fifo_prio;
+    pthread_mutex_unlock(&placement_lock);
+
+    return 0;
+}
+
+/**
+ * thread_placement_load_configs - set the placements from the configs
+ *
+ * Classes without any key are left as they are.  Returns the first
+ * error, the other classes are still set.
+ */
+int thread_placement_load_configs(void)
+{
+    int i, ret, err = 0;
+    char key[64];
+    const char *cpus, *prio;
+
+    for (i = 0; i < THREAD_CLASS_MAX; i++) {
+        snprintf(key, sizeof(key), "%s_cpus", placements[i].name);
+        cpus = config_val_find_by_key(key);
+        snprintf(key, sizeof(key), "%s_sched_fifo", placements[i].name);
+        prio = config_val_find_by_key(key);
+
+        if (!cpus && !prio)
+            continue;
+
+        ret = thread_placement_set(i, cpus, prio ? atoi(prio) : 0);
+        if (ret) {
+            loge("placement: bad %s placement, cpus:%s sched_fifo:%s\n",
+                 placements[i].name, cpus ? : "", prio ? : "");
+            if (!err)
+                err = ret;
+        }
+    }
+
+    return err;
+}
+
+/**
+ * thread_place - apply the placement of its class to a new thread
+ * @thread: thread to place
+ * @cls: THREAD_CLASS_*
+ * @index: index of @thread in its class, picks the cpu of pinned ones
+ * @name: thread name, cut to THREAD_NAME_LEN, may be NULL
+ *
+ * Best effort: a failure is logged and returned, @thread keeps running
+ * where it was, e.g. SCHED_FIFO needs CAP_SYS_NICE.
+ */
+int thread_place(pthread_t thread, int cls, int index, const char *name)
+{
+    int ret, err = 0;
+    cpu_set_t set;
+    struct sched_param param;
+    struct thread_placement p;
+    char comm[THREAD_NAME_LEN];
+
+    if (cls < 0 || cls >= THREAD_CLASS_MAX)
+        return -EINVAL;
+
+    if (name) {
+        snprintf(comm, sizeof(comm), "%s", name);
+        pthread_setname_np(thread, comm);
+    }
+
+    pthread_mutex_lock(&placement_lock);
+    p = placements[cls];
+    pthread_mutex_unlock(&placement_lock);
+
+    if (p.nr_cpus) {
+        if (p.pin) {
+            CPU_ZERO(&set);
+            CPU_SET(cpu_set_nth(&p.cpus, index), &set);
+        } else
+            set = p.cpus;
+
+        ret = pthread_setaffinity_np(thread, sizeof(set), &set);
+        if (ret) {
+            logw("placement: %s affinity failed(%s).\n", p.name, strerror(ret));
+            err = -ret;
+        }
+    }
+
+    if (p.fifo_prio) {
+        param.sched_priority = p.fifo_prio;
+        ret = pthread_setschedparam(thread, SCHED_FIFO, &param);
+        if (ret) {
+            logw("placement: %s SCHED_FIFO failed(%s).\n", p.name, strerror(ret));
+            err = err ? : -ret;
+        }
+    }
+
+    return err;
+}
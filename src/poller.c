@@ -19,12 +19,24 @@
 #include <errno.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
 #include <sys/epoll.h>
-#include <sys/socket.h>
-#include <arpa/inet.h>
-
-#include <include/sizes.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <config.h>
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+/* multishot recvs into a provided buffer ring, linux 6.0 headers */
+#ifdef IORING_RECV_MULTISHOT
+#define POLLER_URING_RECV
+#endif
+#endif
+
+#include <include/core.h>
 #include <include/poller.h>
+#include <include/timer.h>
 #include <include/utils.h>
 #include <include/log.h>
 
@@ -34,6 +46,8 @@ enum loop_ev_opt {
     EV_POLLER_ENABLE,
     EV_POLLER_DISABLE,
     EV_POLLER_SIGNAL,
+    EV_POLLER_CALL,
+    EV_POLLER_RECV,
 };
 
 typedef struct {
@@ -46,19 +60,176 @@ typedef struct {
             event_func ev_func;
         } ev; /* used for looper add */
         int events; 		/* used for looper enable / disable */
+        recv_func recv;     /* used for looper recv */
+        struct {
+            void (*func)(void *);
+            void *arg;
+        } call; /* used for looper call */
     };
 } poller_ctl_t;
 
 
-static inline void poller_ctl_submit(struct poller *l, void *data, int len)
+/*
+ * Bounded multi-producer / single-consumer ring of control commands.
+ *
+ * Every slot carries a sequence number. A producer owns slot 'pos'
+ * once it moved 'head' from pos to pos + 1, and publishes it by
+ * setting seq to pos + 1. The loop thread consumes it and hands the
+ * slot back to the producers by setting seq to pos + size.
+ *
+ * 'pending' counts submitted but not yet executed commands, and the
+ * eventfd doorbell is rung by the producer that moves it off zero.
+ * When the loop thread drained everything published but 'pending' is
+ * still not zero, a producer counted its command and was preempted
+ * before publishing it. The loop thread does not wait for it: it sets
+ * 'idle' and goes back to poll, and that producer rings the doorbell
+ * itself once it published and sees 'idle'.
+ */
+struct poller_ctl_slot {
+    unsigned long seq;
+    poller_ctl_t ctl;
+};
+
+struct poller_ctl_ring {
+    unsigned long head ____cacheline_aligned;  /* producers */
+    unsigned long pending ____cacheline_aligned;
+    int idle;                                  /* loop left a gap */
+    unsigned long tail ____cacheline_aligned;  /* loop thread only */
+    unsigned long mask;
+    struct poller_ctl_slot slots[0];
+};
+
+static unsigned long poller_ctl_drain(struct poller *l);
+static inline struct event_hook *poller_find(struct poller *l, int fd);
+
+/* every poller between poller_init() and poller_release() */
+static LIST_HEAD(poller_list);
+static pthread_mutex_t poller_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * l->stats is only written by the loop thread, inside a
+ * poller_stats_begin()/poller_stats_end() section. stats_seq is odd
+ * while a section is open, poller_stats_snapshot() retries its copy
+ * until it saw the same even sequence before and after.
+ */
+static inline void poller_stats_begin(struct poller *l)
+{
+    __atomic_store_n(&l->stats_seq, l->stats_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void poller_stats_end(struct poller *l)
+{
+    __atomic_store_n(&l->stats_seq, l->stats_seq + 1, __ATOMIC_RELEASE);
+}
+
+static inline int poller_hist_bucket(uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+
+    if (!us)
+        return 0;
+    return min(64 - __builtin_clzll(us), POLLER_HIST_BUCKETS - 1);
+}
+
+static struct poller_ctl_ring *poller_ctl_ring_create(int size)
+{
+    int i;
+    struct poller_ctl_ring *ring;
+
+    ring = calloc(1, sizeof(*ring) + size * sizeof(struct poller_ctl_slot));
+    if (!ring)
+        return NULL;
+
+    ring->mask = size - 1;
+    for (i = 0; i < size; i++)
+        ring->slots[i].seq = i;
+
+    return ring;
+}
+
+static int poller_ctl_ring_put(struct poller_ctl_ring *ring, poller_ctl_t *ctl)
+{
+    struct poller_ctl_slot *slot;
+    unsigned long pos, seq;
+    long dif;
+
+    pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = &ring->slots[pos & ring->mask];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        dif = (long)seq - (long)pos;
+
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0) {
+            return -EAGAIN; /* full */
+        } else {
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    slot->ctl = *ctl;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int poller_ctl_ring_get(struct poller_ctl_ring *ring, poller_ctl_t *ctl)
+{
+    struct poller_ctl_slot *slot;
+    unsigned long pos = ring->tail;
+
+    slot = &ring->slots[pos & ring->mask];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+        return -EAGAIN; /* empty, or the producer did not publish yet */
+
+    *ctl = slot->ctl;
+    ring->tail = pos + 1;
+    __atomic_store_n(&slot->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* true if the next slot of @ring is published */
+static bool poller_ctl_ring_ready(struct poller_ctl_ring *ring)
+{
+    struct poller_ctl_slot *slot = &ring->slots[ring->tail & ring->mask];
+
+    return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == ring->tail + 1;
+}
+
+static void poller_ctl_submit(struct poller *l, poller_ctl_t *ctl)
 {
     int ret;
+    uint64_t one = 1;
+    unsigned long pending;
+    struct poller_ctl_ring *ring = l->ctl_ring;
+
+    pending = __atomic_fetch_add(&ring->pending, 1, __ATOMIC_SEQ_CST);
+
+    while (poller_ctl_ring_put(ring, ctl)) {
+        /* ring full. the loop thread is the only consumer and may be
+         * submitting from one of its callbacks, make room ourselves. */
+        if (pthread_equal(l->thread, pthread_self()))
+            poller_ctl_drain(l);
+        else
+            sched_yield();
+    }
 
-    pthread_mutex_lock(&l->lock);
-    ret = xwrite(l->ctl_socks[0], data, len);
-    if (ret < 0)
-        loge("poller ctl command submit failed(%d).\n", ret);
-    pthread_mutex_unlock(&l->lock);
+    /* pairs with the fence in poller_ctl_event(): either the loop
+     * thread sees our slot, or we see it went idle without it. */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    /* the empty -> non-empty transition rings the doorbell, and so
+     * does a late publish the loop thread gave up on */
+    if (pending == 0 ||
+        (__atomic_load_n(&ring->idle, __ATOMIC_RELAXED) &&
+         __atomic_exchange_n(&ring->idle, 0, __ATOMIC_RELAXED))) {
+        ret = xwrite(l->ctl_fd, &one, sizeof(one));
+        if (ret < 0 && errno != EAGAIN)
+            loge("poller ctl command submit failed(%d).\n", errno);
+    }
 }
 
 /* register a file descriptor and its event handler.
@@ -74,7 +245,7 @@ void poller_event_add(struct poller *l, int fd, event_func func, void *user)
     ctl.ev.ev_user = user;
     ctl.ev.ev_func = func;
 
-    poller_ctl_submit(l, &ctl, sizeof(ctl));
+    poller_ctl_submit(l, &ctl);
 }
 
 /*
@@ -83,11 +254,20 @@ void poller_event_add(struct poller *l, int fd, event_func func, void *user)
 void poller_event_del(struct poller *l, int fd)
 {
     poller_ctl_t ctl;
+    struct event_hook *hook;
+
+    /* from a handler: the owner may free the hook data right away, no
+     * callback nor recv completion of this round must reach it */
+    if (pthread_equal(l->thread, pthread_self())) {
+        hook = poller_find(l, fd);
+        if (hook)
+            hook->state |= HOOK_CLOSING;
+    }
 
     ctl.opt = EV_POLLER_DEL;
     ctl.fd = fd;
 
-    poller_ctl_submit(l, &ctl, sizeof(ctl));
+    poller_ctl_submit(l, &ctl);
 }
 
 /* enable monitoring of certain events for a file
@@ -102,7 +282,7 @@ void poller_event_enable(struct poller *l, int  fd, int  events)
     ctl.fd = fd;
     ctl.events = events;
 
-    poller_ctl_submit(l, &ctl, sizeof(ctl));
+    poller_ctl_submit(l, &ctl);
 }
 
 /* disable monitoring of certain events for a file
@@ -117,7 +297,7 @@ void poller_event_disable(struct poller *l, int  fd, int  events)
     ctl.fd = fd;
     ctl.events = events;
 
-    poller_ctl_submit(l, &ctl, sizeof(ctl));
+    poller_ctl_submit(l, &ctl);
 }
 
 /*
@@ -128,45 +308,667 @@ void poller_event_signal(struct poller *l)
     poller_ctl_t ctl;
 
     ctl.opt = EV_POLLER_SIGNAL;
-    poller_ctl_submit(l, &ctl, sizeof(ctl));
+    poller_ctl_submit(l, &ctl);
+}
+
+/**
+ * poller_event_call - run @func(@arg) on the thread of poller @l
+ *
+ * The call is queued behind the control commands already submitted and
+ * runs from the loop, so @func must not block.
+ */
+void poller_event_call(struct poller *l, void (*func)(void *), void *arg)
+{
+    poller_ctl_t ctl;
+
+    ctl.opt = EV_POLLER_CALL;
+    ctl.call.func = func;
+    ctl.call.arg = arg;
+    poller_ctl_submit(l, &ctl);
+}
+
+/**
+ * poller_event_recv - read @fd with multishot recvs
+ * @func: gets every completion, with the hook's user data
+ *
+ * On a poller set up by poller_recv_init(), EV_READ of @fd is served by
+ * a multishot recv into the provided buffers instead of readiness
+ * events: the data comes to @func without a read() of the handler.
+ * Elsewhere, or if @fd turns out not to be a stream socket, EV_READ
+ * events keep coming to the event_func of the fd.
+ */
+void poller_event_recv(struct poller *l, int fd, recv_func func)
+{
+    poller_ctl_t ctl;
+
+    ctl.opt = EV_POLLER_RECV;
+    ctl.fd = fd;
+    ctl.recv = func;
+    poller_ctl_submit(l, &ctl);
 }
 
 
 /* return the struct event_hook corresponding to a given
  * monitored file descriptor, or NULL if not found
  */
-static struct event_hook *poller_find(struct poller  *l, int  fd)
+static inline struct event_hook *poller_find(struct poller  *l, int  fd)
 {
-    struct event_hook  *hook = l->hooks;
-    struct event_hook  *end  = hook + l->num_fds;
+    if (fd < 0 || fd >= l->fdtab_size)
+        return NULL;
+    return l->fdtab[fd];
+}
 
-    for (; hook < end; hook++) {
-        if (hook->fd == fd)
-            return hook;
-    }
-    return NULL;
+/* grow the fd table so that it can index @fd */
+static void poller_grow_fdtab(struct poller  *l, int  fd)
+{
+    int  old_size = l->fdtab_size;
+    int  new_size = old_size ? old_size : 64;
+
+    while (new_size <= fd)
+        new_size <<= 1;
+
+    xrenew(l->fdtab, new_size);
+    memset(l->fdtab + old_size, 0,
+           (new_size - old_size) * sizeof(struct event_hook *));
+    l->fdtab_size = new_size;
 }
 
-/* grow the arrays in the poller object */
+/* grow the epoll_wait() result array. hooks are not moved, so
+ * the kernel side needs no update.
+ */
 static void poller_grow(struct poller  *l)
 {
     int  old_max = l->max_fds;
     int  new_max = old_max + (old_max >> 1) + 4;
-    int  n;
 
     xrenew(l->events, new_max);
-    xrenew(l->hooks,  new_max);
     l->max_fds = new_max;
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+/*
+ * io_uring backend. Every hook with a non empty interest set has one
+ * IORING_OP_POLL_ADD in flight: one-shot for level-triggered hooks,
+ * re-armed after the handler ran, and multishot for EV_ET hooks. Arm,
+ * cancel and re-arm requests are only queued in the SQ ring and go to
+ * the kernel with the io_uring_enter() that waits for completions, so
+ * enabling or disabling events costs no syscall of its own.
+ *
+ * A poll is tagged with (generation << 32 | fd): completions of a poll
+ * that was cancelled or replaced, or whose hook is gone, don't match
+ * the hook's current token and are dropped.
+ *
+ * Hooks put in recv mode by poller_event_recv() have EV_READ served by
+ * a multishot IORING_OP_RECV instead, which picks its buffers from a
+ * ring provided by poller_recv_init() and refilled as completions are
+ * reaped. Its completions carry POLLER_URING_RECV_TAG and are handed to
+ * the hook's recv_func right away, data is never dropped while the
+ * hook lives, even past a cancel. Accepts and sends are still driven
+ * by poll readiness.
+ */
+#define POLLER_URING_ENTRIES    (256)
+#define POLLER_URING_CQ_ENTRIES (4096)
+
+#define POLLER_URING_RECV_TAG   (1ULL << 63)
+#define POLLER_URING_GEN_MASK   (0x7fffffffU)
+#define POLLER_URING_RECV_BUFS  (256)   /* must be a power of 2 */
+#define POLLER_URING_BGID       (0)
+
+struct poller_uring {
+    int fd;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned sqe_tail;      /* prepared, published on io_uring_enter() */
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    size_t sqes_size;
+
+    uint32_t gen;           /* poll token generation */
+    unsigned int batch;     /* poller_uring_wait() round */
+    struct list_head rearm; /* hooks whose poll or recv has completed */
+
+#ifdef POLLER_URING_RECV
+    /* provided buffers of the recvs, br is NULL until poller_recv_init() */
+    struct io_uring_buf_ring *br;
+    size_t br_size;
+    unsigned short br_tail;
+    void **bufs;            /* cookie of each buffer id, NULL if none */
+    int bufs_missing;       /* ids left empty by a failed get() */
+    const struct poller_buf_ops *buf_ops;
+    void *buf_arg;
+#endif
+};
+
+#ifdef POLLER_URING_RECV
+static void poller_run_recv(struct poller *l, struct event_hook *hook,
+                            void *buf, int res);
+#endif
+
+static int poller_uring_enter(struct poller_uring *u, unsigned submit,
+                              unsigned wait, unsigned flags, void *arg, size_t sz)
+{
+    return syscall(__NR_io_uring_enter, u->fd, submit, wait, flags, arg, sz);
+}
+
+static unsigned poller_uring_unsubmitted(struct poller_uring *u)
+{
+    return u->sqe_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+}
+
+static void poller_uring_publish(struct poller_uring *u)
+{
+    __atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+}
+
+static struct io_uring_sqe *poller_uring_get_sqe(struct poller_uring *u)
+{
+    struct io_uring_sqe *sqe;
+
+    /* SQ ring full: hand what we have to the kernel first */
+    while (poller_uring_unsubmitted(u) >= u->sq_entries) {
+        poller_uring_publish(u);
+        poller_uring_enter(u, poller_uring_unsubmitted(u), 0, 0, NULL, 0);
+    }
+
+    sqe = &u->sqes[u->sqe_tail & *u->sq_mask];
+    u->sq_array[u->sqe_tail & *u->sq_mask] = u->sqe_tail & *u->sq_mask;
+    u->sqe_tail++;
+
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/* tokens carry 31 bits of generation, the top one tags recvs */
+static uint32_t poller_uring_next_gen(struct poller_uring *u)
+{
+    u->gen = (u->gen + 1) & POLLER_URING_GEN_MASK;
+    if (!u->gen)
+        u->gen = 1;
+    return u->gen;
+}
+
+/* the events the poll of @hook waits for, EV_READ may be a recv's */
+static int poller_uring_poll_mask(struct event_hook *hook)
+{
+    int mask = hook->wanted & ~EPOLLET;
+
+    if (hook->recv)
+        mask &= ~EV_READ;
+    return mask;
+}
+
+static void poller_uring_arm(struct poller *l, struct event_hook *hook)
+{
+    struct poller_uring *u = l->uring;
+    struct io_uring_sqe *sqe;
+
+    hook->token = ((uint64_t)poller_uring_next_gen(u) << 32) |
+                  (uint32_t)hook->fd;
+
+    sqe = poller_uring_get_sqe(u);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = hook->fd;
+    sqe->poll32_events = poller_uring_poll_mask(hook);
+    if (hook->wanted & EPOLLET)
+        sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = hook->token;
+}
+
+static void poller_uring_cancel(struct poller *l, struct event_hook *hook)
+{
+    struct io_uring_sqe *sqe;
+
+    if (!hook->token)
+        return;
+
+    /* its own completion has user_data 0 and is ignored */
+    sqe = poller_uring_get_sqe(l->uring);
+    sqe->opcode = IORING_OP_POLL_REMOVE;
+    sqe->addr = hook->token;
+    hook->token = 0;
+}
+
+#ifdef POLLER_URING_RECV
+static void poller_uring_arm_recv(struct poller *l, struct event_hook *hook)
+{
+    struct poller_uring *u = l->uring;
+    struct io_uring_sqe *sqe;
+
+    hook->recv_token = POLLER_URING_RECV_TAG |
+                       ((uint64_t)poller_uring_next_gen(u) << 32) |
+                       (uint32_t)hook->fd;
+
+    sqe = poller_uring_get_sqe(u);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = hook->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = POLLER_URING_BGID;
+    sqe->user_data = hook->recv_token;
+}
+
+static void poller_uring_cancel_recv(struct poller *l, struct event_hook *hook)
+{
+    struct io_uring_sqe *sqe;
+
+    if (!hook->recv_token)
+        return;
+
+    /* what it received before is still delivered, as stale completions */
+    sqe = poller_uring_get_sqe(l->uring);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = hook->recv_token;
+    hook->recv_token = 0;
+}
+
+/* hand a new buffer to the kernel under id @bid */
+static int poller_uring_buf_fill(struct poller_uring *u, int bid)
+{
+    int size;
+    void *addr, *buf;
+    struct io_uring_buf *b;
+
+    buf = u->buf_ops->get(u->buf_arg, &addr, &size);
+    if (!buf)
+        return -ENOMEM;
+
+    u->bufs[bid] = buf;
+    b = &u->br->bufs[u->br_tail & (POLLER_URING_RECV_BUFS - 1)];
+    b->addr = (uint64_t)(uintptr_t)addr;
+    b->len = size;
+    b->bid = bid;
+    u->br_tail++;
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static void poller_uring_buf_refill(struct poller_uring *u)
+{
+    int i;
+
+    for (i = 0; u->bufs_missing && i < POLLER_URING_RECV_BUFS; i++) {
+        if (u->bufs[i])
+            continue;
+        if (poller_uring_buf_fill(u, i))
+            break;
+        u->bufs_missing--;
+    }
+}
+
+/* was generation @a issued before @b, modulo the 31 bits */
+static int poller_uring_gen_before(uint32_t a, uint32_t b)
+{
+    return ((a - b) & POLLER_URING_GEN_MASK) > (POLLER_URING_GEN_MASK >> 1);
+}
+
+/* a completion of a multishot recv */
+static void poller_uring_recv_done(struct poller *l, struct io_uring_cqe *cqe)
+{
+    int bid;
+    int res = cqe->res;
+    void *buf = NULL;
+    struct poller_uring *u = l->uring;
+    struct event_hook *hook;
+    uint32_t gen = (cqe->user_data >> 32) & POLLER_URING_GEN_MASK;
+
+    /* the buffer id is free again, give it a new buffer right away */
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        buf = u->bufs[bid];
+        u->bufs[bid] = NULL;
+        if (poller_uring_buf_fill(u, bid))
+            u->bufs_missing++;
+    }
+
+    /* a recv of a deleted hook, maybe of an older one of this fd */
+    hook = poller_find(l, (int)(uint32_t)cqe->user_data);
+    if (hook && (!hook->recv || poller_uring_gen_before(gen, hook->recv_first)))
+        hook = NULL;
+
+    /* the current recv is over */
+    if (hook && cqe->user_data == hook->recv_token &&
+        !(cqe->flags & IORING_CQE_F_MORE)) {
+        hook->recv_token = 0;
+
+        switch (res) {
+            case -EINVAL:
+            case -ENOTSOCK:
+            case -EOPNOTSUPP:
+                /* no multishot recv on this fd or kernel: EV_READ goes
+                 * back to the poll */
+                hook->recv = NULL;
+                poller_uring_cancel(l, hook);
+                if (poller_uring_poll_mask(hook))
+                    poller_uring_arm(l, hook);
+                return;
+            case 0:
+                break;
+            default:
+                /* out of buffers, or stopped on its own */
+                if ((res > 0 || res == -ENOBUFS) &&
+                    list_empty(&hook->arm_entry))
+                    list_add_tail(&hook->arm_entry, &u->rearm);
+                break;
+        }
+    }
+
+    if (!hook || (hook->state & HOOK_CLOSING) ||
+        res == -ENOBUFS || res == -ECANCELED) {
+        if (buf)
+            u->buf_ops->put(u->buf_arg, buf);
+        return;
+    }
+
+    poller_run_recv(l, hook, buf, res);
+}
+#endif
+
+static void poller_uring_ctl(struct poller *l, struct event_hook *hook, int op)
+{
+    switch (op) {
+        case EPOLL_CTL_ADD:
+            break;
+        case EPOLL_CTL_DEL:
+            list_del_init(&hook->arm_entry);
+            poller_uring_cancel(l, hook);
+#ifdef POLLER_URING_RECV
+            poller_uring_cancel_recv(l, hook);
+#endif
+            break;
+        case EPOLL_CTL_MOD:
+            poller_uring_cancel(l, hook);
+            if (poller_uring_poll_mask(hook))
+                poller_uring_arm(l, hook);
+#ifdef POLLER_URING_RECV
+            if (!hook->recv || !(hook->wanted & EV_READ))
+                poller_uring_cancel_recv(l, hook);
+            else if (!hook->recv_token)
+                poller_uring_arm_recv(l, hook);
+#endif
+            break;
+    }
+}
+
+/* io_uring flavour of epoll_wait(): fills l->events the same way */
+static int poller_uring_wait(struct poller *l, int maxevents, int timeout)
+{
+    int ret;
+    int count = 0;
+    int delivered = 0;
+    unsigned head, tail;
+    struct poller_uring *u = l->uring;
+    struct event_hook *hook, *tmp;
+    struct io_uring_cqe *cqe;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+
+again:
+#ifdef POLLER_URING_RECV
+    if (u->bufs_missing)
+        poller_uring_buf_refill(u);
+#endif
+
+    /* one-shot polls of the last round, their handlers have run */
+    list_for_each_entry_safe(hook, tmp, &u->rearm, arm_entry) {
+        list_del_init(&hook->arm_entry);
+        if (!hook->token && poller_uring_poll_mask(hook))
+            poller_uring_arm(l, hook);
+#ifdef POLLER_URING_RECV
+        if (hook->recv && !hook->recv_token && (hook->wanted & EV_READ))
+            poller_uring_arm_recv(l, hook);
+#endif
+    }
+
+    memset(&arg, 0, sizeof(arg));
+    if (timeout > 0) {
+        ts.tv_sec = timeout / MSEC_PER_SEC;
+        ts.tv_nsec = (timeout % MSEC_PER_SEC) * NSEC_PER_MSEC;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+
+    poller_uring_publish(u);
+    ret = poller_uring_enter(u, poller_uring_unsubmitted(u), timeout ? 1 : 0,
+                             IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                             &arg, sizeof(arg));
+    if (ret < 0 && errno != ETIME && errno != EINTR && errno != EBUSY)
+        return -1;
+
+    u->batch++;
+    head = *u->cq_head;
+    tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail && count < maxevents; head++) {
+        cqe = &u->cqes[head & *u->cq_mask];
+
+        if (!cqe->user_data)
+            continue;
+
+#ifdef POLLER_URING_RECV
+        if (cqe->user_data & POLLER_URING_RECV_TAG) {
+            poller_uring_recv_done(l, cqe);
+            delivered++;
+            continue;
+        }
+#endif
+
+        hook = poller_find(l, (int)(uint32_t)cqe->user_data);
+        if (!hook || hook->token != cqe->user_data)
+            continue;
 
-    /* now change the handles to all events */
-    for (n = 0; n < l->num_fds; n++) {
-        struct epoll_event ev;
-        struct event_hook *hook = l->hooks + n;
+        /* the poll is over: one-shot, or a multishot one that ended */
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            hook->token = 0;
+            if (list_empty(&hook->arm_entry))
+                list_add_tail(&hook->arm_entry, &u->rearm);
+        }
+
+        /* several completions of a hook in one round are merged */
+        if (hook->batch == u->batch) {
+            l->events[hook->slot].events |= cqe->res < 0 ? EPOLLERR : cqe->res;
+            continue;
+        }
 
-        ev.events   = hook->wanted;
-        ev.data.ptr = hook;
-        epoll_ctl(l->epoll_fd, EPOLL_CTL_MOD, hook->fd, &ev);
+        hook->batch = u->batch;
+        hook->slot = count;
+        l->events[count].events = cqe->res < 0 ? EPOLLERR : cqe->res;
+        l->events[count].data.ptr = hook;
+        count++;
     }
+
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+    /* only stale completions, keep sleeping. after recvs went to their
+     * handlers, let the loop look at what those queued instead */
+    if (!count && !delivered && timeout < 0 && ret >= 0)
+        goto again;
+    return count;
+}
+
+static int poller_uring_init(struct poller *l)
+{
+    struct poller_uring *u;
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = POLLER_URING_CQ_ENTRIES;
+
+    xznew(u);
+    INIT_LIST_HEAD(&u->rearm);
+
+    u->fd = syscall(__NR_io_uring_setup, POLLER_URING_ENTRIES, &p);
+    if (u->fd < 0)
+        goto fail;
+
+    /* poller_uring_wait() relies on both */
+    if (!(p.features & IORING_FEAT_EXT_ARG) ||
+        !(p.features & IORING_FEAT_NODROP))
+        goto fail_close;
+
+    u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    u->sq_ptr = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->cq_ptr = mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sq_ptr == MAP_FAILED || u->cq_ptr == MAP_FAILED ||
+        u->sqes == MAP_FAILED)
+        goto fail_unmap;
+
+    u->sq_head = u->sq_ptr + p.sq_off.head;
+    u->sq_tail = u->sq_ptr + p.sq_off.tail;
+    u->sq_mask = u->sq_ptr + p.sq_off.ring_mask;
+    u->sq_array = u->sq_ptr + p.sq_off.array;
+    u->sq_entries = p.sq_entries;
+    u->sqe_tail = *u->sq_tail;
+
+    u->cq_head = u->cq_ptr + p.cq_off.head;
+    u->cq_tail = u->cq_ptr + p.cq_off.tail;
+    u->cq_mask = u->cq_ptr + p.cq_off.ring_mask;
+    u->cqes = u->cq_ptr + p.cq_off.cqes;
+
+    l->uring = u;
+    return 0;
+
+fail_unmap:
+    if (u->sq_ptr != MAP_FAILED)
+        munmap(u->sq_ptr, u->sq_size);
+    if (u->cq_ptr != MAP_FAILED)
+        munmap(u->cq_ptr, u->cq_size);
+    if (u->sqes != MAP_FAILED)
+        munmap(u->sqes, u->sqes_size);
+fail_close:
+    close(u->fd);
+fail:
+    xfree(u);
+    return -ENOSYS;
+}
+
+static void poller_uring_release(struct poller *l)
+{
+    struct poller_uring *u = l->uring;
+#ifdef POLLER_URING_RECV
+    int i;
+#endif
+
+    munmap(u->sq_ptr, u->sq_size);
+    munmap(u->cq_ptr, u->cq_size);
+    munmap(u->sqes, u->sqes_size);
+    close(u->fd);
+
+#ifdef POLLER_URING_RECV
+    /* the loop thread is gone, and its recvs with it */
+    if (u->br) {
+        for (i = 0; i < POLLER_URING_RECV_BUFS; i++) {
+            if (u->bufs[i])
+                u->buf_ops->put(u->buf_arg, u->bufs[i]);
+        }
+        xfree(u->bufs);
+        munmap(u->br, u->br_size);
+    }
+#endif
+
+    xfree(u);
+    l->uring = NULL;
+}
+#endif
+
+/**
+ * poller_recv_init - let the hooks of @l be read by multishot recvs
+ * @ops: where the provided buffers come from, @arg is passed to it
+ *
+ * io_uring backend only, call it before poller_loop(). Returns 0, or
+ * -ENOSYS when the poller can't do it: poller_event_recv() is then a
+ * no-op and the hooks keep getting EV_READ events.
+ */
+int poller_recv_init(struct poller *l, const struct poller_buf_ops *ops,
+                     void *arg)
+{
+#ifdef POLLER_URING_RECV
+    int i;
+    struct io_uring_buf_reg reg;
+    struct poller_uring *u = l->uring;
+
+    if (!u || u->br)
+        return -ENOSYS;
+
+    u->br_size = POLLER_URING_RECV_BUFS * sizeof(struct io_uring_buf);
+    u->br = mmap(NULL, u->br_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->br == MAP_FAILED)
+        goto fail;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->br;
+    reg.ring_entries = POLLER_URING_RECV_BUFS;
+    reg.bgid = POLLER_URING_BGID;
+    if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) < 0)
+        goto fail_unmap;
+
+    u->bufs = xzalloc(POLLER_URING_RECV_BUFS * sizeof(void *));
+    u->buf_ops = ops;
+    u->buf_arg = arg;
+    u->br_tail = 0;
+    u->bufs_missing = 0;
+    for (i = 0; i < POLLER_URING_RECV_BUFS; i++) {
+        if (poller_uring_buf_fill(u, i))
+            u->bufs_missing++;
+    }
+    return 0;
+
+fail_unmap:
+    munmap(u->br, u->br_size);
+fail:
+    u->br = NULL;
+    return -ENOSYS;
+#else
+    return -ENOSYS;
+#endif
+}
+
+/* push the interest set of @hook to the kernel */
+static void poller_hook_ctl(struct poller *l, struct event_hook *hook, int op)
+{
+    struct epoll_event ev;
+
+#ifdef HAVE_LINUX_IO_URING_H
+    if (l->uring) {
+        poller_uring_ctl(l, hook, op);
+        return;
+    }
+#endif
+
+    ev.events   = hook->wanted;
+    ev.data.ptr = hook;
+    epoll_ctl(l->epoll_fd, op, hook->fd,
+              op == EPOLL_CTL_DEL ? NULL : &ev);
+}
+
+static int poller_wait(struct poller *l, int timeout)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+    if (l->uring)
+        return poller_uring_wait(l, l->num_fds, timeout);
+#endif
+    return epoll_wait(l->epoll_fd, l->events, l->num_fds, timeout);
 }
 
 /* register a file descriptor and its event handler.
@@ -174,13 +976,20 @@ static void poller_grow(struct poller  *l)
  */
 static void poller_add(struct poller *l, int fd, event_func  func, void  *data)
 {
-    struct epoll_event  ev;
     struct event_hook           *hook;
 
+    if (fd >= l->fdtab_size)
+        poller_grow_fdtab(l, fd);
+
+    if (l->fdtab[fd]) {
+        loge("%s: fd %d already registered", __func__, fd);
+        return;
+    }
+
     if (l->num_fds >= l->max_fds)
         poller_grow(l);
 
-    hook = l->hooks + l->num_fds;
+    hook = mempool_alloc(l->hook_pool);
 
     hook->fd      = fd;
     hook->data = data;
@@ -188,13 +997,25 @@ static void poller_add(struct poller *l, int fd, event_func  func, void  *data)
     hook->state   = 0;
     hook->wanted  = 0;
     hook->events  = 0;
+    hook->ready   = 0;
+    hook->recv    = NULL;
+    hook->recv_token = 0;
+    hook->recv_first = 0;
+    hook->token   = 0;
+    hook->batch   = 0;
+    INIT_LIST_HEAD(&hook->entry);
+    INIT_LIST_HEAD(&hook->ready_entry);
+    INIT_LIST_HEAD(&hook->arm_entry);
 
     setnonblock(fd);
 
-    ev.events   = 0;
-    ev.data.ptr = hook;
-    epoll_ctl(l->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    poller_hook_ctl(l, hook, EPOLL_CTL_ADD);
+
+    poller_stats_begin(l);
+    l->stats.hooks_added++;
+    poller_stats_end(l);
 
+    l->fdtab[fd] = hook;
     if (!l->num_fds++)
         wake_up(&l->waitq);
 }
@@ -209,10 +1030,22 @@ static void poller_del(struct poller  *l, int  fd)
         loge("%s: invalid fd: %d", __func__, fd);
         return;
     }
-    /* don't remove the hook yet */
+
+    /* the fd may be reused right away, but the current
+     * epoll_wait() batch can still reference the hook:
+     * don't free it yet */
     hook->state |= HOOK_CLOSING;
+    hook->state &= ~HOOK_READY;
+    list_del_init(&hook->ready_entry);
+    l->fdtab[fd] = NULL;
+    l->num_fds--;
+    list_add_tail(&hook->entry, &l->closing_hooks);
 
-    epoll_ctl(l->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    poller_hook_ctl(l, hook, EPOLL_CTL_DEL);
+
+    poller_stats_begin(l);
+    l->stats.hooks_removed++;
+    poller_stats_end(l);
 }
 
 /* enable monitoring of certain events for a file
@@ -229,19 +1062,15 @@ static void poller_enable(struct poller  *l, int  fd, int  events)
     }
 
     if (events & ~hook->wanted) {
-        struct epoll_event  ev;
-
         hook->wanted |= events;
-        ev.events   = hook->wanted;
-        ev.data.ptr = hook;
-
-        epoll_ctl(l->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+        poller_hook_ctl(l, hook, EPOLL_CTL_MOD);
     }
 }
 
 /* disable monitoring of certain events for a file
  * descriptor. This ignores events that are not
- * currently enabled.
+ * currently enabled. Events kept pending by
+ * poller_event_pending() are dropped as well.
  */
 static void poller_disable(struct poller  *l, int  fd, int  events)
 {
@@ -252,123 +1081,400 @@ static void poller_disable(struct poller  *l, int  fd, int  events)
         return;
     }
 
-    if (events & hook->wanted) {
-        struct epoll_event  ev;
+    if (hook->ready & events) {
+        hook->ready &= ~events;
+        if (!hook->ready && (hook->state & HOOK_READY)) {
+            hook->state &= ~HOOK_READY;
+            list_del_init(&hook->ready_entry);
+        }
+    }
 
+    if (events & hook->wanted) {
         hook->wanted &= ~events;
-        ev.events   = hook->wanted;
-        ev.data.ptr = hook;
+        poller_hook_ctl(l, hook, EPOLL_CTL_MOD);
+    }
+}
+
 
-        epoll_ctl(l->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+/**
+ * poller_event_pending - keep events of an edge-triggered fd pending
+ * @l: the poller
+ * @fd: fd being handled
+ * @events: events left unconsumed, they will be delivered again
+ *
+ * With EV_ET the kernel reports a readiness edge only once. A handler
+ * which stops before EAGAIN (e.g. it hit its fairness budget) calls
+ * this and the poller runs it again on the next loop iteration without
+ * blocking in epoll_wait(). Loop thread only, i.e. from a handler.
+ */
+void poller_event_pending(struct poller *l, int fd, int events)
+{
+    struct event_hook *hook = poller_find(l, fd);
+
+    if (!hook || (hook->state & HOOK_CLOSING))
+        return;
+
+    hook->ready |= events;
+    if (!(hook->state & HOOK_READY)) {
+        hook->state |= HOOK_READY;
+        list_add_tail(&hook->ready_entry, &l->ready_hooks);
     }
 }
 
+/* serve EV_READ of @fd with multishot recvs, if the backend can */
+static void poller_recv(struct poller *l, int fd, recv_func func)
+{
+    struct event_hook *hook = poller_find(l, fd);
 
-static void poller_ctl_event(struct poller *l, int events)
+    if (!hook) {
+        loge("%s: invalid fd: %d", __func__, fd);
+        return;
+    }
+
+#ifdef POLLER_URING_RECV
+    if (!l->uring || !l->uring->br || hook->recv)
+        return;
+
+    /* recvs of an older hook of this fd come before this one */
+    hook->recv_first = poller_uring_next_gen(l->uring);
+    hook->recv = func;
+    poller_hook_ctl(l, hook, EPOLL_CTL_MOD);
+#endif
+}
+
+/* execute every published command, return how many are still pending */
+static unsigned long poller_ctl_drain(struct poller *l)
 {
     poller_ctl_t ctl;
-    int len;
+    unsigned long n = 0;
+    struct poller_ctl_ring *ring = l->ctl_ring;
+
+    while (!poller_ctl_ring_get(ring, &ctl)) {
+        switch (ctl.opt) {
+            case EV_POLLER_ADD:
+                poller_add(l, ctl.fd, ctl.ev.ev_func, ctl.ev.ev_user);
+                break;
+            case EV_POLLER_DEL:
+                poller_del(l, ctl.fd);
+                break;
+            case EV_POLLER_ENABLE:
+                poller_enable(l, ctl.fd, ctl.events);
+                break;
+            case EV_POLLER_DISABLE:
+                poller_disable(l, ctl.fd, ctl.events);
+                break;
+            case EV_POLLER_CALL:
+                ctl.call.func(ctl.call.arg);
+                break;
+            case EV_POLLER_RECV:
+                poller_recv(l, ctl.fd, ctl.recv);
+                break;
+            default:
+                break;
+        }
+        n++;
+    }
+
+    if (!n)
+        return __atomic_load_n(&ring->pending, __ATOMIC_SEQ_CST);
+
+    poller_stats_begin(l);
+    l->stats.ctl_cmds += n;
+    if (n > l->stats.ctl_max_batch)
+        l->stats.ctl_max_batch = n;
+    poller_stats_end(l);
+
+    return __atomic_sub_fetch(&ring->pending, n, __ATOMIC_SEQ_CST);
+}
+
+static void poller_ctl_event(struct poller *l, int events)
+{
+    uint64_t count;
+    struct poller_ctl_ring *ring = l->ctl_ring;
 
     if (!(events & EPOLLIN)) {
         return;
     }
 
-    len = xread(l->ctl_socks[1], &ctl, sizeof(poller_ctl_t));
-    if (len < sizeof(poller_ctl_t))
-        return;
+    xread(l->ctl_fd, &count, sizeof(count));
+    __atomic_store_n(&ring->idle, 0, __ATOMIC_RELAXED);
 
-    switch (ctl.opt) {
-        case EV_POLLER_ADD:
-            poller_add(l, ctl.fd, ctl.ev.ev_func, ctl.ev.ev_user);
-            break;
-        case EV_POLLER_DEL:
-            poller_del(l, ctl.fd);
-            break;
-        case EV_POLLER_ENABLE:
-            poller_enable(l, ctl.fd, ctl.events);
-            break;
-        case EV_POLLER_DISABLE:
-            poller_disable(l, ctl.fd, ctl.events);
-            break;
-        default:
+    /* a producer counted its command but did not publish it yet, never
+     * wait for it: it rings the doorbell itself once it sees 'idle'.
+     * every round here executed at least one command. */
+    while (poller_ctl_drain(l)) {
+        __atomic_store_n(&ring->idle, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!poller_ctl_ring_ready(ring))
             break;
+        __atomic_store_n(&ring->idle, 0, __ATOMIC_RELAXED);
     }
 }
 
 
+/* account for a callback of the hook of @fd which took @ns */
+static void poller_account_cb(struct poller *l, int fd, event_func func,
+                              uint64_t ns)
+{
+    struct poller_stats *st = &l->stats;
+
+    poller_stats_begin(l);
+    st->callbacks++;
+    st->busy_ns += ns;
+    st->cb_hist[poller_hist_bucket(ns)]++;
+    if (ns > st->cb_max_ns) {
+        st->cb_max_ns = ns;
+        st->cb_max_fd = fd;
+        st->cb_max_func = func;
+    }
+    poller_stats_end(l);
+}
+
+/* run a hook callback and account for the time it took */
+static void poller_run_hook(struct poller *l, struct event_hook *hook,
+                            int events)
+{
+    int fd = hook->fd;
+    event_func func = hook->func;
+    uint64_t ns;
+
+    ns = curr_time_ns();
+    func(hook->data, events);
+    ns = curr_time_ns() - ns;
+
+    poller_account_cb(l, fd, func, ns);
+}
+
+#ifdef POLLER_URING_RECV
+/* deliver a recv completion, accounted as a callback of the hook */
+static void poller_run_recv(struct poller *l, struct event_hook *hook,
+                            void *buf, int res)
+{
+    int fd = hook->fd;
+    event_func func = hook->func;
+    uint64_t ns;
+
+    ns = curr_time_ns();
+    hook->recv(hook->data, buf, res);
+    ns = curr_time_ns() - ns;
+
+    /* busy time, taken out of the wait it ran in by poller_exec() */
+    l->wait_busy_ns += ns;
+    poller_account_cb(l, fd, func, ns);
+}
+#endif
+
 static int poller_exec(struct poller *l)
 {
     int  n, count;
-    struct event_hook *hook;
+    int  timeout;
+    uint64_t start, now;
+    struct event_hook *hook, *tmp;
+    struct poller_stats *st = &l->stats;
+    LIST_HEAD(ready);
 
     wait_event(l->waitq, l->num_fds != 0);
 
+    if (__atomic_load_n(&l->stats_reset, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&l->stats_reset, 0, __ATOMIC_RELAXED);
+        poller_stats_begin(l);
+        memset(st, 0, sizeof(*st));
+        poller_stats_end(l);
+    }
+
+    /* don't sleep while edge-triggered hooks have work left,
+     * nor past the earliest timer */
+    timeout = list_empty(&l->ready_hooks) ? timer_base_timeout(l->timers) : 0;
+
+    l->wait_busy_ns = 0;
+    start = curr_time_ns();
     do {
-        count = epoll_wait(l->epoll_fd, l->events, l->num_fds, -1);
+        count = poller_wait(l, timeout);
     } while (count < 0 && errno == EINTR);
+    now = curr_time_ns();
 
     if (count < 0) {
         loge("%s: error: %s", __func__, strerror(errno));
         return -EINVAL;
     }
 
-    if (count == 0) {
-        loge("poller huh ? epoll returned count=0");
+    poller_stats_begin(l);
+    st->loops++;
+    st->wait_ns += now - start - min(l->wait_busy_ns, now - start);
+    if (count > 0) {
+        st->waits++;
+        st->events += count;
+        if (count > st->max_events)
+            st->max_events = count;
+    }
+    poller_stats_end(l);
+
+    /* io_uring also comes back once it delivered recvs */
+    if (count == 0 && timeout < 0) {
+        if (!l->uring)
+            loge("poller huh ? epoll returned count=0");
         return 0;
     }
 
+    /* the ready hooks are run by this iteration, their handlers
+     * may put them back on l->ready_hooks */
+    list_splice_init(&l->ready_hooks, &ready);
+
     /* mark all pending hooks */
     for (n = 0; n < count; n++) {
         hook = l->events[n].data.ptr;
-        hook->state  = HOOK_PENDING;
+        hook->state |= HOOK_PENDING;
         hook->events = l->events[n].events;
+
+        if (hook->state & HOOK_READY) {
+            hook->events |= hook->ready & hook->wanted;
+            hook->ready = 0;
+            hook->state &= ~HOOK_READY;
+            list_del_init(&hook->ready_entry);
+        }
     }
 
-#define FIRST_DYNAMIC_SLOT     (1)
-    /* execute hook callbacks. this may change the 'hooks'
-     * and 'events' array, as well as l->num_fds, so be careful */
-    for (n = FIRST_DYNAMIC_SLOT; n < l->num_fds; n++) {
-        hook = l->hooks + n;
-        if (hook->state & HOOK_PENDING) {
+    /* execute hook callbacks. this may delete hooks of the current
+     * batch, those are flagged HOOK_CLOSING and skipped. The manage
+     * hook is run last. */
+    for (n = 0; n < count; n++) {
+        hook = l->events[n].data.ptr;
+        if (hook == l->ctl_hook)
+            continue;
+
+        if ((hook->state & (HOOK_PENDING | HOOK_CLOSING)) == HOOK_PENDING) {
             hook->state &= ~HOOK_PENDING;
-            hook->func(hook->data, hook->events);
+            poller_run_hook(l, hook, hook->events);
         }
     }
 
-    /* now remove all the hooks that were closed by
-     * the callbacks */
-    for (n = FIRST_DYNAMIC_SLOT; n < l->num_fds;) {
-        struct epoll_event ev;
-        hook = l->hooks + n;
+    /* edge-triggered hooks with no new edge but work left over */
+    while (!list_empty(&ready)) {
+        int events;
 
-        if (!(hook->state & HOOK_CLOSING)) {
-            n++;
-            continue;
-        }
+        /* a handler may delete any other hook, don't keep a cursor */
+        hook = list_first_entry(&ready, struct event_hook, ready_entry);
+        /* the handler may have been disabled since, e.g. paused */
+        events = hook->ready & hook->wanted;
+
+        list_del_init(&hook->ready_entry);
+        hook->ready = 0;
+        hook->state &= ~HOOK_READY;
 
-        hook[0]     = l->hooks[l->num_fds - 1];
-        l->num_fds--;
-        ev.events   = hook->wanted;
-        ev.data.ptr = hook;
-        epoll_ctl(l->epoll_fd, EPOLL_CTL_MOD, hook->fd, &ev);
+        if (!(hook->state & HOOK_CLOSING) && events)
+            poller_run_hook(l, hook, events);
     }
 
-    /* slot 0: manage hook. */
-    hook = l->hooks;
+    start = curr_time_ns();
+    timer_base_run(l->timers);
+    now = curr_time_ns();
+
+    poller_stats_begin(l);
+    st->busy_ns += now - start;
+    poller_stats_end(l);
+
+    /* manage hook. */
+    hook = l->ctl_hook;
     if (hook->state & HOOK_PENDING) {
         hook->state &= ~HOOK_PENDING;
-        hook->func(hook->data, hook->events);
+        poller_run_hook(l, hook, hook->events);
+    }
+
+    /* now free all the hooks that were closed by the callbacks */
+    list_for_each_entry_safe(hook, tmp, &l->closing_hooks, entry) {
+        list_del(&hook->entry);
+        mempool_free(l->hook_pool, hook);
     }
 
     return 0;
 }
 
+/**
+ * poller_stats_snapshot - copy the event loop statistics of @l
+ *
+ * Can be called from any thread, the loop is never blocked by it.
+ */
+int poller_stats_snapshot(struct poller *l, struct poller_stats *st)
+{
+    unsigned int seq;
+
+    do {
+        while ((seq = __atomic_load_n(&l->stats_seq, __ATOMIC_ACQUIRE)) & 1)
+            sched_yield();
+
+        memcpy(st, &l->stats, sizeof(*st));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&l->stats_seq, __ATOMIC_RELAXED) != seq);
+
+    st->num_fds = __atomic_load_n(&l->num_fds, __ATOMIC_RELAXED);
+    st->ctl_depth = __atomic_load_n(&l->ctl_ring->pending, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/**
+ * poller_stats_reset - clear the statistics of @l
+ *
+ * They are cleared by the loop thread on its next iteration.
+ */
+void poller_stats_reset(struct poller *l)
+{
+    __atomic_store_n(&l->stats_reset, 1, __ATOMIC_RELAXED);
+    poller_event_signal(l);
+}
+
+/**
+ * poller_stats_percentile - callback duration under which @pct percent
+ * of the callbacks completed, in nanoseconds. This is the upper bound
+ * of the histogram bucket holding that rank.
+ */
+uint64_t poller_stats_percentile(struct poller_stats *st, int pct)
+{
+    int i;
+    uint64_t rank;
+    uint64_t seen = 0;
+
+    if (!st->callbacks)
+        return 0;
+
+    rank = (st->callbacks * pct + 99) / 100;
+    for (i = 0; i < POLLER_HIST_BUCKETS - 1; i++) {
+        seen += st->cb_hist[i];
+        if (seen >= rank)
+            return min_t(uint64_t, (1ULL << i) * 1000, st->cb_max_ns);
+    }
+    return st->cb_max_ns;
+}
+
+/**
+ * poller_for_each - call @fn on every initialized poller
+ *
+ * Stops at the first non zero value returned by @fn and returns it.
+ * Pollers can't be released while @fn runs.
+ */
+int poller_for_each(int (*fn)(struct poller *l, void *data), void *data)
+{
+    int ret = 0;
+    struct poller *l;
+
+    pthread_mutex_lock(&poller_list_lock);
+    list_for_each_entry(l, &poller_list, entry) {
+        ret = fn(l, data);
+        if (ret)
+            break;
+    }
+    pthread_mutex_unlock(&poller_list_lock);
+
+    return ret;
+}
+
 /* wait until an event occurs on one of the registered file
  * descriptors. Only returns in case of error !!
  */
 void poller_loop(struct poller *l)
 {
     int ret;
+
+    l->thread = pthread_self();
     for (;;) {
         if (!l->running)
             break;
@@ -386,52 +1492,129 @@ void poller_done(struct poller *l)
 }
 
 
-/* initialize a poller object */
-int poller_init(struct poller *l)
+/* the earliest deadline moved: make sure the loop is not sleeping on
+ * a stale epoll_wait() timeout. the loop itself recomputes it anyway. */
+static void poller_timer_kick(void *data)
 {
-    int ret;
-    int size = SZ_32K;
+    struct poller *l = (struct poller *)data;
+
+    if (!pthread_equal(pthread_self(), l->thread))
+        poller_event_signal(l);
+}
 
-    l->epoll_fd = epoll_create(1);
+/**
+ * poller_timer_base - timer base run by the loop thread of @l
+ *
+ * Timers initialized with init_timer_on(timer, poller_timer_base(l))
+ * fire on the loop thread, no timerfd nor thread handoff is involved.
+ */
+struct timer_base *poller_timer_base(struct poller *l)
+{
+    return l->timers;
+}
+
+/* initialize a poller object */
+/**
+ * poller_init_backend - initialize a poller object on the given backend
+ * @backend: POLLER_BACKEND_XXX. if io_uring is not usable on this
+ *      system, the poller falls back to epoll.
+ */
+int poller_init_backend(struct poller *l, int backend)
+{
+    l->epoll_fd = -1;
+    l->uring    = NULL;
     l->num_fds  = 0;
     l->max_fds  = 0;
     l->events   = NULL;
-    l->hooks    = NULL;
+    l->fdtab    = NULL;
+    l->fdtab_size = 0;
+    l->thread   = 0;
+    memset(&l->stats, 0, sizeof(l->stats));
+    l->stats_seq = 0;
+    l->stats_reset = 0;
+    l->wait_busy_ns = 0;
+    INIT_LIST_HEAD(&l->closing_hooks);
+    INIT_LIST_HEAD(&l->ready_hooks);
+
+#ifdef HAVE_LINUX_IO_URING_H
+    if (backend == POLLER_BACKEND_URING && poller_uring_init(l))
+        logw("poller: io_uring unavailable, fall back to epoll.\n");
+#else
+    if (backend == POLLER_BACKEND_URING)
+        logw("poller: built without io_uring, fall back to epoll.\n");
+#endif
+    if (!l->uring)
+        l->epoll_fd = epoll_create(1);
+
+    l->hook_pool = mempool_create(sizeof(struct event_hook), 64, 0);
 
-    pthread_mutex_init(&l->lock, NULL);
     init_waitqueue_head(&l->waitq);
-    ret = socketpair(AF_UNIX, SOCK_DGRAM, 0, l->ctl_socks);
-    if (ret < 0) {
-        loge("error in socketpair(). errno:%d.\n", errno);
+
+    l->ctl_ring = poller_ctl_ring_create(POLLER_CTL_RING_SIZE);
+    if (!l->ctl_ring) {
+        loge("poller ctl ring alloc failed.\n");
+        return -ENOMEM;
+    }
+
+    l->ctl_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (l->ctl_fd < 0) {
+        loge("error in eventfd(). errno:%d.\n", errno);
+        xfree(l->ctl_ring);
         return -EINVAL;
     }
 
-    logd("create poller ctl event pipe, sockpair:%d:%d.\n",
-         l->ctl_socks[0], l->ctl_socks[1]);
+    l->timers = timer_base_create(poller_timer_kick, l);
+    if (!l->timers) {
+        close(l->ctl_fd);
+        xfree(l->ctl_ring);
+        return -ENOMEM;
+    }
 
-    setsockopt(l->ctl_socks[0], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
-    setsockopt(l->ctl_socks[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
-    setsockopt(l->ctl_socks[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
-    setsockopt(l->ctl_socks[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
-    fcntl(l->ctl_socks[0], F_SETFL, O_NONBLOCK);
-    fcntl(l->ctl_socks[1], F_SETFL, O_NONBLOCK);
+    logd("create poller ctl event fd:%d.\n", l->ctl_fd);
 
-    poller_add(l, l->ctl_socks[1], (event_func)poller_ctl_event, l);
-    poller_enable(l, l->ctl_socks[1], EPOLLIN);
+    poller_add(l, l->ctl_fd, (event_func)poller_ctl_event, l);
+    poller_enable(l, l->ctl_fd, EPOLLIN);
+    l->ctl_hook = poller_find(l, l->ctl_fd);
     l->running = 1;
 
+    pthread_mutex_lock(&poller_list_lock);
+    list_add_tail(&l->entry, &poller_list);
+    pthread_mutex_unlock(&poller_list_lock);
+
     return 0;
 }
 
+int poller_init(struct poller *l)
+{
+    return poller_init_backend(l, POLLER_BACKEND_EPOLL);
+}
+
 /* finalize a poller object */
 void poller_release(struct poller  *l)
 {
+    pthread_mutex_lock(&poller_list_lock);
+    list_del(&l->entry);
+    pthread_mutex_unlock(&poller_list_lock);
+
     xfree(l->events);
-    xfree(l->hooks);
+    xfree(l->fdtab);
+    l->fdtab_size = 0;
     l->max_fds = 0;
     l->num_fds = 0;
-
-    close(l->epoll_fd);
+    mempool_release(l->hook_pool);
+
+    close(l->ctl_fd);
+    l->ctl_fd = -1;
+    xfree(l->ctl_ring);
+    timer_base_release(l->timers);
+    l->timers = NULL;
+
+#ifdef HAVE_LINUX_IO_URING_H
+    if (l->uring)
+        poller_uring_release(l);
+#endif
+    if (l->epoll_fd >= 0)
+        close(l->epoll_fd);
     l->epoll_fd  = -1;
 }
 
@@ -55,6 +55,28 @@ retry:
     return p;
 }
 
+/**
+ * queue_out_many - remove up to @max packets from the head of the fifo
+ * under a single lock round trip. Never blocks.
+ * Returns the number of packets stored in @pkts.
+ */
+int queue_out_many(struct queue *q, struct packet **pkts, int max)
+{
+    int n = 0;
+    struct packet *p;
+
+    pthread_mutex_lock(&q->lock);
+    while (n < max && !queue_empty(q)) {
+        p = list_first_entry(&q->list, struct packet, node);
+        list_del_init(&p->node);
+        pkts[n++] = p;
+    }
+    q->count -= n;
+    pthread_mutex_unlock(&q->lock);
+
+    return n;
+}
+
 /**
  * queue_peek - get data from the fifo without removing
  */
@@ -62,15 +84,38 @@ struct packet *queue_peek(struct queue *q)
 {
     struct packet *p;
 
+    pthread_mutex_lock(&q->lock);
     if (queue_empty(q)) {
         pthread_mutex_unlock(&q->lock);
         return NULL;
     }
 
     p = list_entry(q->list.next, struct packet, node);
+    pthread_mutex_unlock(&q->lock);
     return p;
 }
 
+/**
+ * queue_peek_many - get up to @max packets from the head of the fifo
+ * without removing them. Only safe for the single consumer of @q.
+ * Returns the number of packets stored in @pkts.
+ */
+int queue_peek_many(struct queue *q, struct packet **pkts, int max)
+{
+    int n = 0;
+    struct packet *p;
+
+    pthread_mutex_lock(&q->lock);
+    list_for_each_entry(p, &q->list, node) {
+        if (n >= max)
+            break;
+        pkts[n++] = p;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return n;
+}
+
 
 size_t queue_count(struct queue *q)
 {
@@ -16,6 +16,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 
 #include <include/timer.h>
 #include <include/ioasync.h>
@@ -28,6 +29,12 @@ struct timer_base {
 
     pthread_mutex_t lock;
     uint64_t next_expires;
+
+    /* set on a base run by its owner's loop instead of a timerfd,
+     * see timer_base_create(). called when the earliest deadline
+     * moved, with lock held. */
+    void (*kick)(void *data);
+    void *kick_data;
 };
 
 struct timer_base _timers;
@@ -57,6 +64,10 @@ static void timer_set_expires(struct timer_list *timer, uint64_t expires)
     struct timer_base *base = timer->base;
 
     base->next_expires = expires;
+    if (base->kick) {
+        base->kick(base->kick_data);
+        return;
+    }
     timer_set_interval(timer, expires - now);
 }
 
@@ -69,7 +80,7 @@ static void update_timer_recent_expires(struct timer_base *base)
     if (RB_EMPTY_ROOT(root))
         return;
 
-    recent = rb_entry(root->rb_node, struct timer_list, entry);
+    recent = rb_entry(rb_first(root), struct timer_list, entry);
 
     if (time_before(recent->expires, base->next_expires) ||
         time_before_eq(base->next_expires, now)) {
@@ -248,7 +259,7 @@ next:
     if (RB_EMPTY_ROOT(root))
         goto empty;
 
-    node = root->rb_node;
+    node = rb_first(root);
     timer = rb_entry(node, struct timer_list, entry);
 
     if (time_before_eq(timer->expires, now)) {
@@ -287,12 +298,93 @@ empty:
 
 
 void init_timer(struct timer_list *timer)
+{
+    init_timer_on(timer, &_timers);
+}
+
+/**
+ * init_timer_on - initialize a timer which runs on @base
+ * @timer: the timer to be initialized
+ * @base: a base from timer_base_create(), e.g. poller_timer_base()
+ */
+void init_timer_on(struct timer_list *timer, struct timer_base *base)
 {
     memset(timer, 0, sizeof(struct timer_list));
     rb_init_node(&timer->entry);
     INIT_LIST_HEAD(&timer->list);
     timer->state = 0;
-    timer->base = &_timers;
+    timer->base = base;
+}
+
+/**
+ * timer_base_create - create a timer base driven by an event loop
+ * @kick: called when the earliest deadline moved, the loop must then
+ *        recompute its timeout with timer_base_timeout()
+ * @data: @kick argument
+ *
+ * Unlike the global base, no timerfd is used: the loop sleeps for at
+ * most timer_base_timeout() and calls timer_base_run() when it wakes
+ * up, the timer functions run on the loop thread.
+ */
+struct timer_base *timer_base_create(void (*kick)(void *), void *data)
+{
+    struct timer_base *base;
+
+    base = malloc(sizeof(*base));
+    if (!base)
+        return NULL;
+
+    base->clockid = -1;
+    base->ioh = NULL;
+    base->timer_tree = RB_ROOT;
+    base->next_expires = 0;
+    base->kick = kick;
+    base->kick_data = data;
+    pthread_mutex_init(&base->lock, NULL);
+
+    return base;
+}
+
+void timer_base_release(struct timer_base *base)
+{
+    pthread_mutex_destroy(&base->lock);
+    free(base);
+}
+
+/**
+ * timer_base_timeout - milliseconds until the earliest timer of @base
+ *
+ * Returns -1 if no timer is pending, 0 if one is already due.
+ */
+int timer_base_timeout(struct timer_base *base)
+{
+    int timeout = -1;
+    uint64_t now;
+    struct timer_list *first;
+
+    pthread_mutex_lock(&base->lock);
+    if (RB_EMPTY_ROOT(&base->timer_tree)) {
+        /* the next add_timer() must kick the loop out of its sleep */
+        base->next_expires = 0;
+    } else {
+        first = rb_entry(rb_first(&base->timer_tree), struct timer_list, entry);
+        now = curr_time_ms();
+
+        base->next_expires = first->expires;
+        if (time_after(first->expires, now))
+            timeout = min_t(uint64_t, first->expires - now, INT_MAX);
+        else
+            timeout = 0;
+    }
+    pthread_mutex_unlock(&base->lock);
+
+    return timeout;
+}
+
+/* run the expired timers of @base, from the loop driving it */
+void timer_base_run(struct timer_base *base)
+{
+    run_timers(base);
 }
 
 static void timer_handler(void *priv, uint8_t *data, int len)
@@ -326,7 +418,8 @@ int init_timers(void)
     }
 
     base->ioh = iohandler_create(aio, base->clockid,
-                                 timer_handler, timer_close, base);
+                                 timer_handler, timer_close, base,
+                                 IOHANDLER_DISPATCH_DEFERRED);
     return 0;
 }
 
@@ -10,22 +10,31 @@
  *
  */
 
+#define _GNU_SOURCE
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
 #include <pthread.h>
 
+#include <include/utils.h>
 #include <include/timer.h>
 #include <include/list.h>
 #include <include/wait.h>
 #include <include/bitops.h>
+#include <include/bitmap.h>
+#include <include/non-atomic.h>
 #include <include/workqueue.h>
 #include <include/compiler.h>
-#include <include/fake_atomic.h>
+#include <include/atomic.h>
+#include <include/placement.h>
 
 enum {
     /* global_wq flags */
     GWQ_MANAGE_WORKERS = 1 << 0,   /* need to manage workers */
     GWQ_MANAGING_WORKERS   = 1 << 1,   /* managing workers */
-    GWQ_HIGHPRI_PENDING = 1 << 2,
 
     /* worker flags */
     WORKER_STARTED      = 1 << 0,   /* started */
@@ -43,6 +52,12 @@ enum {
     MAX_IDLE_WORKERS_RATIO  = 4,        /* 1/4 of busy can be idle */
 
     IDLE_WORKER_TIMEOUT = 300 * MSEC_PER_SEC,
+
+    WQ_MAX_POOLS        = 64,       /* worker pools, one per cpu */
+    WQ_STEAL_BATCH      = 16,       /* max works taken per steal */
+    WQ_KICK_SCAN        = 4,        /* sibling pools checked by a queuer */
+    WQ_LANE_STARVE      = 8,        /* higher lane picks a waiting lane
+                                       sits through before its turn */
 };
 
 /*
@@ -63,6 +78,8 @@ enum {
  *
  * F: wq->flush_mutex protected.
  *
+ * Q: wq->lock protected.
+ *
  * W: workqueue_lock protected.
  */
 
@@ -83,24 +100,31 @@ struct worker {
     struct work_struct	*current_work;	/* L: work being processed */
     work_func_t     current_func;   /* L: current_work's fn */
     struct workqueue_struct *current_wq; /* L: current_work's wq */
+    uint64_t        current_start;  /* L: current_work's start, ns */
     struct list_head	scheduled;	/* L: scheduled works XXX*/
     struct global_wq	*gwq;		/* I: the associated gwq */
     /* 64 bytes boundary on 64bit, 32 on 32bit */
     uint64_t last_active;	/* L: last active timestamp */
     unsigned int		flags;		/* X: flags */
+    int         kicked;     /* L: woken up to steal work */
 
     pthread_t 			task;		/* I: worker task */
     wait_queue_head_t   waitq;
 };
 
 /*
- * Global workqueue.  There's one and only one for
- * and all works are queued and processed here regardless of their
- * target workqueues.
+ * Global workqueue pool.  There's one per cpu (or per wq_pool_cpus
+ * cpus), works are queued on the pool of the cpu which submits them
+ * regardless of their target workqueues, and idle workers steal from
+ * the backlog of busy sibling pools.
  */
 struct global_wq {
     pthread_mutex_t		lock;		/* the gwq lock */
-    struct list_head	worklist;	/* L: list of pending works */
+    int         id;         /* I: index in global_wqs */
+    struct list_head	worklist[WQ_NR_LANES];	/* L: pending works */
+    int         nr_pending; /* L: works on all lanes */
+    int         lane_pending[WQ_NR_LANES];  /* L: works per lane */
+    int         lane_skipped[WQ_NR_LANES];  /* L: see gwq_dequeue_work() */
     unsigned int		flags;		/* L: GWQ_* flags */
 
     int			nr_workers;	/* L: total number of workers */
@@ -127,39 +151,110 @@ struct global_wq {
  * aligned at two's power of the number of flag bits.
  */
 struct workqueue_struct {
-    struct global_wq	*gwq;		/* I: the associated gwq */
     unsigned int		flags;		/* I: WQ_* flags */
+    int         lane;       /* I: WQ_LANE_* of its works */
     struct list_head	list;		/* W: list of all workqueues */
 
-    int			nr_active;	/* L: nr of active works */
-    int			max_active;	/* L: max active works */
-    struct list_head	delayed_works;	/* L: delayed works */
+    /* works of a wq may run on any pool, max_active is kept without
+     * the pool locks: nr_active is only raised past max_active for a
+     * moment, by a queuer which then goes through wq->lock. */
+    atomic_t    nr_active;  /* nr of active works */
+    int			max_active;	/* Q: max active works, read without it */
+    pthread_mutex_t     lock;
+    atomic_t    nr_delayed; /* Q: length of delayed_works */
+    struct list_head	delayed_works;	/* Q: delayed works */
+
+    /* counters only, see wq_stat_add() */
+    struct workqueue_stats  stats;
+    uint64_t    stats_since;    /* allocation or last reset, ns */
 };
 
-static struct global_wq _global_wq;
+static struct global_wq *global_wqs;
+static int nr_global_wqs;
+static int wq_pool_cpus = 1;    /* cpus sharing a pool */
 static LIST_HEAD(workqueues);
 static pthread_mutex_t workqueue_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/* flush_workqueue() callers sleep on wq_flush_cond, the workers only
+ * look at it while wq_nr_flushers is not zero. wq_flush_lock nests
+ * outside the pool locks. */
+static atomic_t wq_nr_flushers = ATOMIC_INIT(0);
+static pthread_mutex_t wq_flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wq_flush_cond = PTHREAD_COND_INITIALIZER;
+
 
 static void *worker_thread(void *__worker);
 
+/* the pool of the calling cpu */
 static inline struct global_wq *get_global_wq(void)
 {
-    return &_global_wq;
+    int cpu = sched_getcpu();
+
+    if (unlikely(cpu < 0))
+        cpu = 0;
+    return &global_wqs[(cpu / wq_pool_cpus) % nr_global_wqs];
+}
+
+
+/*
+ * wq->stats is updated by every worker running works of the wq, with
+ * relaxed atomics: each counter is exact but a snapshot of them is not
+ * taken at a single point in time.  No lock is involved.
+ */
+static inline void wq_stat_add(uint64_t *v, uint64_t n)
+{
+    __atomic_fetch_add(v, n, __ATOMIC_RELAXED);
+}
+
+/* returns whether @n is a new maximum */
+static inline bool wq_stat_max(uint64_t *v, uint64_t n)
+{
+    uint64_t old = __atomic_load_n(v, __ATOMIC_RELAXED);
+
+    while (n > old) {
+        if (__atomic_compare_exchange_n(v, &old, n, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return true;
+    }
+    return false;
+}
+
+static inline int wq_hist_bucket(uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+
+    if (!us)
+        return 0;
+    return min(64 - __builtin_clzll(us), WQ_HIST_BUCKETS - 1);
+}
+
+/* a work of @wq ran for @exec_ns after waiting @wait_ns */
+static void wq_account_work(struct workqueue_struct *wq, work_func_t func,
+                            uint64_t wait_ns, uint64_t exec_ns)
+{
+    struct workqueue_stats *st = &wq->stats;
+
+    wq_stat_add(&st->done, 1);
+    wq_stat_add(&st->wait_hist[wq_hist_bucket(wait_ns)], 1);
+    wq_stat_max(&st->wait_max_ns, wait_ns);
+    wq_stat_add(&st->exec_hist[wq_hist_bucket(exec_ns)], 1);
+    wq_stat_add(&st->exec_ns, exec_ns);
+    if (wq_stat_max(&st->exec_max_ns, exec_ns))
+        __atomic_store_n(&st->exec_max_func, func, __ATOMIC_RELAXED);
 }
 
 
 static inline void set_work_wq(struct work_struct *work,
                                struct workqueue_struct *wq, unsigned long extra_flags)
 {
-    fake_atomic_long_set(&work->data,
-                         (long)wq | WORK_STRUCT_PENDING | (extra_flags & WORK_STRUCT_FLAG_MASK));
+    atomic_long_set(&work->data,
+                    (long)wq | WORK_STRUCT_PENDING | (extra_flags & WORK_STRUCT_FLAG_MASK));
 }
 
 
 static inline struct workqueue_struct *get_work_wq(struct work_struct *work)
 {
-    return (void *)(fake_atomic_long_get(&work->data) & WORK_STRUCT_WQ_DATA_MASK);
+    return (void *)(atomic_long_get(&work->data) & WORK_STRUCT_WQ_DATA_MASK);
 }
 
 
@@ -170,7 +265,8 @@ static inline struct workqueue_struct *get_work_wq(struct work_struct *work)
  */
 static bool __need_more_worker(struct global_wq *gwq)
 {
-    return !gwq->nr_running || (gwq->flags & GWQ_HIGHPRI_PENDING);
+    /* high lane works don't wait for the running workers */
+    return !gwq->nr_running || gwq->lane_pending[WQ_LANE_HIGH];
 }
 
 /*
@@ -179,7 +275,7 @@ static bool __need_more_worker(struct global_wq *gwq)
  */
 static bool need_more_worker(struct global_wq *gwq)
 {
-    return !list_empty(&gwq->worklist) && __need_more_worker(gwq);
+    return gwq->nr_pending && __need_more_worker(gwq);
 }
 
 
@@ -193,6 +289,22 @@ static struct worker *first_worker(struct global_wq *gwq)
 }
 
 
+/*
+ * wake_up_workers - wake up to @nr idle workers of @gwq, the first
+ * ones as wake_up_worker() would.
+ */
+static void wake_up_workers(struct global_wq *gwq, int nr)
+{
+    struct worker *worker;
+
+    list_for_each_entry(worker, &gwq->idle_list, entry) {
+        if (!nr--)
+            break;
+        wake_up(&worker->waitq);
+    }
+}
+
+
 /**
  * wake_up_worker - wake up an idle worker
  * @gwq: gwq to wake worker for
@@ -372,14 +484,12 @@ static struct worker *find_worker_executing_work(struct global_wq *gwq,
  * @gwq: gwq of interest
  * @wq: wq a work is being queued for
  *
- * A work for @wq is about to be queued on @gwq, determine insertion
- * position for the work.  If @wq is for HIGHPRI wq, the work is
- * queued at the head of the queue but in FIFO order with respect to
- * other HIGHPRI works; otherwise, at the end of the queue.  This
- * function also sets GWQ_HIGHPRI_PENDING flag to hint @gwq that
- * there are HIGHPRI works pending.
+ * A work for @wq is about to be queued on @gwq, it goes to the tail
+ * of the lane of @wq: WQ_HIGHPRI works are always picked first and
+ * WQ_BACKGROUND ones after the normal works, see gwq_dequeue_work().
  *
  * CONTEXT:
+ * pthread_mutex_lock(gwq->lock)
  *
  * RETURNS:
  * Pointer to inserstion position.
@@ -387,25 +497,13 @@ static struct worker *find_worker_executing_work(struct global_wq *gwq,
 static inline struct list_head *gwq_determine_ins_pos(struct global_wq *gwq,
         struct workqueue_struct *wq)
 {
-    struct work_struct *twork;
-
-    if (likely(!(wq->flags & WQ_HIGHPRI)))
-        return &gwq->worklist;
-
-    list_for_each_entry(twork, &gwq->worklist, entry) {
-        struct workqueue_struct *twq = get_work_wq(twork);
-
-        if (!(twq->flags & WQ_HIGHPRI))
-            break;
-    }
-
-    gwq->flags |= GWQ_HIGHPRI_PENDING;
-    return &twork->entry;
+    return &gwq->worklist[wq->lane];
 }
 
 
 /**
  * insert_work - insert a work into gwq
+ * @gwq: pool to queue @work on
  * @wq: wq @work belongs to
  * @work: work to insert
  * @head: insertion point
@@ -415,22 +513,266 @@ static inline struct list_head *gwq_determine_ins_pos(struct global_wq *gwq,
  * @extra_flags is or'd to work_struct flags.
  *
  * CONTEXT:
+ * pthread_mutex_lock(gwq->lock)
  */
-static void insert_work(struct workqueue_struct *wq,
-                        struct work_struct *work, struct list_head *head,
-                        unsigned int extra_flags)
+static void __insert_work(struct global_wq *gwq, struct workqueue_struct *wq,
+                          struct work_struct *work, struct list_head *head,
+                          unsigned int extra_flags)
 {
-    struct global_wq *gwq = wq->gwq;
-
     /* we own @work, set data and link */
     set_work_wq(work, wq, extra_flags);
 
     list_add_tail(&work->entry, head);
+    gwq->nr_pending++;
+    gwq->lane_pending[wq->lane]++;
+}
+
+static void insert_work(struct global_wq *gwq, struct workqueue_struct *wq,
+                        struct work_struct *work, struct list_head *head,
+                        unsigned int extra_flags)
+{
+    __insert_work(gwq, wq, work, head, extra_flags);
 
     if (__need_more_worker(gwq))
         wake_up_worker(gwq);
 }
 
+/**
+ * gwq_dequeue_work - take the next work off the lanes of @gwq
+ * @gwq: pool with pending works
+ *
+ * Lanes are served in strict priority order, except that a lane which
+ * waited through WQ_LANE_STARVE picks of a higher lane gets the next
+ * one: bulk works keep trickling under a steady flood of high ones.
+ *
+ * CONTEXT:
+ * pthread_mutex_lock(gwq->lock)
+ */
+static struct work_struct *gwq_dequeue_work(struct global_wq *gwq)
+{
+    int lane, pick = -1;
+    struct work_struct *work;
+
+    for (lane = 0; lane < WQ_NR_LANES; lane++) {
+        if (!gwq->lane_pending[lane]) {
+            gwq->lane_skipped[lane] = 0;
+            continue;
+        }
+
+        if (pick < 0)
+            pick = lane;
+        else if (++gwq->lane_skipped[lane] > WQ_LANE_STARVE)
+            pick = lane;
+    }
+    gwq->lane_skipped[pick] = 0;
+
+    work = list_first_entry(&gwq->worklist[pick], struct work_struct, entry);
+    list_del_init(&work->entry);
+    gwq->lane_pending[pick]--;
+    gwq->nr_pending--;
+
+    return work;
+}
+
+/* an idle pool whose workers may take works from a busy sibling */
+static bool gwq_may_steal(struct global_wq *gwq)
+{
+    return !gwq->nr_pending && !gwq->nr_running;
+}
+
+/* works are waiting for a busy worker of @gwq */
+static bool gwq_has_backlog(struct global_wq *gwq)
+{
+    return gwq->nr_pending && (gwq->nr_running || !gwq->nr_idle);
+}
+
+/**
+ * kick_idle_sibling - get help for a pool with a backlog
+ * @gwq: pool which just got a work it won't start right away
+ *
+ * Wake an idle worker of one of the next WQ_KICK_SCAN pools with
+ * nothing to do, it steals from @gwq.  The pools are checked without
+ * their lock first, so a fully busy system costs a few reads only.
+ *
+ * CONTEXT:
+ * No pool lock held.
+ */
+static void kick_idle_sibling(struct global_wq *gwq)
+{
+    int i;
+    struct global_wq *sib;
+    struct worker *worker;
+    int scan = min(nr_global_wqs - 1, (int)WQ_KICK_SCAN);
+
+    for (i = 1; i <= scan; i++) {
+        sib = &global_wqs[(gwq->id + i) % nr_global_wqs];
+        if (!sib->nr_idle || !gwq_may_steal(sib))
+            continue;
+
+        pthread_mutex_lock(&sib->lock);
+        worker = gwq_may_steal(sib) ? first_worker(sib) : NULL;
+        if (worker && !worker->kicked) {
+            worker->kicked = 1;
+            wake_up(&worker->waitq);
+        }
+        pthread_mutex_unlock(&sib->lock);
+
+        if (worker)
+            return;
+    }
+}
+
+/**
+ * wq_pop_delayed - activate the oldest delayed work of @wq
+ * @wq: workqueue which may have room for one more active work
+ *
+ * Works queued while @wq was at max_active wait on @wq->delayed_works.
+ * Returns the first one if it may become active, the caller queues it.
+ *
+ * CONTEXT:
+ * pthread_mutex_lock(wq->lock)
+ */
+static struct work_struct *wq_pop_delayed(struct workqueue_struct *wq)
+{
+    struct work_struct *work;
+
+    if (list_empty(&wq->delayed_works))
+        return NULL;
+
+    if (atomic_inc_return(&wq->nr_active) > wq->max_active) {
+        atomic_dec(&wq->nr_active);
+        return NULL;
+    }
+
+    work = list_first_entry(&wq->delayed_works, struct work_struct, entry);
+    list_del_init(&work->entry);
+    atomic_dec(&wq->nr_delayed);
+
+    return work;
+}
+
+/*
+ * Park @work on @wq->delayed_works.  An active work may have retired
+ * since the caller found @wq full, so look again once @work is visible
+ * to the workers: either they see it, or we see the room they left.
+ */
+static struct work_struct *wq_delay_work(struct workqueue_struct *wq,
+        struct work_struct *work)
+{
+    pthread_mutex_lock(&wq->lock);
+
+    set_work_wq(work, wq, WORK_STRUCT_DELAYED);
+    list_add_tail(&work->entry, &wq->delayed_works);
+    atomic_inc(&wq->nr_delayed);
+    smp_mb();   /* pairs with wq_work_done() */
+
+    work = wq_pop_delayed(wq);
+
+    pthread_mutex_unlock(&wq->lock);
+
+    return work;
+}
+
+/*
+ * wq_delay_works - wq_delay_work() for all but the first @nr_active
+ * works of @batch, the delayed works which fit by now are appended to
+ * @batch in their place.
+ */
+static void wq_delay_works(struct workqueue_struct *wq,
+                           struct list_head *batch, int nr_active)
+{
+    struct work_struct *work, *tmp;
+
+    pthread_mutex_lock(&wq->lock);
+
+    list_for_each_entry_safe(work, tmp, batch, entry) {
+        if (nr_active-- > 0)
+            continue;
+
+        set_work_wq(work, wq, WORK_STRUCT_DELAYED);
+        list_move_tail(&work->entry, &wq->delayed_works);
+        atomic_inc(&wq->nr_delayed);
+    }
+    smp_mb();   /* pairs with wq_work_done() */
+
+    while ((work = wq_pop_delayed(wq)))
+        list_add_tail(&work->entry, batch);
+
+    pthread_mutex_unlock(&wq->lock);
+}
+
+/*
+ * wq_work_done - an active work of @wq has returned
+ *
+ * Returns the delayed work of @wq which takes the freed slot, if any.
+ * Called without any pool lock held.
+ */
+static struct work_struct *wq_work_done(struct workqueue_struct *wq)
+{
+    struct work_struct *work;
+
+    atomic_dec(&wq->nr_active);
+    smp_mb();   /* pairs with wq_delay_work() */
+
+    if (likely(!atomic_get(&wq->nr_delayed)))
+        return NULL;
+
+    pthread_mutex_lock(&wq->lock);
+    work = wq_pop_delayed(wq);
+    pthread_mutex_unlock(&wq->lock);
+
+    return work;
+}
+
+/**
+ * gwq_queue_works - queue active works on the pool of the calling cpu
+ * @wq: workqueue the works belong to
+ * @works: list of works, linked by their entry, emptied
+ *
+ * The works are queued under a single pool lock.  Concurrency managed
+ * works need one running worker, only WQ_CPU_INTENSIVE and high lane
+ * ones wake up an idle worker each.
+ */
+static void gwq_queue_works(struct workqueue_struct *wq,
+                            struct list_head *works)
+{
+    int nr = 0;
+    bool backlog;
+    struct work_struct *work, *tmp;
+    struct global_wq *gwq = get_global_wq();
+
+    if (list_empty(works))
+        return;
+
+    pthread_mutex_lock(&gwq->lock);
+    list_for_each_entry_safe(work, tmp, works, entry) {
+        list_del(&work->entry);
+        __insert_work(gwq, wq, work, gwq_determine_ins_pos(gwq, wq), 0);
+        nr++;
+    }
+
+    if (__need_more_worker(gwq)) {
+        if (!(wq->flags & WQ_CPU_INTENSIVE) && wq->lane != WQ_LANE_HIGH)
+            nr = 1;
+        wake_up_workers(gwq, nr);
+    }
+    /* a running worker will get to them, unless a sibling is faster */
+    backlog = !__need_more_worker(gwq);
+    pthread_mutex_unlock(&gwq->lock);
+
+    if (backlog && nr_global_wqs > 1)
+        kick_idle_sibling(gwq);
+}
+
+/* queue an active work of @wq on the pool of the calling cpu */
+static void gwq_queue_work(struct workqueue_struct *wq,
+                           struct work_struct *work)
+{
+    LIST_HEAD(works);
+
+    list_add_tail(&work->entry, &works);
+    gwq_queue_works(wq, &works);
+}
 
 
 /**
@@ -445,25 +787,21 @@ static void insert_work(struct workqueue_struct *wq,
  */
 static void __queue_work(struct workqueue_struct *wq, struct work_struct *work)
 {
-    struct list_head *worklist;
-    unsigned int work_flags = 0;
-    struct global_wq *gwq = wq->gwq;
+    BUG_ON(!list_empty(&work->entry));
 
-    pthread_mutex_lock(&gwq->lock);
+    work->queued_ns = curr_time_ns();
+    wq_stat_add(&wq->stats.queued, 1);
 
-    BUG_ON(!list_empty(&work->entry));
+    if (unlikely(atomic_inc_return(&wq->nr_active) > wq->max_active)) {
+        atomic_dec(&wq->nr_active);
 
-    if (likely(wq->nr_active < wq->max_active)) {
-        wq->nr_active++;
-        worklist = gwq_determine_ins_pos(gwq, wq);
-    } else {
-        work_flags |= WORK_STRUCT_DELAYED;
-        worklist = &wq->delayed_works;
+        /* may hand back an older delayed work which fits now */
+        work = wq_delay_work(wq, work);
+        if (!work)
+            return;
     }
 
-    insert_work(wq, work, worklist, work_flags);
-
-    pthread_mutex_unlock(&gwq->lock);
+    gwq_queue_work(wq, work);
 }
 
 int queue_work(struct workqueue_struct *wq, struct work_struct *work)
@@ -471,13 +809,70 @@ int queue_work(struct workqueue_struct *wq, struct work_struct *work)
     /*XXX*/
     int ret = 0;
 
-    if (!fake_test_and_set_bit(WORK_STRUCT_PENDING_BIT, work_data_bits(work))) {
+    if (!test_and_set_bit(WORK_STRUCT_PENDING_BIT, work_data_bits(work))) {
         __queue_work(wq, work);
         ret = 1;
     }
     return ret;
 }
 
+/**
+ * queue_work_many - queue a batch of works on a workqueue
+ * @wq: workqueue to use
+ * @works: works to queue, in order
+ * @nr: number of @works
+ * @pending: if not NULL, a bitmap of @nr bits, set for the works which
+ *           were already pending and thus left alone
+ *
+ * Same as queue_work() on each of @works, but the slots of @wq, its
+ * delayed_works and the pool are each locked once for the batch, and
+ * at most one idle worker per new work is woken up.
+ *
+ * Returns the number of works queued.
+ */
+int queue_work_many(struct workqueue_struct *wq, struct work_struct **works,
+                    int nr, unsigned long *pending)
+{
+    int i, active, excess, queued = 0;
+    struct work_struct *work;
+    uint64_t now = curr_time_ns();
+    LIST_HEAD(batch);
+
+    if (pending)
+        bitmap_zero(pending, nr);
+
+    for (i = 0; i < nr; i++) {
+        work = works[i];
+        if (test_and_set_bit(WORK_STRUCT_PENDING_BIT, work_data_bits(work))) {
+            if (pending)
+                __set_bit(i, pending);
+            continue;
+        }
+
+        BUG_ON(!list_empty(&work->entry));
+        work->queued_ns = now;
+        list_add_tail(&work->entry, &batch);
+        queued++;
+    }
+
+    if (!queued)
+        return 0;
+
+    wq_stat_add(&wq->stats.queued, queued);
+
+    /* the head of the batch takes the free slots, the rest waits */
+    active = atomic_add_return(queued, &wq->nr_active);
+    excess = min(max(active - wq->max_active, 0), queued);
+    if (unlikely(excess)) {
+        atomic_sub(excess, &wq->nr_active);
+        wq_delay_works(wq, &batch, queued - excess);
+    }
+
+    gwq_queue_works(wq, &batch);
+
+    return queued;
+}
+
 static void delayed_work_timer_fn(unsigned long __data)
 {
     struct delayed_work *dwork = (struct delayed_work *)__data;
@@ -515,6 +910,79 @@ int queue_delayed_work(struct workqueue_struct *wq,
 }
 
 
+/*
+ * Strands.  A strand runs the works queued on it one at a time and in
+ * queue order, on the workers of a shared workqueue.  Only the strand's
+ * own runner work ever sits on the workqueue, so any number of strands
+ * costs no more workqueues or workers than one.
+ */
+static void strand_run(struct work_struct *run)
+{
+    struct strand *s = container_of(run, struct strand, run);
+    struct work_struct *work;
+    int budget = STRAND_BATCH;
+
+    pthread_mutex_lock(&s->lock);
+    while (!list_empty(&s->works) && budget--) {
+        work = list_first_entry(&s->works, struct work_struct, entry);
+        list_del_init(&work->entry);
+        work_clear_pending(work);
+        pthread_mutex_unlock(&s->lock);
+
+        work->func(work);
+
+        pthread_mutex_lock(&s->lock);
+    }
+
+    /* give the worker to other strands, come back at the tail */
+    if (!list_empty(&s->works))
+        queue_work(s->wq, &s->run);
+    else
+        s->scheduled = 0;
+    pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * strand_init - initialize a strand
+ * @s: strand to initialize
+ * @wq: workqueue whose workers run the strand
+ */
+void strand_init(struct strand *s, struct workqueue_struct *wq)
+{
+    s->wq = wq;
+    s->scheduled = 0;
+    pthread_mutex_init(&s->lock, NULL);
+    INIT_LIST_HEAD(&s->works);
+    INIT_WORK(&s->run, strand_run);
+}
+
+/**
+ * strand_queue_work - queue work on a strand
+ * @s: strand to use
+ * @work: work to queue
+ *
+ * @work runs after every work queued on @s before it has returned, and
+ * never concurrently with them.
+ *
+ * Returns 0 if @work was already on a queue, non-zero otherwise.
+ */
+int strand_queue_work(struct strand *s, struct work_struct *work)
+{
+    if (test_and_set_bit(WORK_STRUCT_PENDING_BIT, work_data_bits(work)))
+        return 0;
+
+    pthread_mutex_lock(&s->lock);
+    list_add_tail(&work->entry, &s->works);
+    if (!s->scheduled) {
+        s->scheduled = 1;
+        queue_work(s->wq, &s->run);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    return 1;
+}
+
+
 /**
  * work_busy - test whether a work is currently pending or running
  * @work: the work to be tested
@@ -530,40 +998,93 @@ int queue_delayed_work(struct workqueue_struct *wq,
  */
 unsigned int work_busy(struct work_struct *work)
 {
-    struct global_wq *gwq = get_global_wq();
+    int i;
+    struct global_wq *gwq;
     unsigned int ret = 0;
 
-    if (!gwq)
+    if (!global_wqs)
         return false;
 
-    pthread_mutex_lock(&gwq->lock);
-
     if (work_pending(work))
         ret |= WORK_BUSY_PENDING;
 
-    if (find_worker_executing_work(gwq, work))
-        ret |= WORK_BUSY_RUNNING;
+    /* any pool may run it, a stolen work runs away from its cpu */
+    for (i = 0; i < nr_global_wqs && !(ret & WORK_BUSY_RUNNING); i++) {
+        gwq = &global_wqs[i];
 
-    pthread_mutex_unlock(&gwq->lock);
+        pthread_mutex_lock(&gwq->lock);
+        if (find_worker_executing_work(gwq, work))
+            ret |= WORK_BUSY_RUNNING;
+        pthread_mutex_unlock(&gwq->lock);
+    }
 
     return ret;
 }
 
 
+/*
+ * A worker is done with @wq only once its current_wq is cleared, after
+ * wq_work_done() which still reads @wq past the nr_active drop.
+ */
+static bool wq_has_workers(struct workqueue_struct *wq)
+{
+    int i, j;
+    bool busy = false;
+    struct global_wq *gwq;
+    struct worker *worker;
+    struct hlist_node *tmp;
+
+    for (i = 0; i < nr_global_wqs && !busy; i++) {
+        gwq = &global_wqs[i];
+
+        pthread_mutex_lock(&gwq->lock);
+        for (j = 0; j < BUSY_WORKER_HASH_SIZE && !busy; j++) {
+            hlist_for_each_entry(worker, tmp, &gwq->busy_hash[j], hentry)
+            if (worker->current_wq == wq)
+                busy = true;
+        }
+        pthread_mutex_unlock(&gwq->lock);
+    }
+
+    return busy;
+}
+
+/* nothing of @wq is queued, delayed or running, with wq_flush_lock held */
+static bool wq_drained(struct workqueue_struct *wq)
+{
+    if (atomic_get(&wq->nr_active) || atomic_get(&wq->nr_delayed))
+        return false;
+
+    return !wq_has_workers(wq);
+}
+
+/* called by a worker once it let go of a work, see flush_workqueue() */
+static void wq_flush_wake(void)
+{
+    pthread_mutex_lock(&wq_flush_lock);
+    pthread_cond_broadcast(&wq_flush_cond);
+    pthread_mutex_unlock(&wq_flush_lock);
+}
+
 /**
  * flush_workqueue - ensure that any scheduled work has run to completion.
  * @wq: workqueue to flush
  *
- * Forces execution of the workqueue and blocks until its completion.
- * This is typically used in driver shutdown handlers.
- *
- * We sleep until all works which were queued on entry have been handled,
- * but we are not livelocked by new incoming ones.
+ * Sleeps until @wq is idle: no work of it queued, delayed or running,
+ * and no worker still touching @wq.  Works queued meanwhile, by the
+ * works themselves or by others, are waited for as well.
  */
 void flush_workqueue(struct workqueue_struct *wq)
 {
+    pthread_mutex_lock(&wq_flush_lock);
+    atomic_inc(&wq_nr_flushers);
+    smp_mb();   /* pairs with process_one_work() */
 
-    /*XXX*/
+    while (!wq_drained(wq))
+        pthread_cond_wait(&wq_flush_cond, &wq_flush_lock);
+
+    atomic_dec(&wq_nr_flushers);
+    pthread_mutex_unlock(&wq_flush_lock);
 }
 
 /* Can I start working?  Called from busy but !running workers. */
@@ -575,8 +1096,8 @@ static bool may_start_working(struct global_wq *gwq)
 /* Do I need to keep working?  Called from currently running workers. */
 static bool keep_working(struct global_wq *gwq)
 {
-    return !list_empty(&gwq->worklist) &&
-           (gwq->nr_running <= 1 || (gwq->flags & GWQ_HIGHPRI_PENDING));
+    return gwq->nr_pending &&
+           (gwq->nr_running <= 1 || gwq->lane_pending[WQ_LANE_HIGH]);
 }
 
 
@@ -665,6 +1186,7 @@ static struct worker *alloc_worker(void)
     INIT_LIST_HEAD(&worker->entry);
     /* on creation a worker is in !idle && prep state */
     worker->flags = WORKER_PREP;
+    worker->kicked = 0;
 
     return worker;
 }
@@ -672,9 +1194,9 @@ static struct worker *alloc_worker(void)
 /**
  * create_worker - create a new workqueue worker
  * @gwq: gwq the new worker will belong to
- * @bind: whether to set affinity to @cpu or not
  *
- * Create a new worker which is bound to @gwq.  The returned worker
+ * Create a new worker which is bound to @gwq and placed as a
+ * THREAD_CLASS_WORKER thread.  The returned worker
  * can be started by calling start_worker() or destroyed using
  * destroy_worker().
  *
@@ -689,6 +1211,7 @@ static struct worker *create_worker(struct global_wq *gwq)
     int ret;
     struct worker *worker = NULL;
     pthread_attr_t attr;
+    char name[32];     /* cut by thread_place() */
 
     worker = alloc_worker();
     if (!worker)
@@ -704,6 +1227,9 @@ static struct worker *create_worker(struct global_wq *gwq)
     if (ret)
         goto create_fail;
 
+    snprintf(name, sizeof(name), "kworker/%d:%d", gwq->id, worker->id);
+    thread_place(worker->task, THREAD_CLASS_WORKER, worker->id, name);
+
     return worker;
 
 create_fail:
@@ -883,26 +1409,165 @@ static bool manage_workers(struct worker *worker)
 }
 
 
+/**
+ * worker_steal_work - take works from the backlog of a sibling pool
+ * @worker: self, its pool has nothing to run
+ *
+ * Move up to half of the first busy sibling's pending works, at most
+ * WQ_STEAL_BATCH, to the pool of @worker.  The higher lanes are taken
+ * first, and works from the head of each lane so that they still run
+ * roughly in queueing order.
+ *
+ * CONTEXT:
+ * pthread_mutex_lock(gwq->lock) which is released while the victim is
+ * locked, two pool locks are never held together.
+ *
+ * RETURNS:
+ * The number of works taken.
+ */
+static int worker_steal_work(struct worker *worker)
+{
+    int i, lane, quota, nr = 0;
+    struct global_wq *gwq = worker->gwq;
+    struct global_wq *victim;
+    struct work_struct *work;
+    struct list_head stolen[WQ_NR_LANES];
+    int nr_stolen[WQ_NR_LANES] = { 0 };
+
+    if (nr_global_wqs == 1)
+        return 0;
+
+    for (lane = 0; lane < WQ_NR_LANES; lane++)
+        INIT_LIST_HEAD(&stolen[lane]);
+
+    pthread_mutex_unlock(&gwq->lock);
+
+    for (i = 1; i < nr_global_wqs && !nr; i++) {
+        victim = &global_wqs[(gwq->id + i) % nr_global_wqs];
+        /* racy hint, rechecked under the lock */
+        if (!gwq_has_backlog(victim))
+            continue;
+
+        pthread_mutex_lock(&victim->lock);
+        if (gwq_has_backlog(victim)) {
+            quota = min((victim->nr_pending + 1) / 2, (int)WQ_STEAL_BATCH);
+            for (lane = 0; lane < WQ_NR_LANES && nr < quota; lane++) {
+                while (nr < quota && victim->lane_pending[lane]) {
+                    work = list_first_entry(&victim->worklist[lane],
+                                            struct work_struct, entry);
+                    list_move_tail(&work->entry, &stolen[lane]);
+                    victim->lane_pending[lane]--;
+                    nr_stolen[lane]++;
+                    nr++;
+                }
+            }
+            victim->nr_pending -= nr;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+
+    pthread_mutex_lock(&gwq->lock);
+
+    for (lane = 0; lane < WQ_NR_LANES; lane++) {
+        list_splice_tail(&stolen[lane], &gwq->worklist[lane]);
+        gwq->lane_pending[lane] += nr_stolen[lane];
+    }
+    gwq->nr_pending += nr;
+
+    return nr;
+}
+
+/**
+ * process_one_work - run a work taken off the worklist
+ * @worker: self
+ * @work: work to process
+ *
+ * CONTEXT:
+ * pthread_mutex_lock(gwq->lock) which is released while @work runs.
+ */
+static void process_one_work(struct worker *worker, struct work_struct *work)
+{
+    struct global_wq *gwq = worker->gwq;
+    struct workqueue_struct *wq = get_work_wq(work);
+    struct work_struct *next;
+    bool cpu_intensive = wq->flags & WQ_CPU_INTENSIVE;
+    uint64_t wait_ns;
+
+    hlist_add_head(&worker->hentry, busy_worker_head(gwq, work));
+
+    worker->current_work = work;
+    worker->current_func = work->func;
+    worker->current_wq = wq;
+    worker->current_start = curr_time_ns();
+    /* @work may be gone once it ran */
+    wait_ns = worker->current_start - work->queued_ns;
+
+    /*
+     * CPU intensive works don't participate in concurrency management.
+     * They're the scheduler's responsibility.  This takes @worker out
+     * of concurrency management and the next code block will chain
+     * execution of the pending work items.
+     */
+    if (unlikely(cpu_intensive))
+        worker_set_flags(worker, WORKER_CPU_INTENSIVE);
+
+    if (need_more_worker(gwq))
+        wake_up_worker(gwq);
+
+    work_clear_pending(work);
+    pthread_mutex_unlock(&gwq->lock);
+
+    worker->current_func(work);
+
+    wq_account_work(wq, worker->current_func, wait_ns,
+                    curr_time_ns() - worker->current_start);
+
+    /* the slot of @work may go to a delayed work of @wq */
+    next = wq_work_done(wq);
+
+    pthread_mutex_lock(&gwq->lock);
+
+    /* clear cpu intensive status */
+    if (unlikely(cpu_intensive))
+        worker_clr_flags(worker, WORKER_CPU_INTENSIVE);
+
+    /* we're done with it, release */
+    hlist_del_init(&worker->hentry);
+    worker->current_work = NULL;
+    worker->current_func = NULL;
+    worker->current_wq = NULL;
+
+    if (next)
+        insert_work(gwq, wq, next, gwq_determine_ins_pos(gwq, wq), 0);
+
+    /* current_wq is cleared, a flusher of @wq may be done.
+     * wq_work_done() ordered our nr_active drop before this read. */
+    if (unlikely(atomic_get(&wq_nr_flushers))) {
+        pthread_mutex_unlock(&gwq->lock);
+        wq_flush_wake();
+        pthread_mutex_lock(&gwq->lock);
+    }
+}
+
 /**
  * worker_thread - the worker thread function
  * @__worker: self
  *
  * The gwq worker thread function.  There's a single dynamic pool of
  * these per each cpu.  These workers process all works regardless of
- * their specific target workqueue.  The only exception is works which
- * belong to workqueues with a rescuer which will be explained in
- * rescuer_thread().
+ * their specific target workqueue, and steal from sibling pools when
+ * their own has nothing left.
  */
 static void *worker_thread(void *__worker)
 {
     struct worker *worker = __worker;
     struct global_wq *gwq = worker->gwq;
-    struct hlist_head *bwh;
 
 woke_up:
     pthread_mutex_lock(&gwq->lock);
 
     worker_leave_idle(worker);
+    worker->kicked = 0;
 recheck:
     /* no more worker necessary? */
     if (!need_more_worker(gwq))
@@ -914,52 +1579,7 @@ recheck:
 
     worker_clr_flags(worker, WORKER_PREP);
     do {
-        struct work_struct *work =
-            list_first_entry(&gwq->worklist,
-                             struct work_struct, entry);
-        struct workqueue_struct *wq = get_work_wq(work);
-
-        bool cpu_intensive = wq->flags & WQ_CPU_INTENSIVE;
-
-        bwh = busy_worker_head(gwq, work);
-        hlist_add_head(&worker->hentry, bwh);
-
-        worker->current_work = work;
-        worker->current_func = work->func;
-        worker->current_wq = wq;
-
-        list_del_init(&work->entry);
-
-        /*
-         * CPU intensive works don't participate in concurrency management.
-         * They're the scheduler's responsibility.  This takes @worker out
-         * of concurrency management and the next code block will chain
-         * execution of the pending work items.
-         */
-        if (unlikely(cpu_intensive))
-            worker_set_flags(worker, WORKER_CPU_INTENSIVE);
-
-        if (need_more_worker(gwq))
-            wake_up_worker(gwq);
-
-        work_clear_pending(work);
-        pthread_mutex_unlock(&gwq->lock);
-
-        worker->current_func(work);
-
-        pthread_mutex_lock(&gwq->lock);
-
-        /* clear cpu intensive status */
-        if (unlikely(cpu_intensive))
-            worker_clr_flags(worker, WORKER_CPU_INTENSIVE);
-
-        /* we're done with it, release */
-        hlist_del_init(&worker->hentry);
-        worker->current_work = NULL;
-        worker->current_func = NULL;
-        worker->current_wq = NULL;
-
-        wq->nr_active--;
+        process_one_work(worker, gwq_dequeue_work(gwq));
     } while (keep_working(gwq));
     worker_set_flags(worker, WORKER_PREP);
 
@@ -967,6 +1587,10 @@ sleep:
     if (unlikely(need_to_manage_workers(gwq)) && manage_workers(worker))
         goto recheck;
 
+    /* our pool is idle, help a busy one before going to sleep */
+    if (gwq_may_steal(gwq) && worker_steal_work(worker))
+        goto recheck;
+
     /*
      * gwq->lock is held and there's no work to process and no
      * need to manage, sleep.  Workers are woken up only while
@@ -977,13 +1601,41 @@ sleep:
     worker_enter_idle(worker);
 
     pthread_mutex_unlock(&gwq->lock);
-    wait_event(worker->waitq, need_more_worker(gwq));
+    wait_event(worker->waitq, need_more_worker(gwq) || worker->kicked);
 
     goto woke_up;
 
     return 0;
 }
 
+static int wq_clamp_max_active(int max_active)
+{
+    if (max_active < 1 || max_active > WQ_MAX_ACTIVE)
+        logw("workqueue: max_active %d requested is out of range, "
+             "clamping between %d and %d\n", max_active, 1, WQ_MAX_ACTIVE);
+
+    return max(min(max_active, (int)WQ_MAX_ACTIVE), 1);
+}
+
+/* lane of the works of a workqueue with @flags, WQ_HIGHPRI wins */
+static int wq_flags_to_lane(unsigned int flags)
+{
+    if (flags & WQ_HIGHPRI)
+        return WQ_LANE_HIGH;
+    if (flags & WQ_BACKGROUND)
+        return WQ_LANE_BACKGROUND;
+    return WQ_LANE_NORMAL;
+}
+
+/**
+ * alloc_workqueue - allocate a workqueue
+ * @max_active: max works of the workqueue running at once, 0 for default
+ * @flags: WQ_* flags
+ *
+ * Works past @max_active wait on the workqueue's delayed_works, in
+ * queueing order.  WQ_HIGHPRI and WQ_BACKGROUND select the lane the
+ * active works of the workqueue are queued on.
+ */
 struct workqueue_struct *alloc_workqueue(int max_active, unsigned int flags)
 {
     struct workqueue_struct *wq;
@@ -995,12 +1647,17 @@ struct workqueue_struct *alloc_workqueue(int max_active, unsigned int flags)
     max_active = max_active ? : WQ_DFL_ACTIVE;
 
     wq->flags = flags;
-    wq->max_active = max_active;
-    wq->nr_active = 0;
-    wq->gwq = get_global_wq();
+    wq->lane = wq_flags_to_lane(flags);
+    wq->max_active = wq_clamp_max_active(max_active);
+    atomic_init(&wq->nr_active, 0);
+    atomic_init(&wq->nr_delayed, 0);
 
+    pthread_mutex_init(&wq->lock, NULL);
     INIT_LIST_HEAD(&wq->delayed_works);
 
+    memset(&wq->stats, 0, sizeof(wq->stats));
+    wq->stats_since = curr_time_ns();
+
     pthread_mutex_lock(&workqueue_lock);
     list_add(&wq->list, &workqueues);
     pthread_mutex_unlock(&workqueue_lock);
@@ -1016,37 +1673,229 @@ struct workqueue_struct *alloc_workqueue(int max_active, unsigned int flags)
  */
 void destroy_workqueue(struct workqueue_struct *wq)
 {
-    unsigned int flush_cnt = 0;
-    bool drained;
-
     //	wq->flags |= WQ_DYING;
 
-reflush:
     flush_workqueue(wq);
 
-    pthread_mutex_lock(&wq->gwq->lock);
-    drained = !wq->nr_active && list_empty(&wq->delayed_works);
-    pthread_mutex_lock(&wq->gwq->lock);
-
-    if (!drained) {
-        if (++flush_cnt == 10 ||
-            (flush_cnt % 100 == 0 && flush_cnt <= 1000))
-            logw("workqueue: flush on destruction isn't complete"
-                 " after %u tries\n", flush_cnt);
-        goto reflush;
-    }
-
     pthread_mutex_lock(&workqueue_lock);
     list_del(&wq->list);
     pthread_mutex_unlock(&workqueue_lock);
 
-    BUG_ON(wq->nr_active);
+    BUG_ON(atomic_get(&wq->nr_active));
     BUG_ON(!list_empty(&wq->delayed_works));
 
+    pthread_mutex_destroy(&wq->lock);
     free(wq);
 }
 
 
+/**
+ * workqueue_set_max_active - adjust max_active of a workqueue
+ * @wq: target workqueue
+ * @max_active: new max_active value.
+ *
+ * Set max_active of @wq to @max_active.  Delayed works which fit under
+ * a raised limit are activated right away, a lowered one is reached as
+ * the active works retire.
+ */
+void workqueue_set_max_active(struct workqueue_struct *wq, int max_active)
+{
+    struct work_struct *work;
+    LIST_HEAD(activated);
+
+    max_active = wq_clamp_max_active(max_active);
+
+    pthread_mutex_lock(&wq->lock);
+    wq->max_active = max_active;
+    while ((work = wq_pop_delayed(wq)))
+        list_add_tail(&work->entry, &activated);
+    pthread_mutex_unlock(&wq->lock);
+
+    gwq_queue_works(wq, &activated);
+}
+
+/**
+ * workqueue_congested - test whether a workqueue is congested
+ * @cpu: unused, works of a workqueue aren't bound to a cpu
+ * @wq: target workqueue
+ *
+ * Test whether @wq is at its max_active and new works are delayed.
+ * The result is only a hint, it may change right away.
+ */
+bool workqueue_congested(unsigned int cpu, struct workqueue_struct *wq)
+{
+    return atomic_get(&wq->nr_delayed) > 0;
+}
+
+/**
+ * workqueue_lane_depth - number of works waiting on a lane
+ * @lane: WQ_LANE_*
+ *
+ * Sum of the active works not yet started on @lane of every pool, the
+ * works delayed by max_active aren't counted.  Only a hint.
+ */
+int workqueue_lane_depth(int lane)
+{
+    int i, depth = 0;
+
+    if (lane < 0 || lane >= WQ_NR_LANES)
+        return -EINVAL;
+
+    for (i = 0; i < nr_global_wqs; i++) {
+        pthread_mutex_lock(&global_wqs[i].lock);
+        depth += global_wqs[i].lane_pending[lane];
+        pthread_mutex_unlock(&global_wqs[i].lock);
+    }
+
+    return depth;
+}
+
+/**
+ * workqueue_stats_snapshot - copy the statistics of @wq
+ *
+ * Never blocks the works of @wq, the pool locks are taken in turn to
+ * look at the busy workers.
+ */
+int workqueue_stats_snapshot(struct workqueue_struct *wq,
+                             struct workqueue_stats *st)
+{
+    int i, j;
+    uint64_t now, ns;
+    struct global_wq *gwq;
+    struct worker *worker;
+    struct hlist_node *tmp;
+    struct workqueue_stats *cnt = &wq->stats;
+
+#define WQ_STAT_READ(f)     __atomic_load_n(&cnt->f, __ATOMIC_RELAXED)
+    st->queued = WQ_STAT_READ(queued);
+    st->done = WQ_STAT_READ(done);
+    for (i = 0; i < WQ_HIST_BUCKETS; i++) {
+        st->wait_hist[i] = WQ_STAT_READ(wait_hist[i]);
+        st->exec_hist[i] = WQ_STAT_READ(exec_hist[i]);
+    }
+    st->wait_max_ns = WQ_STAT_READ(wait_max_ns);
+    st->exec_ns = WQ_STAT_READ(exec_ns);
+    st->exec_max_ns = WQ_STAT_READ(exec_max_ns);
+    st->exec_max_func = WQ_STAT_READ(exec_max_func);
+#undef WQ_STAT_READ
+
+    now = curr_time_ns();
+    st->elapsed_ns = now - __atomic_load_n(&wq->stats_since, __ATOMIC_RELAXED);
+
+    st->max_active = wq->max_active;
+    st->nr_active = atomic_get(&wq->nr_active);
+    st->nr_delayed = atomic_get(&wq->nr_delayed);
+
+    st->nr_busy = 0;
+    st->longest_ns = 0;
+    st->longest_func = NULL;
+    st->nr_workers = 0;
+    st->nr_idle = 0;
+
+    for (i = 0; i < nr_global_wqs; i++) {
+        gwq = &global_wqs[i];
+
+        pthread_mutex_lock(&gwq->lock);
+        st->nr_workers += gwq->nr_workers;
+        st->nr_idle += gwq->nr_idle;
+
+        for (j = 0; j < BUSY_WORKER_HASH_SIZE; j++) {
+            hlist_for_each_entry(worker, tmp, &gwq->busy_hash[j], hentry) {
+                if (worker->current_wq != wq)
+                    continue;
+
+                st->nr_busy++;
+                ns = now - worker->current_start;
+                if (ns >= st->longest_ns) {
+                    st->longest_ns = ns;
+                    st->longest_func = worker->current_func;
+                }
+            }
+        }
+        pthread_mutex_unlock(&gwq->lock);
+    }
+
+    return 0;
+}
+
+/**
+ * workqueue_stats_reset - clear the counters of @wq
+ *
+ * The works completing meanwhile may be counted or not.
+ */
+void workqueue_stats_reset(struct workqueue_struct *wq)
+{
+    int i;
+    struct workqueue_stats *cnt = &wq->stats;
+
+#define WQ_STAT_CLEAR(f)    __atomic_store_n(&cnt->f, 0, __ATOMIC_RELAXED)
+    WQ_STAT_CLEAR(queued);
+    WQ_STAT_CLEAR(done);
+    for (i = 0; i < WQ_HIST_BUCKETS; i++) {
+        WQ_STAT_CLEAR(wait_hist[i]);
+        WQ_STAT_CLEAR(exec_hist[i]);
+    }
+    WQ_STAT_CLEAR(wait_max_ns);
+    WQ_STAT_CLEAR(exec_ns);
+    WQ_STAT_CLEAR(exec_max_ns);
+    WQ_STAT_CLEAR(exec_max_func);
+#undef WQ_STAT_CLEAR
+
+    __atomic_store_n(&wq->stats_since, curr_time_ns(), __ATOMIC_RELAXED);
+}
+
+/**
+ * workqueue_stats_percentile - duration under which @pct percent of
+ * the works counted in @hist fell, in nanoseconds.  This is the upper
+ * bound of the histogram bucket holding that rank.
+ * @hist: wait_hist or exec_hist of a snapshot
+ * @max_ns: the matching wait_max_ns or exec_max_ns
+ */
+uint64_t workqueue_stats_percentile(const uint64_t *hist, uint64_t max_ns,
+                                    int pct)
+{
+    int i;
+    uint64_t rank;
+    uint64_t total = 0, seen = 0;
+
+    for (i = 0; i < WQ_HIST_BUCKETS; i++)
+        total += hist[i];
+    if (!total)
+        return 0;
+
+    rank = (total * pct + 99) / 100;
+    for (i = 0; i < WQ_HIST_BUCKETS - 1; i++) {
+        seen += hist[i];
+        if (seen >= rank)
+            return min_t(uint64_t, (1ULL << i) * 1000, max_ns);
+    }
+    return max_ns;
+}
+
+/**
+ * workqueue_for_each - call @fn on every workqueue
+ *
+ * Stops at the first non zero value returned by @fn and returns it.
+ * Workqueues can't be destroyed while @fn runs.
+ */
+int workqueue_for_each(int (*fn)(struct workqueue_struct *wq, void *data),
+                       void *data)
+{
+    int ret = 0;
+    struct workqueue_struct *wq;
+
+    pthread_mutex_lock(&workqueue_lock);
+    list_for_each_entry(wq, &workqueues, list) {
+        ret = fn(wq, data);
+        if (ret)
+            break;
+    }
+    pthread_mutex_unlock(&workqueue_lock);
+
+    return ret;
+}
+
+
 static void idle_worker_timeout(unsigned long __gwq)
 {
     struct global_wq *gwq = (void *)__gwq;
@@ -1075,18 +1924,24 @@ static void idle_worker_timeout(unsigned long __gwq)
 
 
 
-int init_workqueues(void)
+static void init_global_wq(struct global_wq *gwq, int id)
 {
     int i;
     struct worker *worker;
-    struct global_wq *gwq = get_global_wq();
 
     pthread_mutex_init(&gwq->lock, NULL);
 
-    INIT_LIST_HEAD(&gwq->worklist);
+    gwq->id = id;
+    for (i = 0; i < WQ_NR_LANES; i++) {
+        INIT_LIST_HEAD(&gwq->worklist[i]);
+        gwq->lane_pending[i] = 0;
+        gwq->lane_skipped[i] = 0;
+    }
+    gwq->nr_pending = 0;
     gwq->flags = 0;
     gwq->nr_workers = 0;
     gwq->nr_idle = 0;
+    gwq->nr_running = 0;
     gwq->worker_ids = 0;
 
     INIT_LIST_HEAD(&gwq->idle_list);
@@ -1101,8 +1956,36 @@ int init_workqueues(void)
 
     INIT_LIST_HEAD(&gwq->workqueues);
 
+    /* the new worker takes gwq->lock first thing, hold it until the
+     * worker is on the idle list. */
+    pthread_mutex_lock(&gwq->lock);
     worker = create_worker(gwq);
     start_worker(worker);
+    pthread_mutex_unlock(&gwq->lock);
+}
+
+/**
+ * init_workqueues - set up one worker pool per cpu
+ *
+ * Each pool starts with a single idle worker and grows on demand.
+ * Only the first call does anything.
+ */
+int init_workqueues(void)
+{
+    int i, nr_cpus;
+
+    if (global_wqs)
+        return 0;
+
+    nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nr_cpus <= 0)
+        nr_cpus = 1;
+
+    nr_global_wqs = min(DIV_ROUND_UP(nr_cpus, wq_pool_cpus), (int)WQ_MAX_POOLS);
+    global_wqs = xzalloc(nr_global_wqs * sizeof(*global_wqs));
+
+    for (i = 0; i < nr_global_wqs; i++)
+        init_global_wq(&global_wqs[i], i);
 
     return 0;
 }
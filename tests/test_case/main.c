@@ -17,6 +17,26 @@ struct test_case cases[] = {
 	{"configs", "", test_configs},
 	{"workqueue", "", test_workqueue},
 	{"timer", "", test_timer},
+	{"strand", "", test_strand},
+	{"ioasync", "", test_ioasync},
+	{"ioasync_recv", "", test_ioasync_recv},
+	{"ioasync_relay", "", test_ioasync_relay},
+	{"ioasync_inline_close", "", test_ioasync_inline_close},
+	{"ioasync_wm", "", test_ioasync_wm},
+	{"ioasync_wm_block", "", test_ioasync_wm_block},
+	{"ioasync_udp", "", test_ioasync_udp},
+	{"poller_timer", "", test_poller_timer},
+	{"ioasync_accept", "", test_ioasync_accept},
+	{"poller_stats", "", test_poller_stats},
+	{"mempool", "", test_mempool},
+	{"mm_alloc", "", test_mm_alloc},
+	{"atomic", "", test_atomic},
+	{"pack_buf", "", test_pack_buf},
+	{"workqueue_pools", "", test_workqueue_pools},
+	{"workqueue_lanes", "", test_workqueue_lanes},
+	{"workqueue_many", "", test_workqueue_many},
+	{"workqueue_stats", "", test_workqueue_stats},
+	{"placement", "", test_placement},
 };
 
 
@@ -5,5 +5,25 @@ extern int test_list(int argc, char **argv);
 extern int test_configs(int argc, char **argv);
 extern int test_workqueue(int argc, char **argv);
 extern int test_timer(int argc, char **argv);
+extern int test_strand(int argc, char **argv);
+extern int test_ioasync(int argc, char **argv);
+extern int test_ioasync_recv(int argc, char **argv);
+extern int test_ioasync_relay(int argc, char **argv);
+extern int test_ioasync_inline_close(int argc, char **argv);
+extern int test_ioasync_wm(int argc, char **argv);
+extern int test_ioasync_wm_block(int argc, char **argv);
+extern int test_ioasync_udp(int argc, char **argv);
+extern int test_poller_timer(int argc, char **argv);
+extern int test_ioasync_accept(int argc, char **argv);
+extern int test_poller_stats(int argc, char **argv);
+extern int test_mempool(int argc, char **argv);
+extern int test_mm_alloc(int argc, char **argv);
+extern int test_atomic(int argc, char **argv);
+extern int test_pack_buf(int argc, char **argv);
+extern int test_workqueue_pools(int argc, char **argv);
+extern int test_workqueue_lanes(int argc, char **argv);
+extern int test_workqueue_many(int argc, char **argv);
+extern int test_workqueue_stats(int argc, char **argv);
+extern int test_placement(int argc, char **argv);
 
 #endif
@@ -1,12 +1,22 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include <include/list.h>
 #include <include/log.h>
 #include <include/configs.h>
 #include <include/workqueue.h>
+#include <include/ioasync.h>
+#include <include/atomic.h>
+#include <include/bitmap.h>
+#include <include/non-atomic.h>
+#include <include/placement.h>
 
 
 struct test_list_st
@@ -85,6 +95,65 @@ int test_workqueue(int argc, char **argv)
     return ret;
 }
 
+#define STRAND_TEST_COUNT      (4)
+#define STRAND_TEST_WORKS      (32)
+
+struct strand_test {
+    struct work_struct work;
+    int seq;
+    int *last;
+    int order_err;
+};
+
+static void handle_strand_work(struct work_struct *work)
+{
+    struct strand_test *st = container_of(work, struct strand_test, work);
+
+    if (*st->last != st->seq - 1)
+        st->order_err = 1;
+    *st->last = st->seq;
+}
+
+int test_strand(int argc, char **argv)
+{
+    int i, j;
+    int ret = 0;
+    struct workqueue_struct *wq;
+    struct strand strands[STRAND_TEST_COUNT];
+    int last[STRAND_TEST_COUNT];
+    struct strand_test works[STRAND_TEST_COUNT][STRAND_TEST_WORKS];
+
+    /* fewer active slots than strands, some runs must be delayed */
+    wq = alloc_workqueue(2, 0);
+
+    for (i = 0; i < STRAND_TEST_COUNT; i++) {
+        strand_init(&strands[i], wq);
+        last[i] = -1;
+    }
+
+    for (j = 0; j < STRAND_TEST_WORKS; j++) {
+        for (i = 0; i < STRAND_TEST_COUNT; i++) {
+            struct strand_test *st = &works[i][j];
+
+            INIT_WORK(&st->work, handle_strand_work);
+            st->seq = j;
+            st->last = &last[i];
+            st->order_err = 0;
+            strand_queue_work(&strands[i], &st->work);
+        }
+    }
+    sleep(1);
+
+    for (i = 0; i < STRAND_TEST_COUNT; i++) {
+        if (last[i] != STRAND_TEST_WORKS - 1)
+            ret = -1;
+        for (j = 0; j < STRAND_TEST_WORKS; j++)
+            ret |= -works[i][j].order_err;
+    }
+
+    printf("strand test %s.\n", ret ? "failed" : "success");
+    return ret;
+}
 
 struct timer_test {
     int val;
@@ -120,3 +189,1213 @@ int test_timer(int argc, char **argv)
     return ret;
 }
 
+
+
+#define IOASYNC_TEST_PAIRS     (8)
+
+struct ioasync_test {
+    int received;
+    int len;
+};
+
+static void handle_ioasync(void *priv, uint8_t *data, int len)
+{
+    struct ioasync_test *iot = (struct ioasync_test *)priv;
+
+    iot->len += len;
+    iot->received++;
+}
+
+int test_ioasync(int argc, char **argv)
+{
+    int i;
+    int ret = 0;
+    ioasync_t *aio;
+    int socks[IOASYNC_TEST_PAIRS][2];
+    iohandler_t *ioh[IOASYNC_TEST_PAIRS];
+    struct ioasync_test iot[IOASYNC_TEST_PAIRS];
+    char msg[8 * 1024];
+
+    aio = ioasync_create(4, IOASYNC_POLICY_LEAST_LOADED, POLLER_BACKEND_URING);
+    if (!aio)
+        return -1;
+
+    for (i = 0; i < IOASYNC_TEST_PAIRS; i++) {
+        socketpair(AF_UNIX, SOCK_STREAM, 0, socks[i]);
+        iot[i].received = 0;
+        iot[i].len = 0;
+        /* half of the handlers dispatch inline on the reactor thread */
+        ioh[i] = iohandler_create(aio, socks[i][1], handle_ioasync, NULL,
+                                  &iot[i], (i & 2) ? IOHANDLER_DISPATCH_INLINE :
+                                  IOHANDLER_DISPATCH_DEFERRED);
+        /* small budget, the rest must be picked up without a new edge */
+        if (i & 1)
+            iohandler_set_edge_triggered(ioh[i], 0, 2);
+    }
+
+    memset(msg, 'a', sizeof(msg));
+    for (i = 0; i < IOASYNC_TEST_PAIRS; i++)
+        write(socks[i][0], msg, sizeof(msg));
+    sleep(1);
+
+    for (i = 0; i < IOASYNC_TEST_PAIRS; i++) {
+        if (iot[i].len != sizeof(msg))
+            ret = -1;
+    }
+
+    /* many small messages back, coalesced by the writev path */
+    for (i = 0; i < IOASYNC_TEST_PAIRS; i++) {
+        int j;
+        for (j = 0; j < (int)sizeof(msg) / 32; j++)
+            iohandler_send(ioh[i], (uint8_t *)msg + j * 32, 32);
+    }
+    sleep(1);
+
+    for (i = 0; i < IOASYNC_TEST_PAIRS; i++) {
+        int len, total = 0;
+        while ((len = recv(socks[i][0], msg, sizeof(msg), MSG_DONTWAIT)) > 0)
+            total += len;
+        if (total != sizeof(msg))
+            ret = -1;
+        iohandler_shutdown(ioh[i]);
+    }
+
+    printf("ioasync test %s, %d reactors.\n", ret ? "failed" : "success",
+           ioasync_reactor_count(aio));
+
+    /* joins the reactor threads */
+    ioasync_release(aio);
+    for (i = 0; i < IOASYNC_TEST_PAIRS; i++) {
+        close(socks[i][0]);
+        close(socks[i][1]);
+    }
+    return ret;
+}
+
+static void handle_ioasync_close(void *priv)
+{
+    struct ioasync_test *iot = (struct ioasync_test *)priv;
+
+    iot->received = -1;
+}
+
+int test_ioasync_recv(int argc, char **argv)
+{
+    int ret = 0;
+    int paused;
+    ioasync_t *aio;
+    iohandler_t *ioh;
+    int socks[2];
+    struct ioasync_test iot = { 0, 0 };
+    char msg[64 * 1024];
+
+    /* streams are read by multishot recvs on io_uring */
+    aio = ioasync_create(1, IOASYNC_POLICY_FD_HASH, POLLER_BACKEND_URING);
+    if (!aio)
+        return -1;
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, socks);
+    ioh = iohandler_create(aio, socks[1], handle_ioasync, handle_ioasync_close,
+                           &iot, IOHANDLER_DISPATCH_INLINE);
+
+    iohandler_pause_read(ioh);
+    usleep(100 * 1000);
+
+    memset(msg, 'm', sizeof(msg));
+    write(socks[0], msg, sizeof(msg) / 2);
+    usleep(200 * 1000);
+    paused = iot.len;
+
+    iohandler_resume_read(ioh);
+    write(socks[0], msg, sizeof(msg) / 2);
+    usleep(200 * 1000);
+    if (paused || iot.len != sizeof(msg))
+        ret = -1;
+
+    /* end of stream closes the handler */
+    close(socks[0]);
+    usleep(200 * 1000);
+    if (iot.received != -1)
+        ret = -1;
+
+    printf("ioasync recv test %s, %d bytes, %d while paused.\n",
+           ret ? "failed" : "success", iot.len, paused);
+    return ret;
+}
+
+struct ioasync_bye {
+    iohandler_t *ioh;
+    int calls;
+};
+
+static void handle_ioasync_bye(void *priv, uint8_t *data, int len)
+{
+    struct ioasync_bye *bye = (struct ioasync_bye *)priv;
+
+    /* reply and go away with the rest of the read still pending */
+    bye->calls++;
+    iohandler_send(bye->ioh, (uint8_t *)"bye", 3);
+    iohandler_shutdown(bye->ioh);
+}
+
+static void handle_ioasync_bye_from(void *priv, uint8_t *data, int len,
+                                    void *from)
+{
+    struct ioasync_bye *bye = (struct ioasync_bye *)priv;
+
+    bye->calls++;
+    iohandler_sendto(bye->ioh, (uint8_t *)"bye", 3, from);
+    iohandler_shutdown(bye->ioh);
+}
+
+static int udp_bind_loopback(struct sockaddr_in *addr);
+
+int test_ioasync_inline_close(int argc, char **argv)
+{
+    int i;
+    int ret = 0;
+    ioasync_t *aio;
+    int socks[2];
+    int rx, tx;
+    struct sockaddr_in rx_addr, tx_addr;
+    struct ioasync_bye stream = { NULL, 0 };
+    struct ioasync_bye dgram = { NULL, 0 };
+    char msg[8 * 1024];
+
+    aio = ioasync_create(1, IOASYNC_POLICY_FD_HASH, POLLER_BACKEND_EPOLL);
+    if (!aio)
+        return -1;
+
+    /* the drain loop must stop at the first packet */
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, socks) < 0)
+        return -1;
+    stream.ioh = iohandler_create(aio, socks[1], handle_ioasync_bye, NULL,
+                                  &stream, IOHANDLER_DISPATCH_INLINE);
+    if (!stream.ioh)
+        return -1;
+    iohandler_set_edge_triggered(stream.ioh, 0, 0);
+
+    /* and so must the walk of a recvmmsg() batch */
+    rx = udp_bind_loopback(&rx_addr);
+    tx = udp_bind_loopback(&tx_addr);
+    dgram.ioh = iohandler_udp_create(aio, rx, handle_ioasync_bye_from, NULL,
+                                     &dgram, IOHANDLER_DISPATCH_INLINE);
+    if (!dgram.ioh)
+        return -1;
+    iohandler_udp_set_batch(dgram.ioh, 8);
+
+    memset(msg, 'c', sizeof(msg));
+    write(socks[0], msg, sizeof(msg));
+    for (i = 0; i < 8; i++)
+        sendto(tx, msg, 64, 0, (struct sockaddr *)&rx_addr, sizeof(rx_addr));
+    sleep(1);
+
+    if (stream.calls != 1 || dgram.calls != 1)
+        ret = -1;
+
+    ioasync_release(aio);
+    close(socks[0]);
+    close(socks[1]);
+    close(rx);
+    close(tx);
+
+    printf("ioasync inline close test %s, %d/%d calls.\n",
+           ret ? "failed" : "success", stream.calls, dgram.calls);
+    return ret;
+}
+
+static void handle_ioasync_relay(void *priv, pack_buf_t *pkb)
+{
+    /* the buffer reference goes straight to the other side's q_out */
+    if (iohandler_pkt_send((iohandler_t *)priv, pkb))
+        iohandler_pack_buf_free(pkb);
+}
+
+int test_ioasync_relay(int argc, char **argv)
+{
+    int len;
+    int total = 0;
+    int ret = 0;
+    ioasync_t *aio;
+    int in[2], out[2];
+    iohandler_t *src, *dst;
+    char msg[4 * 1024];
+
+    aio = ioasync_create(2, IOASYNC_POLICY_FD_HASH, POLLER_BACKEND_EPOLL);
+    if (!aio)
+        return -1;
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, in);
+    socketpair(AF_UNIX, SOCK_STREAM, 0, out);
+
+    dst = iohandler_create(aio, out[1], NULL, NULL, NULL,
+                           IOHANDLER_DISPATCH_DEFERRED);
+    src = iohandler_pkb_create(aio, in[1], handle_ioasync_relay, NULL, dst,
+                               IOHANDLER_DISPATCH_INLINE);
+
+    memset(msg, 'r', sizeof(msg));
+    write(in[0], msg, sizeof(msg));
+    sleep(1);
+
+    while ((len = recv(out[0], msg, sizeof(msg), MSG_DONTWAIT)) > 0)
+        total += len;
+    if (total != sizeof(msg))
+        ret = -1;
+
+    iohandler_shutdown(src);
+    iohandler_shutdown(dst);
+
+    printf("ioasync relay test %s, %d bytes.\n",
+           ret ? "failed" : "success", total);
+    return ret;
+}
+
+static void handle_ioasync_writable(void *priv)
+{
+    struct ioasync_test *iot = (struct ioasync_test *)priv;
+
+    iot->received++;
+}
+
+int test_ioasync_wm(int argc, char **argv)
+{
+    int i;
+    int len;
+    int ret = 0;
+    int sent = 0;
+    int total = 0;
+    int sndbuf = 4096;
+    ioasync_t *aio;
+    iohandler_t *ioh;
+    int socks[2];
+    struct ioasync_test iot = { 0, 0 };
+    char msg[1024];
+
+    aio = ioasync_create(1, IOASYNC_POLICY_FD_HASH, POLLER_BACKEND_EPOLL);
+    if (!aio)
+        return -1;
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, socks);
+    setsockopt(socks[1], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+    ioh = iohandler_create(aio, socks[1], NULL, NULL, &iot,
+                           IOHANDLER_DISPATCH_DEFERRED);
+    iohandler_set_watermarks(ioh, 16 * 1024, 0, 0, 0, 0);
+    iohandler_set_writable_cb(ioh, handle_ioasync_writable);
+
+    /* nobody reads: the queue must fill up and refuse more */
+    memset(msg, 'w', sizeof(msg));
+    for (i = 0; i < 1024; i++) {
+        if (iohandler_send(ioh, (uint8_t *)msg, sizeof(msg)))
+            break;
+        sent += sizeof(msg);
+    }
+    if (i == 1024)
+        ret = -1;
+
+    /* drain the peer, the queue goes below the low watermark */
+    for (i = 0; i < 100 && total < sent; i++) {
+        while ((len = recv(socks[0], msg, sizeof(msg), MSG_DONTWAIT)) > 0)
+            total += len;
+        usleep(10 * 1000);
+    }
+    if (total != sent || iot.received != 1)
+        ret = -1;
+
+    iohandler_shutdown(ioh);
+
+    printf("ioasync watermark test %s, %d bytes, %d writable.\n",
+           ret ? "failed" : "success", total, iot.received);
+    return ret;
+}
+
+struct ioasync_wm_block_test {
+    iohandler_t *ioh;
+    int ret;
+};
+
+static void *ioasync_wm_block_thread(void *arg)
+{
+    struct ioasync_wm_block_test *wbt = arg;
+    char msg[1024];
+
+    /* the reactor may still have flushed a little, keep going until the
+     * queue is full again and the send sleeps */
+    memset(msg, 'b', sizeof(msg));
+    while (!(wbt->ret = iohandler_send(wbt->ioh, (uint8_t *)msg,
+                                       sizeof(msg))))
+        ;
+    return NULL;
+}
+
+int test_ioasync_wm_block(int argc, char **argv)
+{
+    int i;
+    int ret = 0;
+    int sndbuf = 4096;
+    ioasync_t *aio;
+    pthread_t thread;
+    int socks[2];
+    struct ioasync_wm_block_test wbt = { NULL, 0 };
+    char msg[1024];
+
+    aio = ioasync_create(1, IOASYNC_POLICY_FD_HASH, POLLER_BACKEND_EPOLL);
+    if (!aio)
+        return -1;
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, socks);
+    setsockopt(socks[1], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+    wbt.ioh = iohandler_create(aio, socks[1], NULL, NULL, &wbt,
+                               IOHANDLER_DISPATCH_DEFERRED);
+    iohandler_set_watermarks(wbt.ioh, 16 * 1024, 0, 0, 0, 0);
+
+    /* fill the queue in fail-fast mode, then make senders wait */
+    memset(msg, 'w', sizeof(msg));
+    for (i = 0; i < 1024; i++) {
+        if (iohandler_send(wbt.ioh, (uint8_t *)msg, sizeof(msg)))
+            break;
+    }
+    iohandler_set_watermarks(wbt.ioh, 16 * 1024, 0, 0, 0,
+                             IOHANDLER_WM_BLOCK);
+
+    pthread_create(&thread, NULL, ioasync_wm_block_thread, &wbt);
+    usleep(50 * 1000);
+
+    /* nobody reads: only the shutdown may release the sender */
+    iohandler_shutdown(wbt.ioh);
+    pthread_join(thread, NULL);
+    if (i == 1024 || wbt.ret != -EPIPE)
+        ret = -1;
+
+    printf("ioasync watermark block test %s, sender got %d.\n",
+           ret ? "failed" : "success", wbt.ret);
+    return ret;
+}
+
+struct poller_timer_test {
+    int fired;
+    uint64_t when;
+    pthread_t thread;
+};
+
+static void handle_poller_timer(unsigned long data)
+{
+    struct poller_timer_test *ptt = (struct poller_timer_test *)data;
+
+    ptt->when = curr_time_ms();
+    ptt->thread = pthread_self();
+    ptt->fired++;
+}
+
+int test_poller_timer(int argc, char **argv)
+{
+    int ret = 0;
+    int socks[2];
+    uint64_t start;
+    ioasync_t *aio;
+    iohandler_t *ioh;
+    struct timer_list timer, later;
+    struct poller_timer_test ptt = { 0 };
+    struct poller_timer_test ptt_later = { 0 };
+
+    aio = ioasync_create(1, IOASYNC_POLICY_FD_HASH, POLLER_BACKEND_EPOLL);
+    if (!aio)
+        return -1;
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, socks);
+    ioh = iohandler_create(aio, socks[1], NULL, NULL, NULL,
+                           IOHANDLER_DISPATCH_DEFERRED);
+
+    /* the loop sleeps on the later timer first, the earlier one
+     * added next must cut that sleep short */
+    iohandler_init_timer(ioh, &later);
+    setup_timer(&later, handle_poller_timer, (unsigned long)&ptt_later);
+    iohandler_init_timer(ioh, &timer);
+    setup_timer(&timer, handle_poller_timer, (unsigned long)&ptt);
+
+    start = curr_time_ms();
+    mod_timer(&later, start + 2 * MSEC_PER_SEC);
+    usleep(50 * 1000);
+    mod_timer(&timer, start + 200);
+    sleep(1);
+
+    if (ptt.fired != 1 || ptt_later.fired != 0 ||
+        ptt.when < start + 200 || ptt.when > start + 500 ||
+        pthread_equal(ptt.thread, pthread_self()))
+        ret = -1;
+    del_timer(&later);
+
+    iohandler_shutdown(ioh);
+
+    printf("poller timer test %s, fired after %dms.\n",
+           ret ? "failed" : "success", (int)(ptt.when - start));
+    return ret;
+}
+
+#define IOASYNC_UDP_COUNT      (200)
+
+static void handle_ioasync_udp(void *priv, uint8_t *data, int len, void *from)
+{
+    struct ioasync_test *iot = (struct ioasync_test *)priv;
+
+    iot->len += len;
+    iot->received++;
+}
+
+static int udp_bind_loopback(struct sockaddr_in *addr)
+{
+    int fd;
+    socklen_t len = sizeof(*addr);
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bind(fd, (struct sockaddr *)addr, sizeof(*addr));
+    getsockname(fd, (struct sockaddr *)addr, &len);
+    return fd;
+}
+
+int test_ioasync_udp(int argc, char **argv)
+{
+    int i;
+    int ret = 0;
+    int rx, tx;
+    int total = 0;
+    ioasync_t *aio;
+    iohandler_t *ioh;
+    struct sockaddr_in rx_addr, tx_addr;
+    struct ioasync_test iot = { 0, 0 };
+    char msg[64];
+    char big[PACKET_MAX_PAYLOAD * 2];
+
+    aio = ioasync_create(1, IOASYNC_POLICY_FD_HASH, POLLER_BACKEND_EPOLL);
+    if (!aio)
+        return -1;
+
+    rx = udp_bind_loopback(&rx_addr);
+    tx = udp_bind_loopback(&tx_addr);
+
+    ioh = iohandler_udp_create(aio, rx, handle_ioasync_udp, NULL, &iot,
+                               IOHANDLER_DISPATCH_INLINE);
+    iohandler_udp_set_batch(ioh, 16);
+
+    /* too big for a slot: dropped, never delivered truncated */
+    memset(big, 'b', sizeof(big));
+    sendto(tx, big, sizeof(big), 0, (struct sockaddr *)&rx_addr,
+           sizeof(rx_addr));
+
+    memset(msg, 'u', sizeof(msg));
+    for (i = 0; i < IOASYNC_UDP_COUNT; i++)
+        sendto(tx, msg, sizeof(msg), 0, (struct sockaddr *)&rx_addr,
+               sizeof(rx_addr));
+    sleep(1);
+
+    if (iot.received != IOASYNC_UDP_COUNT ||
+        iot.len != IOASYNC_UDP_COUNT * sizeof(msg))
+        ret = -1;
+
+    for (i = 0; i < IOASYNC_UDP_COUNT; i++)
+        iohandler_sendto(ioh, (uint8_t *)msg, sizeof(msg),
+                         (struct sockaddr *)&tx_addr);
+    sleep(1);
+
+    while (recv(tx, msg, sizeof(msg), MSG_DONTWAIT) > 0)
+        total++;
+    if (total != IOASYNC_UDP_COUNT)
+        ret = -1;
+
+    printf("ioasync udp test %s, %d/%d datagrams.\n",
+           ret ? "failed" : "success", iot.received, total);
+    return ret;
+}
+
+#define IOASYNC_ACCEPT_COUNT   (128)
+
+struct accept_test {
+	int accepted;
+	int calls;
+};
+
+static void handle_accept_batch(void *priv, int *fds, int nr)
+{
+	int i;
+	struct accept_test *at = (struct accept_test *)priv;
+
+	for (i = 0; i < nr; i++)
+		close(fds[i]);
+	__atomic_add_fetch(&at->calls, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&at->accepted, nr, __ATOMIC_RELAXED);
+}
+
+int test_ioasync_accept(int argc, char **argv)
+{
+	int i;
+	int fd;
+	int ret = 0;
+	ioasync_t *aio;
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	struct accept_test at = { 0, 0 };
+	int clients[IOASYNC_ACCEPT_COUNT];
+
+	aio = ioasync_create(2, IOASYNC_POLICY_FD_HASH, POLLER_BACKEND_EPOLL);
+	if (!aio)
+		return -1;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	getsockname(fd, (struct sockaddr *)&addr, &len);
+
+	iohandler_accept_batch_create(aio, fd, handle_accept_batch, NULL, &at,
+				      IOASYNC_ACCEPT_COUNT * 2, IOHANDLER_ACCEPT_SPREAD);
+
+	for (i = 0; i < IOASYNC_ACCEPT_COUNT; i++) {
+		clients[i] = socket(AF_INET, SOCK_STREAM, 0);
+		connect(clients[i], (struct sockaddr *)&addr, sizeof(addr));
+	}
+
+	for (i = 0; i < 20 && __atomic_load_n(&at.accepted, __ATOMIC_RELAXED)
+	     != IOASYNC_ACCEPT_COUNT; i++)
+		usleep(100 * 1000);
+
+	if (at.accepted != IOASYNC_ACCEPT_COUNT)
+		ret = -1;
+
+	for (i = 0; i < IOASYNC_ACCEPT_COUNT; i++)
+		close(clients[i]);
+
+	printf("ioasync accept test %s, %d connections in %d calls.\n",
+	       ret ? "failed" : "success", at.accepted, at.calls);
+	return ret;
+}
+
+struct poller_stats_test {
+	struct poller *poller;
+	int fd;
+};
+
+static void handle_poller_stats(void *data, int events)
+{
+	char c;
+	struct poller_stats_test *pst = (struct poller_stats_test *)data;
+
+	if (read(pst->fd, &c, 1) == 1)
+		usleep(2 * 1000);
+}
+
+static void *poller_stats_thread(void *data)
+{
+	poller_loop((struct poller *)data);
+	return NULL;
+}
+
+int test_poller_stats(int argc, char **argv)
+{
+	int ret = 0;
+	int socks[2];
+	pthread_t thread;
+	struct poller_stats st;
+	struct poller_stats_test pst;
+
+	pst.poller = poller_create();
+	if (poller_init(pst.poller))
+		return -1;
+
+	socketpair(AF_UNIX, SOCK_STREAM, 0, socks);
+	pst.fd = socks[1];
+	poller_event_add(pst.poller, pst.fd, handle_poller_stats, &pst);
+	poller_event_enable(pst.poller, pst.fd, EV_READ);
+	pthread_create(&thread, NULL, poller_stats_thread, pst.poller);
+
+	write(socks[0], "s", 1);
+	usleep(100 * 1000);
+
+	poller_stats_snapshot(pst.poller, &st);
+	if (st.loops == 0 || st.callbacks < 2 || st.hooks_added != 2 ||
+	    st.num_fds != 2 || st.cb_max_fd != pst.fd ||
+	    st.cb_max_ns < 2 * 1000 * 1000 ||
+	    poller_stats_percentile(&st, 100) != st.cb_max_ns)
+		ret = -1;
+
+	poller_done(pst.poller);
+	pthread_join(thread, NULL);
+
+	printf("poller stats test %s, %llu loops, %llu callbacks, slowest %lluus.\n",
+	       ret ? "failed" : "success", (unsigned long long)st.loops,
+	       (unsigned long long)st.callbacks,
+	       (unsigned long long)st.cb_max_ns / 1000);
+	return ret;
+}
+
+#define MEMPOOL_TEST_THREADS   (4)
+#define MEMPOOL_TEST_BLOCKS    (1000)
+#define MEMPOOL_TEST_ARENA     (50000)
+
+static void *mempool_test_thread(void *data)
+{
+	int i, j;
+	mempool_t *pool = (mempool_t *)data;
+	int *blocks[MEMPOOL_TEST_BLOCKS];
+
+	for (j = 0; j < 50; j++) {
+		for (i = 0; i < MEMPOOL_TEST_BLOCKS; i++) {
+			blocks[i] = mempool_alloc(pool);
+			*blocks[i] = i;
+		}
+		for (i = 0; i < MEMPOOL_TEST_BLOCKS; i++) {
+			if (*blocks[i] != i)
+				return (void *)-1;
+			mempool_free(pool, blocks[i]);
+		}
+	}
+	return NULL;
+}
+
+int test_mempool(int argc, char **argv)
+{
+	int i, j;
+	int ret = 0;
+	void *res;
+	void **arena;
+	mempool_t *pool;
+	pthread_t threads[MEMPOOL_TEST_THREADS];
+	void *blocks[1024 + 1];
+
+	pool = mempool_create(64, 128, 0);
+	for (i = 0; i < MEMPOOL_TEST_THREADS; i++)
+		pthread_create(&threads[i], NULL, mempool_test_thread, pool);
+	for (i = 0; i < MEMPOOL_TEST_THREADS; i++) {
+		pthread_join(threads[i], &res);
+		if (res)
+			ret = -1;
+	}
+	mempool_release(pool);
+
+	/* a limited pool never hands out more than its initial count */
+	pool = mempool_create(64, 1024, 1);
+	for (i = 0; i < 1024; i++) {
+		blocks[i] = mempool_alloc(pool);
+		if (!blocks[i])
+			ret = -1;
+	}
+	if (mempool_alloc(pool))
+		ret = -1;
+	for (i = 0; i < 1024; i++)
+		mempool_free(pool, blocks[i]);
+
+	/* bulk calls report how far a limited pool could go */
+	if (mempool_alloc_bulk(pool, blocks, 1000) != 1000 ||
+	    mempool_alloc_bulk(pool, blocks + 1000, 25) != 24)
+		ret = -1;
+	mempool_free_bulk(pool, blocks, 1024);
+	if (mempool_alloc_bulk(pool, blocks, 1024) != 1024)
+		ret = -1;
+	mempool_free_bulk(pool, blocks, 1024);
+	mempool_release(pool);
+
+	/* arena pools: cache line aligned blocks, grown and emptied by slabs */
+	pool = mempool_create_flags(100, 16, 0, MEMPOOL_F_ARENA | MEMPOOL_F_THP);
+	arena = malloc(MEMPOOL_TEST_ARENA * sizeof(void *));
+	for (j = 0; j < 2; j++) {
+		for (i = 0; i < MEMPOOL_TEST_ARENA; i++) {
+			arena[i] = mempool_alloc(pool);
+			if (!arena[i] || ((uintptr_t)arena[i] & 63))
+				ret = -1;
+			else
+				memset(arena[i], i, 100);
+		}
+		for (i = 0; i < MEMPOOL_TEST_ARENA; i++)
+			mempool_free(pool, arena[i]);
+	}
+	free(arena);
+	mempool_release(pool);
+
+	pool = mempool_create_flags(64, 1024, 1, MEMPOOL_F_ARENA);
+	for (i = 0; i < 1024; i++) {
+		blocks[i] = mempool_alloc(pool);
+		if (!blocks[i])
+			ret = -1;
+	}
+	if (mempool_alloc(pool))
+		ret = -1;
+	for (i = 0; i < 1024; i++)
+		mempool_free(pool, blocks[i]);
+	mempool_release(pool);
+
+	printf("mempool test %s.\n", ret ? "failed" : "success");
+	return ret;
+}
+
+int test_mm_alloc(int argc, char **argv)
+{
+	int i;
+	int ret = 0;
+	int sizes[] = { 1, 17, 100, 1000, 4097, 65536, 65537, 1 << 20 };
+	uint8_t *p[ARRAY_SIZE(sizes)];
+	uint8_t *fixed;
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		p[i] = mm_alloc(sizes[i]);
+		if (!p[i]) {
+			ret = -1;
+			continue;
+		}
+		memset(p[i], i, sizes[i]);
+	}
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		if (p[i] && (p[i][0] != i || p[i][sizes[i] - 1] != i))
+			ret = -1;
+		mm_free(p[i]);
+	}
+
+	/* constant sizes resolve their class at compile time */
+	fixed = mm_alloc(200);
+	if (!fixed || size_to_index(200) != size_to_index(256))
+		ret = -1;
+	mm_free(fixed);
+
+	printf("mm_alloc test %s.\n", ret ? "failed" : "success");
+	return ret;
+}
+
+#define ATOMIC_TEST_THREADS	4
+#define ATOMIC_TEST_LOOPS	100000
+
+static atomic_t atomic_test_count = ATOMIC_INIT(0);
+static unsigned long atomic_test_bits;
+
+static void *atomic_test_thread(void *arg)
+{
+	int i;
+	int nr = (long)arg;
+
+	for (i = 0; i < ATOMIC_TEST_LOOPS; i++) {
+		atomic_inc(&atomic_test_count);
+		if (!test_and_set_bit(nr, &atomic_test_bits))
+			clear_bit_unlock(nr, &atomic_test_bits);
+	}
+	return NULL;
+}
+
+int test_atomic(int argc, char **argv)
+{
+	int i;
+	int ret = 0;
+	pthread_t threads[ATOMIC_TEST_THREADS];
+	atomic_t v = ATOMIC_INIT(1);
+
+	for (i = 0; i < ATOMIC_TEST_THREADS; i++)
+		pthread_create(&threads[i], NULL, atomic_test_thread, (void *)(long)i);
+	for (i = 0; i < ATOMIC_TEST_THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	if (atomic_get(&atomic_test_count) != ATOMIC_TEST_THREADS * ATOMIC_TEST_LOOPS)
+		ret = -1;
+	if (atomic_test_bits != 0)
+		ret = -1;
+	if (atomic_inc_return(&v) != 2 || atomic_dec_and_test(&v) ||
+			!atomic_dec_and_test(&v))
+		ret = -1;
+
+	printf("atomic test %s.\n", ret ? "failed" : "success");
+	return ret;
+}
+
+int test_pack_buf(int argc, char **argv)
+{
+	int i, len;
+	int ret = 0;
+	int total = 0;
+	int sizes[] = { 64, 256, 2000 };
+	int bad[] = { 256, 64 };
+	pack_buf_pool_t *pool;
+	pack_buf_t *pkb;
+	ioasync_t *aio;
+	iohandler_t *ioh;
+	int socks[2];
+	static uint8_t msg[100 * 1000], back[100 * 1000];
+
+	/* classes out of order would be picked wrong */
+	if (create_pack_buf_pool_sizes(bad, ARRAY_SIZE(bad), 16))
+		return -1;
+
+	pool = create_pack_buf_pool_sizes(sizes, ARRAY_SIZE(sizes), 16);
+	if (!pool)
+		return -1;
+
+	/* a small message takes the smallest class that fits */
+	pkb = pack_buf_alloc_size(pool, 40);
+	if (!pkb || pkb->size != 64 || pkb->next)
+		ret = -1;
+	pack_buf_free(pkb);
+
+	for (i = 0; i < (int)sizeof(msg); i++)
+		msg[i] = i * 7;
+
+	/* 5000 bytes: 2000 + 2000 + 1000, the tail rounded to its class */
+	pkb = pack_buf_alloc_chain(pool, 5000);
+	if (!pkb || pack_buf_copy_in(pkb, msg, 5000) != 5000 ||
+			pack_buf_chain_len(pkb) != 5000 || pkb->next->next->size != 2000)
+		ret = -1;
+	pack_buf_trim(pkb, 2100);
+	if (pack_buf_chain_len(pkb) != 2100 || pkb->next->next ||
+			pack_buf_copy_out(pkb, back, sizeof(back)) != 2100 ||
+			memcmp(msg, back, 2100))
+		ret = -1;
+	pack_buf_free(pkb);
+	free_pack_buf_pool(pool);
+
+	/* a message far above PACKET_MAX_PAYLOAD goes out as one chain */
+	aio = ioasync_create(1, IOASYNC_POLICY_FD_HASH, POLLER_BACKEND_EPOLL);
+	if (!aio)
+		return -1;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, socks) < 0) {
+		ioasync_release(aio);
+		return -1;
+	}
+	ioh = iohandler_create(aio, socks[1], NULL, NULL, NULL,
+			IOHANDLER_DISPATCH_DEFERRED);
+	if (!ioh) {
+		ioasync_release(aio);
+		close(socks[0]);
+		close(socks[1]);
+		return -1;
+	}
+	if (iohandler_send(ioh, msg, sizeof(msg)) ||
+			iohandler_send(ioh, msg, -1) != -EINVAL)
+		ret = -1;
+
+	for (i = 0; i < 100 && total < (int)sizeof(msg); i++) {
+		len = recv(socks[0], back + total, sizeof(back) - total, MSG_DONTWAIT);
+		if (len > 0)
+			total += len;
+		else
+			usleep(10 * 1000);
+	}
+	if (total != sizeof(msg) || memcmp(msg, back, sizeof(msg)))
+		ret = -1;
+
+	iohandler_shutdown(ioh);
+	ioasync_release(aio);
+	close(socks[0]);
+	close(socks[1]);
+
+	printf("pack_buf test %s, %d bytes.\n", ret ? "failed" : "success", total);
+	return ret;
+}
+
+#define WQ_POOL_TEST_THREADS	4
+#define WQ_POOL_TEST_WORKS	4096
+
+struct wq_pool_test {
+	struct work_struct work;
+	int runs;
+};
+
+static struct wq_pool_test wq_pool_works[WQ_POOL_TEST_WORKS];
+static struct workqueue_struct *wq_pool_wq;
+
+static void handle_wq_pool_work(struct work_struct *work)
+{
+	struct wq_pool_test *t = container_of(work, struct wq_pool_test, work);
+
+	__atomic_add_fetch(&t->runs, 1, __ATOMIC_RELAXED);
+}
+
+static void *wq_pool_test_thread(void *arg)
+{
+	int i;
+
+	for (i = (long)arg; i < WQ_POOL_TEST_WORKS; i += WQ_POOL_TEST_THREADS) {
+		INIT_WORK(&wq_pool_works[i].work, handle_wq_pool_work);
+		queue_work(wq_pool_wq, &wq_pool_works[i].work);
+	}
+	return NULL;
+}
+
+int test_workqueue_pools(int argc, char **argv)
+{
+	int i;
+	int ret = 0;
+	pthread_t threads[WQ_POOL_TEST_THREADS];
+
+	/* few active slots, most works go through delayed_works */
+	wq_pool_wq = alloc_workqueue(4, WQ_CPU_INTENSIVE);
+
+	for (i = 0; i < WQ_POOL_TEST_THREADS; i++)
+		pthread_create(&threads[i], NULL, wq_pool_test_thread, (void *)(long)i);
+	for (i = 0; i < WQ_POOL_TEST_THREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	/* returns once every work has run */
+	destroy_workqueue(wq_pool_wq);
+
+	for (i = 0; i < WQ_POOL_TEST_WORKS; i++) {
+		if (wq_pool_works[i].runs != 1)
+			ret = -1;
+	}
+
+	printf("workqueue pools test %s.\n", ret ? "failed" : "success");
+	return ret;
+}
+
+/* the normal lane backlog, under max_active so that none is delayed */
+#define WQ_LANE_TEST_WORKS	400
+/* WQ_LANE_STARVE of src/workqueue.c */
+#define WQ_LANE_TEST_STARVE	8
+
+static struct work_struct wq_lane_block, wq_lane_high, wq_lane_bg;
+static struct work_struct wq_lane_works[WQ_LANE_TEST_WORKS];
+static int wq_lane_blocked, wq_lane_release;
+static int wq_lane_started;
+static int wq_lane_high_seen = -1, wq_lane_bg_seen = -1;
+
+static void handle_wq_lane_block(struct work_struct *work)
+{
+	__atomic_store_n(&wq_lane_blocked, 1, __ATOMIC_SEQ_CST);
+	while (!__atomic_load_n(&wq_lane_release, __ATOMIC_SEQ_CST))
+		usleep(1000);
+}
+
+static void handle_wq_lane_normal(struct work_struct *work)
+{
+	__atomic_add_fetch(&wq_lane_started, 1, __ATOMIC_SEQ_CST);
+	usleep(200);
+}
+
+static void handle_wq_lane_high(struct work_struct *work)
+{
+	__atomic_store_n(&wq_lane_high_seen,
+			__atomic_load_n(&wq_lane_started, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
+
+static void handle_wq_lane_bg(struct work_struct *work)
+{
+	__atomic_store_n(&wq_lane_bg_seen,
+			__atomic_load_n(&wq_lane_started, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
+
+int test_workqueue_lanes(int argc, char **argv)
+{
+	int i;
+	int ret = 0;
+	int pools, depth_normal, depth_bg, high_early;
+	struct workqueue_struct *normal, *bg, *high;
+
+	/* one pool per cpu, see init_workqueues() */
+	pools = sysconf(_SC_NPROCESSORS_ONLN);
+	if (pools < 1)
+		pools = 1;
+	if (pools > 64)
+		pools = 64;
+
+	normal = alloc_workqueue(WQ_MAX_ACTIVE, 0);
+	bg = alloc_workqueue(WQ_MAX_ACTIVE, WQ_BACKGROUND);
+	high = alloc_workqueue(1, WQ_HIGHPRI);
+
+	/* hold the worker of our pool, everything below waits behind it */
+	INIT_WORK(&wq_lane_block, handle_wq_lane_block);
+	queue_work(normal, &wq_lane_block);
+	while (!__atomic_load_n(&wq_lane_blocked, __ATOMIC_SEQ_CST))
+		usleep(1000);
+
+	for (i = 0; i < WQ_LANE_TEST_WORKS; i++) {
+		INIT_WORK(&wq_lane_works[i], handle_wq_lane_normal);
+		queue_work(normal, &wq_lane_works[i]);
+	}
+	INIT_WORK(&wq_lane_bg, handle_wq_lane_bg);
+	queue_work(bg, &wq_lane_bg);
+
+	depth_normal = workqueue_lane_depth(WQ_LANE_NORMAL);
+	depth_bg = workqueue_lane_depth(WQ_LANE_BACKGROUND);
+
+	/* the high lane gets a worker of its own, right away */
+	INIT_WORK(&wq_lane_high, handle_wq_lane_high);
+	queue_work(high, &wq_lane_high);
+	usleep(20 * 1000);
+	high_early = __atomic_load_n(&wq_lane_high_seen, __ATOMIC_SEQ_CST) >= 0;
+
+	__atomic_store_n(&wq_lane_release, 1, __ATOMIC_SEQ_CST);
+
+	destroy_workqueue(high);
+	destroy_workqueue(bg);
+	destroy_workqueue(normal);
+
+	if (depth_normal <= 0 || depth_bg != 1)
+		ret = -1;
+	if (!high_early || wq_lane_high_seen >= WQ_LANE_TEST_WORKS)
+		ret = -1;
+	/* a pool picks the waiting background work within
+	 * WQ_LANE_STARVE normal ones, stolen works run on the siblings */
+	if (wq_lane_bg_seen < 0 ||
+	    wq_lane_bg_seen > (WQ_LANE_TEST_STARVE + 1) * pools ||
+	    wq_lane_bg_seen >= WQ_LANE_TEST_WORKS)
+		ret = -1;
+	if (wq_lane_started != WQ_LANE_TEST_WORKS)
+		ret = -1;
+	for (i = 0; i < WQ_NR_LANES; i++) {
+		if (workqueue_lane_depth(i) != 0)
+			ret = -1;
+	}
+
+	printf("workqueue lanes test %s, depth %d/%d under load, high ran after "
+			"%d, background after %d of %d normal works.\n",
+			ret ? "failed" : "success", depth_normal, depth_bg,
+			wq_lane_high_seen, wq_lane_bg_seen, WQ_LANE_TEST_WORKS);
+	return ret;
+}
+
+static void *placement_test_thread(void *arg)
+{
+	pthread_barrier_t *barrier = arg;
+
+	pthread_barrier_wait(barrier);	/* placed */
+	pthread_barrier_wait(barrier);	/* checked */
+	return NULL;
+}
+
+int test_placement(int argc, char **argv)
+{
+	int ret = 0;
+	pthread_t thread;
+	pthread_barrier_t barrier;
+	cpu_set_t set;
+	char name[THREAD_NAME_LEN];
+
+	if (thread_placement_set(THREAD_CLASS_POLLER, "3-1", 0) != -EINVAL ||
+			thread_placement_set(THREAD_CLASS_POLLER, "0,x", 0) != -EINVAL ||
+			thread_placement_set(THREAD_CLASS_MAX, NULL, 0) != -EINVAL)
+		ret = -1;
+
+	/* every poller on cpu 0, which always exists */
+	if (thread_placement_set(THREAD_CLASS_POLLER, "0", 0))
+		ret = -1;
+
+	pthread_barrier_init(&barrier, NULL, 2);
+	pthread_create(&thread, NULL, placement_test_thread, &barrier);
+
+	if (thread_place(thread, THREAD_CLASS_POLLER, 5, "placement/test/long"))
+		ret = -1;
+	pthread_barrier_wait(&barrier);
+
+	if (pthread_getaffinity_np(thread, sizeof(set), &set) ||
+			CPU_COUNT(&set) != 1 || !CPU_ISSET(0, &set))
+		ret = -1;
+	if (pthread_getname_np(thread, name, sizeof(name)) ||
+			strcmp(name, "placement/test/"))
+		ret = -1;
+
+	pthread_barrier_wait(&barrier);
+	pthread_join(thread, NULL);
+	pthread_barrier_destroy(&barrier);
+
+	thread_placement_set(THREAD_CLASS_POLLER, NULL, 0);
+
+	printf("placement test %s.\n", ret ? "failed" : "success");
+	return ret;
+}
+
+#define WQ_MANY_TEST_WORKS	256
+
+static struct wq_pool_test wq_many_works[WQ_MANY_TEST_WORKS];
+
+int test_workqueue_many(int argc, char **argv)
+{
+	int i, queued;
+	int ret = 0;
+	struct workqueue_struct *wq;
+	/* the first work once more at the end, already pending by then */
+	struct work_struct *works[WQ_MANY_TEST_WORKS + 1];
+	DECLARE_BITMAP(pending, WQ_MANY_TEST_WORKS + 1);
+
+	/* most of the batch goes through delayed_works */
+	wq = alloc_workqueue(8, WQ_CPU_INTENSIVE);
+
+	for (i = 0; i < WQ_MANY_TEST_WORKS; i++) {
+		INIT_WORK(&wq_many_works[i].work, handle_wq_pool_work);
+		works[i] = &wq_many_works[i].work;
+	}
+	works[WQ_MANY_TEST_WORKS] = works[0];
+
+	queued = queue_work_many(wq, works, WQ_MANY_TEST_WORKS + 1, pending);
+	if (queued != WQ_MANY_TEST_WORKS)
+		ret = -1;
+	for (i = 0; i <= WQ_MANY_TEST_WORKS; i++) {
+		if (!!test_bit(i, pending) != (i == WQ_MANY_TEST_WORKS))
+			ret = -1;
+	}
+
+	destroy_workqueue(wq);
+
+	for (i = 0; i < WQ_MANY_TEST_WORKS; i++) {
+		if (wq_many_works[i].runs != 1)
+			ret = -1;
+	}
+
+	printf("workqueue many test %s, %d/%d queued.\n", ret ? "failed" : "success",
+			queued, WQ_MANY_TEST_WORKS + 1);
+	return ret;
+}
+
+static int wq_stats_release;
+
+static void handle_wq_stats_work(struct work_struct *work)
+{
+	usleep(10 * 1000);
+	while (!__atomic_load_n(&wq_stats_release, __ATOMIC_ACQUIRE))
+		usleep(1000);
+}
+
+int test_workqueue_stats(int argc, char **argv)
+{
+	int i;
+	int ret = 0;
+	struct workqueue_struct *wq;
+	struct work_struct works[2];
+	struct workqueue_stats st;
+
+	wq = alloc_workqueue(1, 0);
+	for (i = 0; i < 2; i++) {
+		INIT_WORK(&works[i], handle_wq_stats_work);
+		queue_work(wq, &works[i]);
+	}
+
+	/* the first work runs, the second waits for max_active */
+	usleep(5 * 1000);
+	workqueue_stats_snapshot(wq, &st);
+	if (st.queued != 2 || st.nr_delayed != 1 || st.nr_busy != 1 ||
+			st.longest_func != handle_wq_stats_work || !st.longest_ns)
+		ret = -1;
+
+	__atomic_store_n(&wq_stats_release, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < 100 && st.done != 2; i++) {
+		usleep(10 * 1000);
+		workqueue_stats_snapshot(wq, &st);
+	}
+
+	if (st.done != 2 || st.nr_active || st.nr_busy ||
+			st.exec_max_func != handle_wq_stats_work ||
+			st.exec_max_ns < 10 * 1000000ULL ||
+			workqueue_stats_percentile(st.wait_hist, st.wait_max_ns, 100) <
+			10 * 1000000ULL)
+		ret = -1;
+
+	printf("workqueue stats test %s, wait max %lluus, exec max %lluus.\n",
+			ret ? "failed" : "success",
+			(unsigned long long)st.wait_max_ns / 1000,
+			(unsigned long long)st.exec_max_ns / 1000);
+
+	workqueue_stats_reset(wq);
+	workqueue_stats_snapshot(wq, &st);
+	if (st.queued || st.done || st.exec_max_ns)
+		ret = -1;
+
+	destroy_workqueue(wq);
+	return ret;
+}